@@ -25,7 +25,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
-#include <sys/socket.h>
+#include <string.h>
 #include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -36,15 +36,15 @@
 #include "wakefield-compositor.h"
 #include "wakefield-private.h"
 #include "xdg-shell-server-protocol.h"
+#include "server-decoration-server-protocol.h"
+#include "fifo-v1-server-protocol.h"
+#include "commit-timing-v1-server-protocol.h"
+#include "viewporter-server-protocol.h"
+#include "relative-pointer-unstable-v1-server-protocol.h"
+#include "pointer-constraints-unstable-v1-server-protocol.h"
 
 #include <xkbcommon/xkbcommon.h>
 
-#if defined(GDK_WINDOWING_X11)
-#include <xkbcommon/xkbcommon-x11.h>
-#include <gdk/gdkx.h>
-#include <X11/Xlib-xcb.h>
-#endif
-
 struct WakefieldPointer
 {
   struct wl_list resource_list;
@@ -60,8 +60,10 @@ struct WakefieldPointer
      that we don't forward enter/leave events during an implicit grab */
   struct wl_resource *current_gdk_surface;
 
-  WakefieldSurface *cursor_surface;
-  gulong cursor_surface_commit_listener;
+  struct wl_resource *cursor_surface;
+  GdkWindow *cursor_window;
+  struct wl_listener cursor_surface_commit_listener;
+  struct wl_listener cursor_surface_destroy_listener;
   int hot_x;
   int hot_y;
 
@@ -73,17 +75,87 @@ struct WakefieldPointer
   struct wl_resource *grab_popup_surface;
   guint32 grab_time;
   guint32 grab_serial;
+
+  /* The pointer frame we are collecting motion and axis events into.
+     It goes out once GDK has handled the events it has queued, or when
+     the socket of frame_resource's client drains, if it is full. */
+  struct wl_resource *frame_resource;
+  guint frame_idle_id;
+  gboolean frame_motion;
+  guint32 frame_motion_time;
+  wl_fixed_t frame_x;
+  wl_fixed_t frame_y;
+  guint32 frame_axis_time;
+  gboolean frame_has_axis_source;
+  enum wl_pointer_axis_source frame_axis_source;
+  wl_fixed_t frame_axis[2];
+  int frame_axis_discrete[2];
+  gboolean frame_axis_stop[2];
+  gboolean frame_relative;
+  guint64 frame_relative_time;
+  double frame_relative_delta[2];
+  double frame_relative_delta_unaccel[2];
+
+  /* Surface coordinates of the last event we forwarded */
+  double x;
+  double y;
+
+  struct wl_list relative_resource_list;
+  /* The deltas come from XI2 raw events, otherwise we work them out
+     from the root coordinates of the motion events */
+  gboolean relative_raw;
+  gboolean has_last_root;
+  double last_x_root;
+  double last_y_root;
+
+  /* Locked and confined pointers. At most one is active; while it is
+     we hold a grab on the pointer, and warp it back whenever it leaves
+     the area. */
+  struct wl_list constraints;
+  struct WakefieldPointerConstraint *active_constraint;
+  GdkDevice *constraint_device;
+  GdkScreen *lock_screen;
+  int lock_x_root;
+  int lock_y_root;
+};
+
+struct WakefieldPointerConstraint
+{
+  struct wl_resource *resource;
+  WakefieldCompositor *compositor;
+  struct wl_list link;
+
+  struct wl_resource *surface;
+  struct wl_listener surface_destroy_listener;
+  struct wl_listener surface_commit_listener;
+
+  gboolean lock;
+  enum zwp_pointer_constraints_v1_lifetime lifetime;
+  /* NULL means the whole surface */
+  cairo_region_t *region;
+  cairo_region_t *pending_region;
+  gboolean has_pending_region;
+  gboolean has_hint;
+  double hint_x;
+  double hint_y;
+  gboolean has_pending_hint;
+  double pending_hint_x;
+  double pending_hint_y;
+
+  gboolean active;
+  /* A oneshot constraint never comes back once deactivated */
+  gboolean defunct;
 };
 
 struct WakefieldKeyboard
 {
+  WakefieldCompositor *compositor;
   struct wl_list resource_list;
   struct wl_resource *focus;
-  struct xkb_context *context;
+  /* Owned by the server, NULL until it has loaded it */
   struct xkb_keymap *keymap;
   int keymap_fd;
   gsize keymap_size;
-  gboolean has_x11_xkb;
   xkb_mod_index_t shift_mod;
   xkb_mod_index_t caps_mod;
   xkb_mod_index_t ctrl_mod;
@@ -105,6 +177,11 @@ struct WakefieldKeyboard
 struct WakefieldOutput
 {
   struct wl_list resource_list;
+
+  /* What we last told the clients */
+  int width;
+  int height;
+  int scale;
 };
 
 struct WakefieldSeat
@@ -122,7 +199,7 @@ struct WakefieldRegion
 struct _WakefieldCompositorPrivate
 {
   GdkWindow *event_window;
-  GSource *wayland_source;
+  WakefieldServer *server;
   struct wl_display *wl_display;
 
   struct wl_list surfaces;
@@ -132,9 +209,32 @@ struct _WakefieldCompositorPrivate
   struct WakefieldSeat seat;
   struct WakefieldOutput output;
   struct WakefieldDataDevice *data_device;
+
+  guint commit_queue_tick_id;
+
+  gboolean low_latency;
+  guint frame_callback_source_id;
+  gint64 frame_callback_deadline;
+  gint64 next_paint_time;
+
+  guint ping_source_id;
 };
 typedef struct _WakefieldCompositorPrivate WakefieldCompositorPrivate;
 
+enum {
+  PROP_0,
+  PROP_SERVER,
+};
+
+enum {
+  CLIENT_NOT_RESPONDING,
+  CLIENT_RESPONDING,
+
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL];
+
 G_DEFINE_TYPE_WITH_PRIVATE (WakefieldCompositor, wakefield_compositor, GTK_TYPE_WIDGET);
 
 #define wl_resource_for_each_reverse(resource, list)                   \
@@ -143,8 +243,14 @@ G_DEFINE_TYPE_WITH_PRIVATE (WakefieldCompositor, wakefield_compositor, GTK_TYPE_
 	     resource = wl_resource_from_link(wl_resource_get_link(resource)->prev))
 
 static void
-unset_cursor_surface (struct WakefieldPointer *pointer,
-                      WakefieldSurface *cursor_surface);
+unset_cursor_surface (struct WakefieldPointer *pointer);
+static void
+flush_input (WakefieldCompositor *compositor,
+             struct wl_resource  *resource);
+static void
+deactivate_pointer_constraint (struct WakefieldPointerConstraint *constraint);
+static void
+maybe_activate_pointer_constraint (WakefieldCompositor *compositor);
 
 static void
 wakefield_compositor_realize (GtkWidget *widget)
@@ -186,6 +292,8 @@ wakefield_compositor_realize (GtkWidget *widget)
     {
       wakefield_xdg_surface_realize (xdg_surface_resource, priv->event_window);
     }
+
+  wakefield_xdg_popup_prepare (gtk_widget_get_screen (widget));
 }
 
 static void
@@ -195,6 +303,10 @@ wakefield_compositor_unrealize (GtkWidget *widget)
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *xdg_surface_resource;
 
+  /* Its grab is on one of the windows going away */
+  if (priv->seat.pointer.active_constraint)
+    deactivate_pointer_constraint (priv->seat.pointer.active_constraint);
+
   wl_resource_for_each (xdg_surface_resource, &priv->xdg_surfaces)
     {
       wakefield_xdg_surface_unrealize (xdg_surface_resource);
@@ -227,52 +339,291 @@ wakefield_compositor_unmap (GtkWidget *widget)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *surface_resource;
 
   gdk_window_hide (priv->event_window);
 
   GTK_WIDGET_CLASS (wakefield_compositor_parent_class)->unmap (widget);
+
+  /* Nothing is presented anymore, so nothing is left to wait for */
+  if (priv->commit_queue_tick_id != 0)
+    {
+      gtk_widget_remove_tick_callback (widget, priv->commit_queue_tick_id);
+      priv->commit_queue_tick_id = 0;
+    }
+
+  wl_resource_for_each (surface_resource, &priv->surfaces)
+    wakefield_surface_process_commit_queue (surface_resource, G_MAXINT64, G_MAXINT64);
+}
+
+static gint64
+predict_presentation_time (GdkFrameClock *frame_clock)
+{
+  gint64 frame_time, refresh_interval, presentation_time;
+
+  frame_time = gdk_frame_clock_get_frame_time (frame_clock);
+  gdk_frame_clock_get_refresh_info (frame_clock, frame_time,
+                                    &refresh_interval, &presentation_time);
+  if (presentation_time == 0)
+    presentation_time = frame_time + refresh_interval;
+
+  return presentation_time;
+}
+
+/* Returns the frame that content committed now would be shown in, and
+   when that is expected to hit the screen. If we're not presenting at
+   all both are G_MAXINT64, so that nothing waits on them. */
+gboolean
+wakefield_compositor_get_frame_timings (WakefieldCompositor *compositor,
+                                        gint64 *presented_frame,
+                                        gint64 *presentation_time)
+{
+  GdkFrameClock *frame_clock = NULL;
+
+  if (gtk_widget_get_mapped (GTK_WIDGET (compositor)))
+    frame_clock = gtk_widget_get_frame_clock (GTK_WIDGET (compositor));
+
+  if (frame_clock == NULL)
+    {
+      *presented_frame = G_MAXINT64;
+      *presentation_time = G_MAXINT64;
+      return FALSE;
+    }
+
+  /* We're called from the wayland source, between frames */
+  *presented_frame = gdk_frame_clock_get_frame_counter (frame_clock) + 1;
+  *presentation_time = predict_presentation_time (frame_clock);
+  return TRUE;
+}
+
+static gboolean
+commit_queue_tick (GtkWidget     *widget,
+                   GdkFrameClock *frame_clock,
+                   gpointer       user_data)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *surface_resource;
+  gint64 presented_frame, presentation_time;
+  gboolean queued = FALSE;
+
+  /* Anything applied during the update phase is painted in this frame */
+  presented_frame = gdk_frame_clock_get_frame_counter (frame_clock);
+  presentation_time = predict_presentation_time (frame_clock);
+
+  wl_resource_for_each (surface_resource, &priv->surfaces)
+    {
+      if (wakefield_surface_process_commit_queue (surface_resource,
+                                                  presented_frame,
+                                                  presentation_time))
+        queued = TRUE;
+    }
+
+  if (queued)
+    return G_SOURCE_CONTINUE;
+
+  priv->commit_queue_tick_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+void
+wakefield_compositor_schedule_commit_queue (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (priv->commit_queue_tick_id == 0)
+    priv->commit_queue_tick_id =
+      gtk_widget_add_tick_callback (GTK_WIDGET (compositor),
+                                    commit_queue_tick, NULL, NULL);
+}
+
+gint64
+wakefield_compositor_get_refresh_interval (WakefieldCompositor *compositor)
+{
+  GdkFrameClock *frame_clock = gtk_widget_get_frame_clock (GTK_WIDGET (compositor));
+  gint64 refresh_interval = G_USEC_PER_SEC / 60;
+  gint64 presentation_time;
+
+  if (frame_clock)
+    gdk_frame_clock_get_refresh_info (frame_clock,
+                                      gdk_frame_clock_get_frame_time (frame_clock),
+                                      &refresh_interval, &presentation_time);
+
+  return refresh_interval;
 }
 
+static gboolean dispatch_frame_callbacks (gpointer user_data);
+
 static void
-refresh_output (WakefieldCompositor *compositor,
-                struct wl_resource *output)
+arm_frame_callbacks (WakefieldCompositor *compositor,
+                     gint64 deadline)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  gint64 delay;
+
+  if (priv->frame_callback_source_id != 0)
+    {
+      if (deadline >= priv->frame_callback_deadline)
+        return;
+      g_source_remove (priv->frame_callback_source_id);
+    }
+
+  delay = MAX (deadline - g_get_monotonic_time (), 0);
+  priv->frame_callback_deadline = deadline;
+  priv->frame_callback_source_id =
+    g_timeout_add_full (G_PRIORITY_HIGH, delay / 1000,
+                        dispatch_frame_callbacks, compositor, NULL);
+}
+
+static gboolean
+dispatch_frame_callbacks (gpointer user_data)
+{
+  WakefieldCompositor *compositor = user_data;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *surface_resource;
+  gint64 now = g_get_monotonic_time ();
+
+  priv->frame_callback_source_id = 0;
+
+  wl_resource_for_each (surface_resource, &priv->surfaces)
+    {
+      gint64 lead = wakefield_surface_get_frame_callback_lead (surface_resource);
+      gint64 deadline;
+
+      if (lead < 0)
+        continue;
+
+      /* The timeout only has ms granularity, so don't spin on the rest */
+      deadline = priv->next_paint_time - lead;
+      if (deadline - now < 1000)
+        {
+          wakefield_surface_send_frame_callbacks (surface_resource);
+          flush_input (compositor, surface_resource);
+        }
+      else
+        arm_frame_callbacks (compositor, deadline);
+    }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Called when a surface with frame callbacks was painted in low latency
+   mode; they are sent lead usecs before the next paint is due */
+void
+wakefield_compositor_schedule_frame_callbacks (WakefieldCompositor *compositor,
+                                               gint64 lead)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  GdkFrameClock *frame_clock = gtk_widget_get_frame_clock (GTK_WIDGET (compositor));
+  gint64 frame_time;
+
+  if (frame_clock)
+    frame_time = gdk_frame_clock_get_frame_time (frame_clock);
+  else
+    frame_time = g_get_monotonic_time ();
+
+  priv->next_paint_time = frame_time + wakefield_compositor_get_refresh_interval (compositor);
+
+  arm_frame_callbacks (compositor, priv->next_paint_time - lead);
+}
+
+void
+wakefield_compositor_set_low_latency (WakefieldCompositor *compositor,
+                                      gboolean low_latency)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *surface_resource;
+
+  low_latency = !!low_latency;
+  if (priv->low_latency == low_latency)
+    return;
+
+  priv->low_latency = low_latency;
+
+  if (!low_latency)
+    {
+      if (priv->frame_callback_source_id != 0)
+        {
+          g_source_remove (priv->frame_callback_source_id);
+          priv->frame_callback_source_id = 0;
+        }
+
+      /* Don't strand callbacks we were holding back */
+      wl_resource_for_each (surface_resource, &priv->surfaces)
+        {
+          if (wakefield_surface_get_frame_callback_lead (surface_resource) >= 0)
+            wakefield_surface_send_frame_callbacks (surface_resource);
+        }
+    }
+}
+
+gboolean
+wakefield_compositor_get_low_latency (WakefieldCompositor *compositor)
 {
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->low_latency;
+}
+
+/* Returns TRUE if the output mode changed since we last sent it */
+static gboolean
+update_output_mode (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldOutput *output = &priv->output;
   GtkAllocation allocation;
+  int scale;
 
   gtk_widget_get_allocation (GTK_WIDGET (compositor), &allocation);
+  scale = gtk_widget_get_scale_factor (GTK_WIDGET (compositor));
 
-  wl_output_send_scale (output, gtk_widget_get_scale_factor (GTK_WIDGET (compositor)));
+  if (output->width == allocation.width &&
+      output->height == allocation.height &&
+      output->scale == scale)
+    return FALSE;
+
+  output->width = allocation.width;
+  output->height = allocation.height;
+  output->scale = scale;
+
+  return TRUE;
+}
+
+/* The buffer scale clients should render at. GTK 3 only has integer
+   scale factors, so that is all we can tell them. */
+int
+wakefield_compositor_get_preferred_scale (WakefieldCompositor *compositor)
+{
+  return gtk_widget_get_scale_factor (GTK_WIDGET (compositor));
+}
+
+static void
+refresh_output (WakefieldCompositor *compositor,
+                struct wl_resource *output)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  wl_output_send_scale (output, priv->output.scale);
   wl_output_send_mode (output,
                        WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
-                       allocation.width,
-                       allocation.height,
+                       priv->output.width,
+                       priv->output.height,
                        60);
   wl_output_send_done (output);
 }
 
-static void
-send_xdg_configure_request (WakefieldCompositor *compositor,
-                            struct wl_resource *xdg_surface)
+void
+wakefield_compositor_send_xdg_configure (WakefieldCompositor *compositor,
+                                         struct wl_resource *xdg_surface)
 {
-  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   GtkAllocation allocation;
-  struct wl_array states;
-  uint32_t serial = wl_display_next_serial (priv->wl_display);
-  uint32_t *s;
+  gboolean activated;
 
   gtk_widget_get_allocation (GTK_WIDGET (compositor), &allocation);
+  activated = (gtk_widget_get_state_flags (GTK_WIDGET (compositor)) & GTK_STATE_FLAG_BACKDROP) == 0;
 
-  wl_array_init(&states);
-  s = wl_array_add(&states, sizeof *s);
-  *s = XDG_SURFACE_STATE_FULLSCREEN;
-  if ((gtk_widget_get_state_flags (GTK_WIDGET (compositor)) & GTK_STATE_FLAG_BACKDROP) == 0)
-    {
-      s = wl_array_add(&states, sizeof *s);
-      *s = XDG_SURFACE_STATE_ACTIVATED;
-    }
-  xdg_surface_send_configure (xdg_surface, allocation.width, allocation.height,
-                              &states, serial);
-  wl_array_release(&states);
+  wakefield_xdg_surface_configure (xdg_surface, allocation.width, allocation.height,
+                                   activated);
 }
 
 static void
@@ -292,14 +643,17 @@ wakefield_compositor_size_allocate (GtkWidget *widget,
                             allocation->width,
                             allocation->height);
 
-  wl_resource_for_each (output, &priv->output.resource_list)
+  if (update_output_mode (compositor))
     {
-      refresh_output (compositor, output);
+      wl_resource_for_each (output, &priv->output.resource_list)
+        {
+          refresh_output (compositor, output);
+        }
     }
 
   wl_resource_for_each (xdg_surface_resource, &priv->xdg_surfaces)
     {
-      send_xdg_configure_request (compositor, xdg_surface_resource);
+      wakefield_compositor_send_xdg_configure (compositor, xdg_surface_resource);
     }
 }
 
@@ -315,7 +669,7 @@ wakefield_compositor_state_flags_changed (GtkWidget        *widget,
 
   wl_resource_for_each (xdg_surface_resource, &priv->xdg_surfaces)
     {
-      send_xdg_configure_request (compositor, xdg_surface_resource);
+      wakefield_compositor_send_xdg_configure (compositor, xdg_surface_resource);
     }
 }
 
@@ -325,7 +679,7 @@ wakefield_compositor_draw (GtkWidget *widget,
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  struct wl_resource *xdg_surface_resource;
+  struct wl_resource *xdg_surface_resource, *xdg_popup_resource;
 
   wl_resource_for_each (xdg_surface_resource, &priv->xdg_surfaces)
     {
@@ -334,6 +688,25 @@ wakefield_compositor_draw (GtkWidget *widget,
         wakefield_surface_draw (surface_resource, cr);
     }
 
+  /* Overlay popups go on top, the newest last */
+  wl_resource_for_each_reverse (xdg_popup_resource, &priv->xdg_popups)
+    {
+      struct wl_resource *surface_resource;
+      int x, y, width, height;
+
+      surface_resource = wakefield_xdg_popup_get_overlay (xdg_popup_resource,
+                                                          &x, &y, &width, &height);
+      if (surface_resource == NULL || !wakefield_surface_is_mapped (surface_resource))
+        continue;
+
+      cairo_save (cr);
+      cairo_translate (cr, x, y);
+      wakefield_surface_draw (surface_resource, cr);
+      cairo_restore (cr);
+    }
+
+  wakefield_data_device_draw_drag_icon (priv->data_device, cr);
+
   return TRUE;
 }
 
@@ -341,18 +714,175 @@ static struct wl_resource *
 wakefield_compositor_get_pointer_for_client (WakefieldCompositor *compositor,
                                              struct wl_client *client)
 {
-  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-
-  return wl_resource_find_for_client (&priv->seat.pointer.resource_list, client);
+  return wakefield_client_get_binding (client, WAKEFIELD_CLIENT_BINDING_POINTER);
 }
 
 static struct wl_resource *
 wakefield_compositor_get_keyboard_for_client (WakefieldCompositor *compositor,
                                               struct wl_client *client)
+{
+  return wakefield_client_get_binding (client, WAKEFIELD_CLIENT_BINDING_KEYBOARD);
+}
+
+/* In low latency mode input goes out right away, instead of waiting
+   for the wayland source to flush all clients on the next iteration */
+static void
+flush_input (WakefieldCompositor *compositor,
+             struct wl_resource  *resource)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  if (priv->low_latency && resource != NULL)
+    wl_client_flush (wl_resource_get_client (resource));
+}
+
+static void
+clear_pointer_frame (struct WakefieldPointer *pointer)
+{
+  pointer->frame_resource = NULL;
+  pointer->frame_motion = FALSE;
+  pointer->frame_has_axis_source = FALSE;
+  memset (pointer->frame_axis, 0, sizeof (pointer->frame_axis));
+  memset (pointer->frame_axis_discrete, 0, sizeof (pointer->frame_axis_discrete));
+  memset (pointer->frame_axis_stop, 0, sizeof (pointer->frame_axis_stop));
+  pointer->frame_relative = FALSE;
+  memset (pointer->frame_relative_delta, 0, sizeof (pointer->frame_relative_delta));
+  memset (pointer->frame_relative_delta_unaccel, 0, sizeof (pointer->frame_relative_delta_unaccel));
+}
+
+static void
+send_frame_event (struct wl_resource *pointer_resource)
+{
+  if (wl_resource_get_version (pointer_resource) >= WL_POINTER_FRAME_SINCE_VERSION)
+    wl_pointer_send_frame (pointer_resource);
+}
+
+static void
+send_pointer_frame (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  struct wl_resource *pointer_resource = pointer->frame_resource;
+  gboolean has_frames;
+  int axis;
+
+  if (pointer_resource == NULL)
+    return;
+
+  has_frames = wl_resource_get_version (pointer_resource) >= WL_POINTER_FRAME_SINCE_VERSION;
+
+  if (pointer->frame_motion)
+    wl_pointer_send_motion (pointer_resource,
+                            pointer->frame_motion_time,
+                            pointer->frame_x,
+                            pointer->frame_y);
+
+  if (pointer->frame_relative)
+    {
+      struct wl_client *client = wl_resource_get_client (pointer_resource);
+      struct wl_resource *relative_resource;
+
+      wl_resource_for_each (relative_resource, &pointer->relative_resource_list)
+        {
+          if (wl_resource_get_client (relative_resource) != client)
+            continue;
+
+          zwp_relative_pointer_v1_send_relative_motion (relative_resource,
+                                                        pointer->frame_relative_time >> 32,
+                                                        pointer->frame_relative_time & 0xffffffff,
+                                                        wl_fixed_from_double (pointer->frame_relative_delta[0]),
+                                                        wl_fixed_from_double (pointer->frame_relative_delta[1]),
+                                                        wl_fixed_from_double (pointer->frame_relative_delta_unaccel[0]),
+                                                        wl_fixed_from_double (pointer->frame_relative_delta_unaccel[1]));
+        }
+    }
+
+  if (has_frames && pointer->frame_has_axis_source &&
+      (pointer->frame_axis[0] != 0 || pointer->frame_axis[1] != 0 ||
+       pointer->frame_axis_stop[0] || pointer->frame_axis_stop[1]))
+    wl_pointer_send_axis_source (pointer_resource, pointer->frame_axis_source);
+
+  for (axis = 0; axis < 2; axis++)
+    {
+      if (pointer->frame_axis[axis] != 0)
+        {
+          if (has_frames && pointer->frame_axis_discrete[axis] != 0)
+            wl_pointer_send_axis_discrete (pointer_resource, axis,
+                                           pointer->frame_axis_discrete[axis]);
+          wl_pointer_send_axis (pointer_resource,
+                                pointer->frame_axis_time,
+                                axis,
+                                pointer->frame_axis[axis]);
+        }
+
+      if (has_frames && pointer->frame_axis_stop[axis])
+        wl_pointer_send_axis_stop (pointer_resource, pointer->frame_axis_time, axis);
+    }
+
+  send_frame_event (pointer_resource);
+  flush_input (compositor, pointer_resource);
+
+  clear_pointer_frame (pointer);
+}
+
+static gboolean
+pointer_frame_idle (gpointer user_data)
+{
+  WakefieldCompositor *compositor = user_data;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+
+  pointer->frame_idle_id = 0;
+
+  /* A client that doesn't read its socket gets the frame, with all the
+     motion and scrolling folded into it, once it catches up */
+  if (pointer->frame_resource &&
+      !wakefield_client_is_backed_up (wl_resource_get_client (pointer->frame_resource)))
+    send_pointer_frame (compositor);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Motion and axis events of one go at the GDK event queue end up in
+   the same frame. The idle runs below the GDK event source, so only
+   once the queue is empty. */
+static void
+begin_pointer_frame (WakefieldCompositor *compositor,
+                     struct wl_resource  *pointer_resource)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+
+  if (pointer->frame_resource != pointer_resource)
+    send_pointer_frame (compositor);
+
+  pointer->frame_resource = pointer_resource;
+
+  if (pointer->frame_idle_id == 0)
+    pointer->frame_idle_id = g_idle_add_full (GDK_PRIORITY_EVENTS + 1,
+                                              pointer_frame_idle,
+                                              compositor, NULL);
+}
+
+/* Called by the server once the client's socket drained */
+void
+wakefield_compositor_client_unblocked (WakefieldCompositor *compositor,
+                                       struct wl_client    *client)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  struct wl_resource *xdg_surface_resource;
+
+  if (pointer->frame_resource &&
+      wl_resource_get_client (pointer->frame_resource) == client)
+    send_pointer_frame (compositor);
 
-  return wl_resource_find_for_client (&priv->seat.keyboard.resource_list, client);
+  /* Sends the configures we held back, if still different */
+  wl_resource_for_each (xdg_surface_resource, &priv->xdg_surfaces)
+    {
+      if (wl_resource_get_client (xdg_surface_resource) == client)
+        wakefield_compositor_send_xdg_configure (compositor, xdg_surface_resource);
+    }
 }
 
 static void
@@ -362,15 +892,21 @@ send_enter (WakefieldCompositor *compositor, struct wl_resource  *surface, doubl
   struct WakefieldPointer *pointer = &priv->seat.pointer;
   struct wl_resource *pointer_resource;
 
+  send_pointer_frame (compositor);
+
   pointer_resource = wakefield_compositor_get_pointer_for_client (compositor,
                                                                   wl_resource_get_client (surface));
 
   pointer->serial = wl_display_next_serial (priv->wl_display);
   if (pointer_resource)
-    wl_pointer_send_enter (pointer_resource, pointer->serial,
-                           surface,
-                           wl_fixed_from_double (x),
-                           wl_fixed_from_double (y));
+    {
+      wl_pointer_send_enter (pointer_resource, pointer->serial,
+                             surface,
+                             wl_fixed_from_double (x),
+                             wl_fixed_from_double (y));
+      send_frame_event (pointer_resource);
+    }
+  flush_input (compositor, pointer_resource);
 }
 
 static void
@@ -380,15 +916,23 @@ send_leave (WakefieldCompositor *compositor, struct wl_resource  *surface)
   struct WakefieldPointer *pointer = &priv->seat.pointer;
   struct wl_resource *pointer_resource;
 
+  send_pointer_frame (compositor);
+
   pointer_resource = wakefield_compositor_get_pointer_for_client (compositor,
                                                                   wl_resource_get_client (surface));
 
   pointer->serial = wl_display_next_serial (priv->wl_display);
   if (pointer_resource)
-    wl_pointer_send_leave (pointer_resource, pointer->serial, surface);
+    {
+      wl_pointer_send_leave (pointer_resource, pointer->serial, surface);
+      send_frame_event (pointer_resource);
+    }
+  flush_input (compositor, pointer_resource);
+
+  pointer->has_last_root = FALSE;
 
   if (pointer->cursor_surface)
-    unset_cursor_surface (pointer, pointer->cursor_surface);
+    unset_cursor_surface (pointer);
 }
 
 static uint32_t
@@ -415,10 +959,12 @@ wakefield_compositor_clear_grab (WakefieldCompositor *compositor)
     gdk_device_ungrab (pointer->grab_device, GDK_CURRENT_TIME);
   else
     {
-      /* During a passive grab we may have not sent a leave event, send it now */
-      if (pointer->current_gdk_surface != pointer->current_surface)
+      /* During a passive grab we may have not sent a leave event, send it
+         now. If the pointer ended up over an overlay popup, or its parent,
+         the next motion enters that. */
+      if (pointer->current_surface != NULL &&
+          pointer->current_gdk_surface != pointer->current_surface)
         {
-          g_assert (pointer->current_gdk_surface == NULL);
           send_leave (compositor, pointer->current_surface);
           pointer->current_surface = NULL;
         }
@@ -449,6 +995,9 @@ ensure_surface_entered (WakefieldCompositor *compositor,
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct WakefieldPointer *pointer = &priv->seat.pointer;
 
+  pointer->x = x;
+  pointer->y = y;
+
   if (pointer->current_surface != surface)
     {
       if (pointer->current_surface != NULL)
@@ -460,24 +1009,236 @@ ensure_surface_entered (WakefieldCompositor *compositor,
     }
 }
 
-void
-wakefield_compositor_send_button (WakefieldCompositor *compositor,
-                                  struct wl_resource *surface,
-                                  GdkEventButton *event)
+#define GRAB_EVENT_MASK (GDK_POINTER_MOTION_MASK | \
+                         GDK_BUTTON_PRESS_MASK | \
+                         GDK_BUTTON_RELEASE_MASK | \
+                         GDK_SCROLL_MASK | \
+                         GDK_ENTER_NOTIFY_MASK | \
+                         GDK_LEAVE_NOTIFY_MASK)
+
+static struct WakefieldPointerConstraint *
+find_pointer_constraint (struct WakefieldPointer *pointer,
+                         struct wl_resource      *surface)
 {
-  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  struct WakefieldPointer *pointer = &priv->seat.pointer;
-  struct wl_resource *pointer_resource, *xdg_popup_resource;
-  guint32 button;
+  struct WakefieldPointerConstraint *constraint;
 
-  if (event->type == GDK_2BUTTON_PRESS || event->type == GDK_3BUTTON_PRESS)
-    return;
+  wl_list_for_each (constraint, &pointer->constraints, link)
+    {
+      if (constraint->surface == surface)
+        return constraint;
+    }
 
-  button = convert_gdk_button_to_libinput (event->button);
+  return NULL;
+}
 
-  if (event->type == GDK_BUTTON_PRESS)
-    {
-      if (pointer->button_count == 0 && pointer->grab_popup_surface == NULL)
+/* Gets the root coordinates of the origin of the surface of a
+   constraint, and the part of it its window shows, in surface
+   coordinates. The window of an xdg_surface starts at its window
+   geometry, not at the surface origin. */
+static void
+get_pointer_constraint_bounds (struct WakefieldPointerConstraint *constraint,
+                               GdkWindow *window,
+                               int *origin_x, int *origin_y,
+                               cairo_rectangle_int_t *whole)
+{
+  int geometry_x, geometry_y;
+
+  wakefield_surface_get_window_geometry (constraint->surface,
+                                         &geometry_x, &geometry_y, NULL, NULL);
+
+  gdk_window_get_origin (window, origin_x, origin_y);
+  *origin_x -= geometry_x;
+  *origin_y -= geometry_y;
+
+  if (whole)
+    {
+      whole->x = geometry_x;
+      whole->y = geometry_y;
+      whole->width = gdk_window_get_width (window);
+      whole->height = gdk_window_get_height (window);
+    }
+}
+
+/* Moves x, y to the closest point of the area the pointer is confined
+   to, within whole. Returns FALSE if it was inside already. */
+static gboolean
+clamp_to_pointer_constraint (struct WakefieldPointerConstraint *constraint,
+                             const cairo_rectangle_int_t *whole,
+                             double *x, double *y)
+{
+  cairo_rectangle_int_t rect;
+  double best_x = *x, best_y = *y, best = G_MAXDOUBLE;
+  int i, n_rects;
+
+  n_rects = constraint->region ? cairo_region_num_rectangles (constraint->region) : 1;
+  for (i = 0; i < n_rects; i++)
+    {
+      double clamped_x, clamped_y, distance;
+
+      if (constraint->region == NULL)
+        rect = *whole;
+      else
+        {
+          cairo_region_get_rectangle (constraint->region, i, &rect);
+          if (!gdk_rectangle_intersect (&rect, whole, &rect))
+            continue;
+        }
+
+      clamped_x = CLAMP (*x, rect.x, rect.x + rect.width - 1);
+      clamped_y = CLAMP (*y, rect.y, rect.y + rect.height - 1);
+      distance = (clamped_x - *x) * (clamped_x - *x) + (clamped_y - *y) * (clamped_y - *y);
+      if (distance < best)
+        {
+          best = distance;
+          best_x = clamped_x;
+          best_y = clamped_y;
+        }
+    }
+
+  if (best == G_MAXDOUBLE || best == 0)
+    return FALSE;
+
+  *x = best_x;
+  *y = best_y;
+  return TRUE;
+}
+
+static void
+activate_pointer_constraint (struct WakefieldPointerConstraint *constraint)
+{
+  WakefieldCompositor *compositor = constraint->compositor;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  GdkWindow *window = wakefield_surface_get_window (constraint->surface);
+  GdkDevice *device;
+
+  if (window == NULL)
+    return;
+
+  /* X can only confine to a window, and GDK not even that, so we grab
+     the pointer and keep it in place ourselves */
+  device = gdk_seat_get_pointer (gdk_display_get_default_seat (gdk_window_get_display (window)));
+  if (gdk_device_grab (device, window, GDK_OWNERSHIP_NONE, TRUE,
+                       GRAB_EVENT_MASK, NULL, GDK_CURRENT_TIME) != GDK_GRAB_SUCCESS)
+    return;
+
+  send_pointer_frame (compositor);
+
+  pointer->active_constraint = constraint;
+  pointer->constraint_device = device;
+  constraint->active = TRUE;
+
+  if (constraint->lock)
+    {
+      gdk_device_get_position (device, &pointer->lock_screen,
+                               &pointer->lock_x_root, &pointer->lock_y_root);
+      zwp_locked_pointer_v1_send_locked (constraint->resource);
+    }
+  else
+    zwp_confined_pointer_v1_send_confined (constraint->resource);
+
+  flush_input (compositor, constraint->resource);
+}
+
+static void
+deactivate_pointer_constraint (struct WakefieldPointerConstraint *constraint)
+{
+  WakefieldCompositor *compositor = constraint->compositor;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  GdkWindow *window;
+
+  if (!constraint->active)
+    return;
+
+  constraint->active = FALSE;
+  pointer->active_constraint = NULL;
+
+  if (constraint->lifetime == ZWP_POINTER_CONSTRAINTS_V1_LIFETIME_ONESHOT)
+    constraint->defunct = TRUE;
+
+  window = wakefield_surface_get_window (constraint->surface);
+  if (constraint->lock && constraint->has_hint && window != NULL)
+    {
+      int x, y;
+
+      get_pointer_constraint_bounds (constraint, window, &x, &y, NULL);
+      gdk_device_warp (pointer->constraint_device, pointer->lock_screen,
+                       x + constraint->hint_x, y + constraint->hint_y);
+    }
+
+  gdk_device_ungrab (pointer->constraint_device, GDK_CURRENT_TIME);
+  pointer->constraint_device = NULL;
+
+  if (constraint->lock)
+    zwp_locked_pointer_v1_send_unlocked (constraint->resource);
+  else
+    zwp_confined_pointer_v1_send_unconfined (constraint->resource);
+  flush_input (compositor, constraint->resource);
+
+  /* We ignored crossing events while it was active */
+  if (pointer->current_surface != NULL &&
+      pointer->current_gdk_surface != pointer->current_surface &&
+      pointer->grab_button == 0)
+    {
+      send_leave (compositor, pointer->current_surface);
+      pointer->current_surface = NULL;
+    }
+}
+
+/* Constraints activate once their surface has the pointer, inside its
+   region, and we have the keyboard focus */
+static void
+maybe_activate_pointer_constraint (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  struct WakefieldPointerConstraint *constraint;
+
+  if (pointer->current_surface == NULL ||
+      pointer->active_constraint != NULL ||
+      pointer->grab_popup_surface != NULL ||
+      !gtk_widget_has_focus (GTK_WIDGET (compositor)))
+    return;
+
+  constraint = find_pointer_constraint (pointer, pointer->current_surface);
+  if (constraint == NULL || constraint->defunct)
+    return;
+
+  if (constraint->region != NULL &&
+      !cairo_region_contains_point (constraint->region, (int) pointer->x, (int) pointer->y))
+    return;
+
+  activate_pointer_constraint (constraint);
+}
+
+void
+wakefield_compositor_send_button (WakefieldCompositor *compositor,
+                                  struct wl_resource *surface,
+                                  GdkEventButton *event)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  struct wl_resource *pointer_resource, *xdg_popup_resource;
+  guint32 button;
+
+  if (event->type == GDK_2BUTTON_PRESS || event->type == GDK_3BUTTON_PRESS)
+    return;
+
+  button = convert_gdk_button_to_libinput (event->button);
+
+  /* Clients don't see buttons during a drag, releasing the last one
+     drops */
+  if (wakefield_data_device_is_dragging (priv->data_device))
+    {
+      if (event->type == GDK_BUTTON_RELEASE && pointer->button_count == 1)
+        wakefield_data_device_drag_drop (priv->data_device, event->time);
+      surface = NULL;
+    }
+
+  if (event->type == GDK_BUTTON_PRESS)
+    {
+      if (pointer->button_count == 0 && pointer->grab_popup_surface == NULL)
         {
           if (wakefield_surface_get_xdg_surface (surface) != NULL)
             {
@@ -502,11 +1263,17 @@ wakefield_compositor_send_button (WakefieldCompositor *compositor,
     {
       ensure_surface_entered (compositor, surface, event->x, event->y);
       pointer_resource = wakefield_compositor_get_pointer_for_client (compositor, wl_resource_get_client (surface));
+      /* Buttons are never folded, but have to come after the motion */
+      send_pointer_frame (compositor);
       if (pointer_resource)
-        wl_pointer_send_button (pointer_resource, pointer->serial,
-                                event->time,
-                                button,
-                                (event->type == GDK_BUTTON_PRESS ? 1 : 0));
+        {
+          wl_pointer_send_button (pointer_resource, pointer->serial,
+                                  event->time,
+                                  button,
+                                  (event->type == GDK_BUTTON_PRESS ? 1 : 0));
+          send_frame_event (pointer_resource);
+        }
+      flush_input (compositor, pointer_resource);
     }
 
   if (pointer->button_count == 1 && event->type == GDK_BUTTON_PRESS)
@@ -534,65 +1301,94 @@ wakefield_compositor_send_button (WakefieldCompositor *compositor,
     }
 }
 
+static enum wl_pointer_axis_source
+get_axis_source (GdkEventScroll *event)
+{
+  GdkDevice *device = gdk_event_get_source_device ((GdkEvent *)event);
+
+  if (event->direction != GDK_SCROLL_SMOOTH || device == NULL)
+    return WL_POINTER_AXIS_SOURCE_WHEEL;
+
+  switch (gdk_device_get_source (device))
+    {
+    case GDK_SOURCE_TOUCHPAD:
+      return WL_POINTER_AXIS_SOURCE_FINGER;
+    case GDK_SOURCE_TRACKPOINT:
+      return WL_POINTER_AXIS_SOURCE_CONTINUOUS;
+    default:
+      return WL_POINTER_AXIS_SOURCE_WHEEL;
+    }
+}
+
 void
 wakefield_compositor_send_scroll (WakefieldCompositor *compositor,
                                   struct wl_resource *surface,
                                   GdkEventScroll *event)
 {
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
   struct wl_resource *pointer_resource;
+  enum wl_pointer_axis_source source;
+  double dx = 0, dy = 0;
+  int discrete_x = 0, discrete_y = 0;
 
-  if (surface == NULL)
+  /* Drags take the pointer focus away */
+  if (surface == NULL || wakefield_data_device_is_dragging (priv->data_device))
     return;
 
   ensure_surface_entered (compositor, surface, event->x, event->y);
 
   pointer_resource = wakefield_compositor_get_pointer_for_client (compositor,
                                                                   wl_resource_get_client (surface));
-  if (pointer_resource && should_send_pointer_event (compositor))
+  if (pointer_resource == NULL || !should_send_pointer_event (compositor))
+    return;
+
+  switch (event->direction)
     {
-      switch (event->direction)
-        {
-        case GDK_SCROLL_SMOOTH:
-          if (event->delta_x != 0)
-            {
-              wl_pointer_send_axis (pointer_resource,
-                                    event->time,
-                                    WL_POINTER_AXIS_HORIZONTAL_SCROLL,
-                                    wl_fixed_from_double (event->delta_x * 10.0));
-            }
-          if (event->delta_y != 0)
-            {
-              wl_pointer_send_axis (pointer_resource,
-                                    event->time,
-                                    WL_POINTER_AXIS_VERTICAL_SCROLL,
-                                    wl_fixed_from_double (event->delta_y * 10.0));
-            }
-          break;
-        case GDK_SCROLL_UP:
-          wl_pointer_send_axis (pointer_resource,
-                                event->time,
-                                WL_POINTER_AXIS_VERTICAL_SCROLL,
-                                wl_fixed_from_int (-10.0));
-          break;
-        case GDK_SCROLL_DOWN:
-          wl_pointer_send_axis (pointer_resource,
-                                event->time,
-                                WL_POINTER_AXIS_VERTICAL_SCROLL,
-                                wl_fixed_from_int (10.0));
-          break;
-        case GDK_SCROLL_LEFT:
-          wl_pointer_send_axis (pointer_resource,
-                                event->time,
-                                WL_POINTER_AXIS_VERTICAL_SCROLL,
-                                wl_fixed_from_int (-10.0));
-          break;
-        case GDK_SCROLL_RIGHT:
-          wl_pointer_send_axis (pointer_resource,
-                                event->time,
-                                WL_POINTER_AXIS_VERTICAL_SCROLL,
-                                wl_fixed_from_int (10.0));
-          break;
-        }
+    case GDK_SCROLL_SMOOTH:
+      dx = event->delta_x * 10.0;
+      dy = event->delta_y * 10.0;
+      break;
+    case GDK_SCROLL_UP:
+      dy = -10.0;
+      discrete_y = -1;
+      break;
+    case GDK_SCROLL_DOWN:
+      dy = 10.0;
+      discrete_y = 1;
+      break;
+    case GDK_SCROLL_LEFT:
+      dx = -10.0;
+      discrete_x = -1;
+      break;
+    case GDK_SCROLL_RIGHT:
+      dx = 10.0;
+      discrete_x = 1;
+      break;
+    }
+
+  source = get_axis_source (event);
+
+  /* Don't mix scrolling from different devices in one frame */
+  if (pointer->frame_has_axis_source && pointer->frame_axis_source != source)
+    send_pointer_frame (compositor);
+
+  begin_pointer_frame (compositor, pointer_resource);
+
+  pointer->frame_axis_time = event->time;
+  pointer->frame_has_axis_source = TRUE;
+  pointer->frame_axis_source = source;
+  pointer->frame_axis[WL_POINTER_AXIS_HORIZONTAL_SCROLL] += wl_fixed_from_double (dx);
+  pointer->frame_axis[WL_POINTER_AXIS_VERTICAL_SCROLL] += wl_fixed_from_double (dy);
+  pointer->frame_axis_discrete[WL_POINTER_AXIS_HORIZONTAL_SCROLL] += discrete_x;
+  pointer->frame_axis_discrete[WL_POINTER_AXIS_VERTICAL_SCROLL] += discrete_y;
+
+  /* The end of a kinetic scroll on a touchpad */
+  if (event->direction == GDK_SCROLL_SMOOTH &&
+      gdk_event_is_scroll_stop_event ((GdkEvent *)event))
+    {
+      pointer->frame_axis_stop[WL_POINTER_AXIS_HORIZONTAL_SCROLL] = TRUE;
+      pointer->frame_axis_stop[WL_POINTER_AXIS_VERTICAL_SCROLL] = TRUE;
     }
 }
 
@@ -601,22 +1397,135 @@ wakefield_compositor_send_motion (WakefieldCompositor *compositor,
                                   struct wl_resource *surface,
                                   GdkEventMotion *event)
 {
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  struct WakefieldPointerConstraint *constraint = pointer->active_constraint;
   struct wl_resource *pointer_resource;
+  double x = event->x, y = event->y;
+  double x_root = event->x_root, y_root = event->y_root;
+
+  if (wakefield_data_device_is_dragging (priv->data_device))
+    {
+      int origin_x, origin_y;
+
+      /* The event may be for a popup toplevel, so go by the root
+         coordinates */
+      if (priv->event_window == NULL)
+        return;
+      gdk_window_get_origin (priv->event_window, &origin_x, &origin_y);
+      wakefield_data_device_drag_motion (priv->data_device,
+                                         event->x_root - origin_x,
+                                         event->y_root - origin_y,
+                                         event->time);
+      return;
+    }
+
+  if (constraint != NULL)
+    {
+      GdkWindow *window = wakefield_surface_get_window (constraint->surface);
+      cairo_rectangle_int_t whole;
+      int origin_x, origin_y;
+
+      /* With the grab the event may be for any of our windows, or even
+         outside of them */
+      surface = constraint->surface;
+      get_pointer_constraint_bounds (constraint, window, &origin_x, &origin_y, &whole);
+      x = event->x_root - origin_x;
+      y = event->y_root - origin_y;
+
+      if (constraint->lock)
+        {
+          if (!pointer->relative_raw)
+            wakefield_compositor_send_relative_motion (compositor,
+                                                       (guint64) event->time * 1000,
+                                                       event->x_root - pointer->lock_x_root,
+                                                       event->y_root - pointer->lock_y_root,
+                                                       event->x_root - pointer->lock_x_root,
+                                                       event->y_root - pointer->lock_y_root);
+
+          /* No motion is sent while locked */
+          if (event->x_root != pointer->lock_x_root ||
+              event->y_root != pointer->lock_y_root)
+            gdk_device_warp (pointer->constraint_device, pointer->lock_screen,
+                             pointer->lock_x_root, pointer->lock_y_root);
+          return;
+        }
+
+      if (clamp_to_pointer_constraint (constraint, &whole, &x, &y))
+        {
+          x_root = origin_x + x;
+          y_root = origin_y + y;
+          gdk_device_warp (pointer->constraint_device,
+                           gdk_window_get_screen (window),
+                           x_root, y_root);
+        }
+    }
 
   if (surface == NULL)
     return;
 
-  ensure_surface_entered (compositor, surface, event->x, event->y);
+  ensure_surface_entered (compositor, surface, x, y);
+
+  if (!pointer->relative_raw && pointer->has_last_root)
+    wakefield_compositor_send_relative_motion (compositor,
+                                               (guint64) event->time * 1000,
+                                               event->x_root - pointer->last_x_root,
+                                               event->y_root - pointer->last_y_root,
+                                               event->x_root - pointer->last_x_root,
+                                               event->y_root - pointer->last_y_root);
+
+  pointer->has_last_root = TRUE;
+  pointer->last_x_root = x_root;
+  pointer->last_y_root = y_root;
 
   pointer_resource = wakefield_compositor_get_pointer_for_client (compositor,
                                                                   wl_resource_get_client (surface));
   if (pointer_resource && should_send_pointer_event (compositor))
     {
-      wl_pointer_send_motion (pointer_resource,
-                              event->time,
-                              wl_fixed_from_double (event->x),
-                              wl_fixed_from_double (event->y));
+      begin_pointer_frame (compositor, pointer_resource);
+      pointer->frame_motion = TRUE;
+      pointer->frame_motion_time = event->time;
+      pointer->frame_x = wl_fixed_from_double (x);
+      pointer->frame_y = wl_fixed_from_double (y);
     }
+
+  maybe_activate_pointer_constraint (compositor);
+}
+
+/* Relative motion goes to the client with the pointer, if it asked for
+   it. Like motion, it is folded into the pointer frame. */
+void
+wakefield_compositor_send_relative_motion (WakefieldCompositor *compositor,
+                                           guint64              utime,
+                                           double               dx,
+                                           double               dy,
+                                           double               dx_unaccel,
+                                           double               dy_unaccel)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  struct wl_resource *pointer_resource;
+  struct wl_client *client;
+
+  if (pointer->current_surface == NULL ||
+      (dx == 0 && dy == 0 && dx_unaccel == 0 && dy_unaccel == 0))
+    return;
+
+  client = wl_resource_get_client (pointer->current_surface);
+  if (wl_resource_find_for_client (&pointer->relative_resource_list, client) == NULL)
+    return;
+
+  pointer_resource = wakefield_compositor_get_pointer_for_client (compositor, client);
+  if (pointer_resource == NULL)
+    return;
+
+  begin_pointer_frame (compositor, pointer_resource);
+  pointer->frame_relative = TRUE;
+  pointer->frame_relative_time = utime;
+  pointer->frame_relative_delta[0] += dx;
+  pointer->frame_relative_delta[1] += dy;
+  pointer->frame_relative_delta_unaccel[0] += dx_unaccel;
+  pointer->frame_relative_delta_unaccel[1] += dy_unaccel;
 }
 
 void
@@ -639,9 +1548,15 @@ wakefield_compositor_send_enter (WakefieldCompositor *compositor,
   if (has_implicit_grab)
     return;
 
+  /* The pointer only crosses while we warp it back */
+  if (pointer->active_constraint)
+    return;
+
   /* We may have ignored a leave event due to an implicit grab, so we need
      to send it now before sending an enter to some other surface */
   ensure_surface_entered (compositor, surface, event->x, event->y);
+
+  maybe_activate_pointer_constraint (compositor);
 }
 
 void
@@ -664,6 +1579,9 @@ wakefield_compositor_send_leave (WakefieldCompositor *compositor,
   if (has_implicit_grab)
     return;
 
+  if (pointer->active_constraint)
+    return;
+
   /* We may have left this surface already when/if it was unmapped */
   if (pointer->current_surface == NULL)
     return;
@@ -685,6 +1603,8 @@ wakefield_compositor_send_keyboard_enter (WakefieldCompositor *compositor,
 
   g_assert (keyboard->focus == NULL);
   keyboard->focus = surface;
+  wakefield_server_set_focus_client (priv->server, wl_resource_get_client (surface));
+  wakefield_data_device_set_focus (priv->data_device, wl_resource_get_client (surface));
 
   wl_array_init (&keys);
 
@@ -699,6 +1619,7 @@ wakefield_compositor_send_keyboard_enter (WakefieldCompositor *compositor,
                                   keyboard->mods_locked,
                                   keyboard->group);
       wl_keyboard_send_enter (keyboard_resource, wl_display_next_serial (priv->wl_display), surface, &keys);
+      flush_input (compositor, keyboard_resource);
     }
 
   wl_array_release (&keys);
@@ -715,11 +1636,13 @@ wakefield_compositor_send_keyboard_leave (WakefieldCompositor *compositor,
 
   g_assert (keyboard->focus == surface);
   keyboard->focus = NULL;
+  wakefield_server_unset_focus_client (priv->server, wl_resource_get_client (surface));
 
   keyboard_resource = wakefield_compositor_get_keyboard_for_client (compositor,
                                                                     wl_resource_get_client (surface));
   if (keyboard_resource)
     wl_keyboard_send_leave (keyboard_resource, serial, surface);
+  flush_input (compositor, keyboard_resource);
 }
 
 
@@ -728,18 +1651,110 @@ static struct wl_resource *
 wakefield_compositor_get_xdg_surface_for_window (WakefieldCompositor *compositor,
                                                  GdkWindow *window)
 {
-  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *xdg_surface_resource;
 
-  wl_resource_for_each (xdg_surface_resource, &priv->xdg_surfaces)
+  xdg_surface_resource = g_object_get_qdata (G_OBJECT (window),
+                                             wakefield_xdg_surface_window_quark ());
+  if (xdg_surface_resource == NULL)
+    return NULL;
+
+  return wakefield_xdg_surface_get_surface (xdg_surface_resource);
+}
+
+static gboolean
+is_overlay_popup (struct wl_resource *surface)
+{
+  struct wl_resource *xdg_popup = wakefield_surface_get_xdg_popup (surface);
+  int x, y, width, height;
+
+  return xdg_popup != NULL &&
+    wakefield_xdg_popup_get_overlay (xdg_popup, &x, &y, &width, &height) != NULL;
+}
+
+static struct wl_resource *
+overlay_popup_at (WakefieldCompositor *compositor,
+                  double x, double y,
+                  int *popup_x, int *popup_y)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *xdg_popup_resource;
+
+  wl_resource_for_each (xdg_popup_resource, &priv->xdg_popups)
     {
-      if (window == wakefield_xdg_surface_get_window (xdg_surface_resource))
-        return wakefield_xdg_surface_get_surface (xdg_surface_resource);
+      struct wl_resource *surface_resource;
+      int width, height;
+
+      surface_resource = wakefield_xdg_popup_get_overlay (xdg_popup_resource,
+                                                          popup_x, popup_y,
+                                                          &width, &height);
+      if (surface_resource == NULL || !wakefield_surface_is_mapped (surface_resource))
+        continue;
+
+      if (x >= *popup_x && x < *popup_x + width &&
+          y >= *popup_y && y < *popup_y + height)
+        return surface_resource;
     }
 
   return NULL;
 }
 
+/* Overlay popups have no window of their own, so events on the
+   xdg_surface window below them are hit tested against them, topmost
+   first, and x, y are made relative to the surface they are for */
+static struct wl_resource *
+wakefield_compositor_pick_surface (WakefieldCompositor *compositor,
+                                   GdkWindow *window,
+                                   gdouble *x, gdouble *y)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+  struct wl_resource *surface, *hit_surface;
+  int hit_x = 0, hit_y = 0;
+
+  surface = wakefield_compositor_get_xdg_surface_for_window (compositor, window);
+  if (surface == NULL)
+    return NULL;
+
+  hit_surface = overlay_popup_at (compositor, *x, *y, &hit_x, &hit_y);
+  if (hit_surface == NULL)
+    {
+      /* The window of the surface only covers its window geometry */
+      wakefield_surface_get_window_geometry (surface, &hit_x, &hit_y, NULL, NULL);
+      hit_x = -hit_x;
+      hit_y = -hit_y;
+      hit_surface = surface;
+    }
+
+  /* Crossings between these are ours to track */
+  if (pointer->current_gdk_surface != NULL)
+    pointer->current_gdk_surface = hit_surface;
+
+  /* Implicit grabs stick to the surface they started on */
+  if (pointer->grab_button != 0 && pointer->grab_popup_surface == NULL &&
+      pointer->grab_initial_surface != NULL &&
+      pointer->grab_initial_surface != hit_surface)
+    {
+      struct wl_resource *xdg_popup = wakefield_surface_get_xdg_popup (pointer->grab_initial_surface);
+      int width, height;
+
+      if (xdg_popup == NULL ||
+          wakefield_xdg_popup_get_overlay (xdg_popup, &hit_x, &hit_y, &width, &height) == NULL)
+        {
+          wakefield_surface_get_window_geometry (surface, &hit_x, &hit_y, NULL, NULL);
+          *x += hit_x;
+          *y += hit_y;
+          return surface;
+        }
+
+      hit_surface = pointer->grab_initial_surface;
+    }
+
+  *x -= hit_x;
+  *y -= hit_y;
+
+  return hit_surface;
+}
+
 static struct wl_resource *
 wakefield_compositor_get_topmost_surface (WakefieldCompositor *compositor)
 {
@@ -757,6 +1772,84 @@ wakefield_compositor_get_topmost_surface (WakefieldCompositor *compositor)
   return NULL;
 }
 
+/* What a drag is over, with x, y in compositor coordinates made
+   relative to it */
+struct wl_resource *
+wakefield_compositor_surface_at (WakefieldCompositor *compositor,
+                                 double *x, double *y)
+{
+  GtkWidget *widget = GTK_WIDGET (compositor);
+  struct wl_resource *surface;
+  int popup_x, popup_y;
+
+  surface = overlay_popup_at (compositor, *x, *y, &popup_x, &popup_y);
+  if (surface != NULL)
+    {
+      *x -= popup_x;
+      *y -= popup_y;
+      return surface;
+    }
+
+  if (*x < 0 || *y < 0 ||
+      *x >= gtk_widget_get_allocated_width (widget) ||
+      *y >= gtk_widget_get_allocated_height (widget))
+    return NULL;
+
+  surface = wakefield_compositor_get_topmost_surface (compositor);
+  if (surface != NULL)
+    {
+      int geometry_x, geometry_y, width, height;
+
+      wakefield_surface_get_window_geometry (surface, &geometry_x, &geometry_y,
+                                             &width, &height);
+      if (*x >= width || *y >= height)
+        return NULL;
+
+      *x += geometry_x;
+      *y += geometry_y;
+    }
+
+  return surface;
+}
+
+/* Drags start from the implicit grab of a button the client got, and
+   take the pointer focus away until it is released */
+gboolean
+wakefield_compositor_start_drag (WakefieldCompositor *compositor,
+                                 struct wl_client    *client,
+                                 uint32_t             serial)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+
+  if (pointer->grab_button == 0 || pointer->grab_popup_surface != NULL ||
+      pointer->grab_client != client || pointer->grab_serial != serial)
+    return FALSE;
+
+  send_pointer_frame (compositor);
+
+  if (pointer->current_surface != NULL)
+    {
+      send_leave (compositor, pointer->current_surface);
+      pointer->current_surface = NULL;
+    }
+
+  return TRUE;
+}
+
+/* GTK took over the pointer for a drag to the host, we won't see the
+   button being released */
+void
+wakefield_compositor_release_pointer_grab (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
+
+  pointer->button_count = 0;
+  if (pointer->grab_button != 0 && pointer->grab_popup_surface == NULL)
+    wakefield_compositor_clear_grab (compositor);
+}
+
 static gboolean
 wakefield_compositor_button_press_event (GtkWidget      *widget,
                                          GdkEventButton *event)
@@ -766,14 +1859,19 @@ wakefield_compositor_button_press_event (GtkWidget      *widget,
     wakefield_compositor_get_instance_private (compositor);
   struct WakefieldPointer *pointer = &priv->seat.pointer;
   struct wl_resource *surface;
+  gdouble x = event->x, y = event->y;
 
   pointer->serial = wl_display_next_serial (priv->wl_display);
 
-  surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
+  surface = wakefield_compositor_pick_surface (compositor, event->window,
+                                               &event->x, &event->y);
 
   if (surface)
     wakefield_compositor_send_button (compositor, surface, event);
 
+  event->x = x;
+  event->y = y;
+
   return TRUE;
 }
 
@@ -786,14 +1884,19 @@ wakefield_compositor_button_release_event (GtkWidget      *widget,
     wakefield_compositor_get_instance_private (compositor);
   struct WakefieldPointer *pointer = &priv->seat.pointer;
   struct wl_resource *surface;
+  gdouble x = event->x, y = event->y;
 
   pointer->serial = wl_display_next_serial (priv->wl_display);
 
-  surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
+  surface = wakefield_compositor_pick_surface (compositor, event->window,
+                                               &event->x, &event->y);
 
   if (surface)
     wakefield_compositor_send_button (compositor, surface, event);
 
+  event->x = x;
+  event->y = y;
+
   return TRUE;
 }
 
@@ -803,12 +1906,17 @@ wakefield_compositor_scroll_event (GtkWidget      *widget,
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
   struct wl_resource *surface;
+  gdouble x = event->x, y = event->y;
 
-  surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
+  surface = wakefield_compositor_pick_surface (compositor, event->window,
+                                               &event->x, &event->y);
 
   if (surface)
     wakefield_compositor_send_scroll (compositor, surface, event);
 
+  event->x = x;
+  event->y = y;
+
   return TRUE;
 }
 
@@ -818,12 +1926,17 @@ wakefield_compositor_motion_notify_event (GtkWidget      *widget,
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
   struct wl_resource *surface;
+  gdouble x = event->x, y = event->y;
 
-  surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
+  surface = wakefield_compositor_pick_surface (compositor, event->window,
+                                               &event->x, &event->y);
 
   if (surface)
     wakefield_compositor_send_motion (compositor, surface, event);
 
+  event->x = x;
+  event->y = y;
+
   return FALSE;
 }
 
@@ -833,13 +1946,18 @@ wakefield_compositor_enter_notify_event (GtkWidget        *widget,
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
   struct wl_resource *surface;
+  gdouble x = event->x, y = event->y;
 
-  surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
+  surface = wakefield_compositor_pick_surface (compositor, event->window,
+                                               &event->x, &event->y);
   if (event->mode == GDK_CROSSING_NORMAL && surface)
     wakefield_compositor_send_enter (compositor,
                                      surface,
                                      event);
 
+  event->x = x;
+  event->y = y;
+
   return FALSE;
 }
 
@@ -848,10 +1966,17 @@ wakefield_compositor_leave_notify_event (GtkWidget        *widget,
                                          GdkEventCrossing *event)
 {
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (widget);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = &priv->seat.pointer;
   struct wl_resource *surface;
 
   surface = wakefield_compositor_get_xdg_surface_for_window (compositor, event->window);
 
+  /* The pointer may be leaving from an overlay popup above it */
+  if (surface && pointer->current_surface != NULL &&
+      is_overlay_popup (pointer->current_surface))
+    surface = pointer->current_surface;
+
   if (event->mode == GDK_CROSSING_NORMAL && surface)
     wakefield_compositor_send_leave (compositor, surface, event);
 
@@ -870,6 +1995,8 @@ wakefield_compositor_focus_in_event (GtkWidget     *widget,
   if (surface)
     wakefield_compositor_send_keyboard_enter (compositor, surface);
 
+  maybe_activate_pointer_constraint (compositor);
+
   return FALSE;
 }
 
@@ -881,6 +2008,8 @@ wakefield_compositor_focus_out_event (GtkWidget     *widget,
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct WakefieldKeyboard *keyboard = &priv->seat.keyboard;
 
+  if (priv->seat.pointer.active_constraint)
+    deactivate_pointer_constraint (priv->seat.pointer.active_constraint);
 
   if (keyboard->focus && wakefield_surface_get_xdg_surface (keyboard->focus))
     wakefield_compositor_send_keyboard_leave (compositor, keyboard->focus);
@@ -943,13 +2072,18 @@ wakefield_compositor_key_press_event (GtkWidget *widget,
   struct wl_resource *keyboard_resource;
   uint32_t serial = wl_display_next_serial (priv->wl_display);
 
-  if (keyboard->focus != NULL)
+  /* Until it has the keymap, the client can't make sense of keys, and
+     we don't know the modifier indices to send it either */
+  if (keyboard->focus != NULL && keyboard->keymap != NULL)
     {
       keyboard_resource = wakefield_compositor_get_keyboard_for_client (compositor,
                                                                         wl_resource_get_client (keyboard->focus));
+      if (keyboard_resource == NULL)
+        return FALSE;
 
       update_modifier_state (compositor, keyboard_resource, event);
       wl_keyboard_send_key (keyboard_resource, serial, event->time, event->hardware_keycode - 8, WL_KEYBOARD_KEY_STATE_PRESSED);
+      flush_input (compositor, keyboard_resource);
 
     }
 
@@ -966,13 +2100,16 @@ wakefield_compositor_key_release_event (GtkWidget     *widget,
   struct wl_resource *keyboard_resource;
   uint32_t serial = wl_display_next_serial (priv->wl_display);
 
-  if (keyboard->focus != NULL)
+  if (keyboard->focus != NULL && keyboard->keymap != NULL)
     {
       keyboard_resource = wakefield_compositor_get_keyboard_for_client (compositor,
                                                                         wl_resource_get_client (keyboard->focus));
+      if (keyboard_resource == NULL)
+        return FALSE;
 
       update_modifier_state (compositor, keyboard_resource, event);
       wl_keyboard_send_key (keyboard_resource, serial, event->time, event->hardware_keycode - 8, WL_KEYBOARD_KEY_STATE_RELEASED);
+      flush_input (compositor, keyboard_resource);
     }
 
   return FALSE;
@@ -992,44 +2129,55 @@ unbind_resource (struct wl_resource *resource)
 }
 
 static void
-unset_cursor_surface (struct WakefieldPointer *pointer,
-                      WakefieldSurface *cursor_surface)
+unset_cursor_surface (struct WakefieldPointer *pointer)
 {
-  g_signal_handler_disconnect (cursor_surface,
-                               pointer->cursor_surface_commit_listener);
-  g_object_remove_weak_pointer (G_OBJECT (cursor_surface),
-                                (gpointer*)&pointer->cursor_surface);
+  wl_list_remove (&pointer->cursor_surface_commit_listener.link);
+  wl_list_remove (&pointer->cursor_surface_destroy_listener.link);
+  g_clear_object (&pointer->cursor_window);
   pointer->cursor_surface = NULL;
 }
 
 static void
-pointer_cursor_surface_committed (WakefieldSurface *surface,
-                                  GdkWindow *window)
+update_cursor (struct WakefieldPointer *pointer)
 {
-  WakefieldCompositor *compositor = wakefield_surface_get_compositor (surface);
-  WakefieldCompositorPrivate *priv =
-    wakefield_compositor_get_instance_private (compositor);
-  struct WakefieldPointer *pointer = &priv->seat.pointer;
   cairo_surface_t *cursor_surface;
   int w, h;
 
-  cursor_surface = wakefield_surface_create_cairo_surface (surface, &w, &h);
+  cursor_surface = wakefield_surface_create_cairo_surface (pointer->cursor_surface, &w, &h);
   if (cursor_surface)
     {
       GdkCursor *gdk_cursor;
 
       /* Note: XRender BadMatches if the hotspot is outside the cursor, so
          limit it here */
-      gdk_cursor = gdk_cursor_new_from_surface (gdk_window_get_display (window),
+      gdk_cursor = gdk_cursor_new_from_surface (gdk_window_get_display (pointer->cursor_window),
                                                 cursor_surface,
                                                 MIN (w, pointer->hot_x),
                                                 MIN (h, pointer->hot_y));
       cairo_surface_destroy (cursor_surface);
-      gdk_window_set_cursor (window, gdk_cursor);
+      gdk_window_set_cursor (pointer->cursor_window, gdk_cursor);
       g_object_unref (gdk_cursor);
     }
 }
 
+static void
+pointer_cursor_surface_committed (struct wl_listener *listener, void *data)
+{
+  struct WakefieldPointer *pointer =
+    wl_container_of (listener, pointer, cursor_surface_commit_listener);
+
+  update_cursor (pointer);
+}
+
+static void
+pointer_cursor_surface_destroyed (struct wl_listener *listener, void *data)
+{
+  struct WakefieldPointer *pointer =
+    wl_container_of (listener, pointer, cursor_surface_destroy_listener);
+
+  unset_cursor_surface (pointer);
+}
+
 static void
 pointer_set_cursor (struct wl_client *client,
                     struct wl_resource *resource,
@@ -1038,13 +2186,10 @@ pointer_set_cursor (struct wl_client *client,
                     int32_t x, int32_t y)
 {
   struct WakefieldPointer *pointer = wl_resource_get_user_data (resource);
-  WakefieldSurface *cursor_surface = NULL;
   GdkWindow *window;
 
   if (surface_resource)
     {
-      cursor_surface = wl_resource_get_user_data (surface_resource);
-
       switch (wakefield_surface_get_role (surface_resource))
         {
         case WAKEFIELD_SURFACE_ROLE_NONE:
@@ -1052,6 +2197,7 @@ pointer_set_cursor (struct wl_client *client,
           break;
         case WAKEFIELD_SURFACE_ROLE_XDG_SURFACE:
         case WAKEFIELD_SURFACE_ROLE_XDG_POPUP:
+        case WAKEFIELD_SURFACE_ROLE_DND_ICON:
           wl_resource_post_error (resource, WL_POINTER_ERROR_ROLE,
                                   "This wl_surface already has a role");
           break;
@@ -1067,28 +2213,29 @@ pointer_set_cursor (struct wl_client *client,
   if (pointer->current_surface == NULL)
     return;
 
-  if (pointer->cursor_surface == cursor_surface)
+  if (pointer->cursor_surface == surface_resource)
     return;
 
   if (pointer->cursor_surface)
-    unset_cursor_surface (pointer, pointer->cursor_surface);
+    unset_cursor_surface (pointer);
 
-  if (cursor_surface)
+  window = wakefield_surface_get_window (pointer->current_surface);
+  if (surface_resource && window)
     {
-      window = wakefield_surface_get_window (pointer->current_surface);
       pointer->hot_x = x;
       pointer->hot_y = y;
-      pointer->cursor_surface_commit_listener =
-        g_signal_connect_object (cursor_surface, "committed",
-                                 G_CALLBACK (pointer_cursor_surface_committed),
-                                 window, 0);
-      pointer->cursor_surface = cursor_surface;
-      g_object_add_weak_pointer (G_OBJECT (cursor_surface),
-                                 (gpointer*)&pointer->cursor_surface);
-      pointer_cursor_surface_committed (cursor_surface, window);
+      pointer->cursor_surface = surface_resource;
+      pointer->cursor_window = g_object_ref (window);
+
+      pointer->cursor_surface_commit_listener.notify = pointer_cursor_surface_committed;
+      wakefield_surface_add_commit_listener (surface_resource,
+                                             &pointer->cursor_surface_commit_listener);
+      pointer->cursor_surface_destroy_listener.notify = pointer_cursor_surface_destroyed;
+      wl_resource_add_destroy_listener (surface_resource,
+                                        &pointer->cursor_surface_destroy_listener);
+
+      update_cursor (pointer);
     }
-  else
-    pointer->cursor_surface = NULL;;
 }
 
 static const struct wl_pointer_interface pointer_implementation = {
@@ -1096,6 +2243,19 @@ static const struct wl_pointer_interface pointer_implementation = {
   resource_release,
 };
 
+static void
+pointer_destructor (struct wl_resource *resource)
+{
+  struct WakefieldPointer *pointer = wl_resource_get_user_data (resource);
+
+  if (pointer->frame_resource == resource)
+    clear_pointer_frame (pointer);
+
+  unbind_resource (resource);
+  wakefield_client_unset_binding (resource, WAKEFIELD_CLIENT_BINDING_POINTER,
+                                  &pointer->resource_list);
+}
+
 static void
 seat_get_pointer (struct wl_client    *client,
                   struct wl_resource  *seat_resource,
@@ -1106,14 +2266,17 @@ seat_get_pointer (struct wl_client    *client,
   struct wl_resource *cr;
 
   cr = wl_resource_create (client, &wl_pointer_interface, wl_resource_get_version (seat_resource), id);
-  wl_resource_set_implementation (cr, &pointer_implementation, pointer, unbind_resource);
+  wl_resource_set_implementation (cr, &pointer_implementation, pointer, pointer_destructor);
   wl_list_insert (&pointer->resource_list, wl_resource_get_link (cr));
+  wakefield_client_set_binding (client, WAKEFIELD_CLIENT_BINDING_POINTER, cr);
 }
 
 static void
 wakefield_pointer_init (struct WakefieldPointer *pointer)
 {
   wl_list_init (&pointer->resource_list);
+  wl_list_init (&pointer->relative_resource_list);
+  wl_list_init (&pointer->constraints);
   pointer->cursor_surface = NULL;
 }
 
@@ -1121,6 +2284,63 @@ static const struct wl_keyboard_interface keyboard_implementation = {
   resource_release,
 };
 
+static void
+keyboard_destructor (struct wl_resource *resource)
+{
+  struct WakefieldKeyboard *keyboard = wl_resource_get_user_data (resource);
+
+  unbind_resource (resource);
+  wakefield_client_unset_binding (resource, WAKEFIELD_CLIENT_BINDING_KEYBOARD,
+                                  &keyboard->resource_list);
+}
+
+/* Returns TRUE if we got the keymap just now */
+static gboolean
+update_keyboard_keymap (struct WakefieldKeyboard *keyboard)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (keyboard->compositor);
+  struct xkb_keymap *keymap;
+
+  if (keyboard->keymap)
+    return FALSE;
+
+  keymap = wakefield_server_get_keymap (priv->server,
+                                        &keyboard->keymap_fd,
+                                        &keyboard->keymap_size);
+  if (keymap)
+    {
+      keyboard->keymap = keymap;
+
+      keyboard->shift_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_SHIFT);
+      keyboard->caps_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_CAPS);
+      keyboard->ctrl_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_CTRL);
+      keyboard->alt_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_ALT);
+      keyboard->mod2_mod = xkb_keymap_mod_get_index (keymap, "Mod2");
+      keyboard->mod3_mod = xkb_keymap_mod_get_index (keymap, "Mod3");
+      keyboard->super_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_LOGO);
+      keyboard->mod5_mod = xkb_keymap_mod_get_index (keymap, "Mod5");
+
+      keyboard->num_led = xkb_keymap_led_get_index (keymap, XKB_LED_NAME_NUM);
+      keyboard->caps_led = xkb_keymap_led_get_index (keymap, XKB_LED_NAME_CAPS);
+      keyboard->scroll_led = xkb_keymap_led_get_index (keymap, XKB_LED_NAME_SCROLL);
+    }
+
+  return keymap != NULL;
+}
+
+static void
+send_keymap (struct WakefieldKeyboard *keyboard,
+             struct wl_resource       *keyboard_resource)
+{
+  if (keyboard->keymap_fd != -1)
+    {
+      wl_keyboard_send_keymap (keyboard_resource,
+                               WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
+                               keyboard->keymap_fd,
+                               keyboard->keymap_size);
+    }
+}
+
 static void
 seat_get_keyboard (struct wl_client    *client,
                    struct wl_resource  *seat_resource,
@@ -1131,256 +2351,399 @@ seat_get_keyboard (struct wl_client    *client,
   struct wl_resource *cr;
 
   cr = wl_resource_create (client, &wl_keyboard_interface, wl_resource_get_version (seat_resource), id);
-  wl_resource_set_implementation (cr, &keyboard_implementation, keyboard, unbind_resource);
+  wl_resource_set_implementation (cr, &keyboard_implementation, keyboard, keyboard_destructor);
   wl_list_insert (&keyboard->resource_list, wl_resource_get_link (cr));
+  wakefield_client_set_binding (client, WAKEFIELD_CLIENT_BINDING_KEYBOARD, cr);
 
-  if (keyboard->keymap_fd != -1)
+  /* If the server is still loading it, the keymap comes later */
+  update_keyboard_keymap (keyboard);
+  if (keyboard->keymap)
+    send_keymap (keyboard, cr);
+}
+
+void
+wakefield_compositor_keymap_loaded (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldKeyboard *keyboard = &priv->seat.keyboard;
+  struct wl_resource *keyboard_resource;
+
+  if (!update_keyboard_keymap (keyboard))
+    return;
+
+  wl_resource_for_each (keyboard_resource, &keyboard->resource_list)
     {
-      wl_keyboard_send_keymap (cr,
-                               WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
-                               keyboard->keymap_fd,
-                               keyboard->keymap_size);
+      send_keymap (keyboard, keyboard_resource);
+      flush_input (compositor, keyboard_resource);
     }
 }
 
-static struct xkb_keymap *
-get_keymap (WakefieldCompositor *compositor,
-            struct WakefieldKeyboard *keyboard)
+static void
+wakefield_keyboard_init (WakefieldCompositor *compositor,
+                         struct WakefieldKeyboard *keyboard)
 {
-  GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (compositor));
+  keyboard->compositor = compositor;
+  keyboard->keymap_fd = -1;
+  wl_list_init (&keyboard->resource_list);
+}
 
-#if defined(GDK_WINDOWING_X11)
-  if (GDK_IS_X11_DISPLAY (display) && keyboard->has_x11_xkb)
-    {
-      Display *xdisplay = gdk_x11_display_get_xdisplay (display);
-      xcb_connection_t *conn = XGetXCBConnection (xdisplay);
-      int32_t core_id = xkb_x11_get_core_keyboard_device_id (conn);
+#define SEAT_VERSION 5
 
-      return xkb_x11_keymap_new_from_device (keyboard->context,
-                                             conn,
-                                             core_id,
-                                             XKB_KEYMAP_COMPILE_NO_FLAGS);
-    }
-#endif
+static const struct wl_seat_interface seat_interface = {
+  seat_get_pointer,
+  seat_get_keyboard, /* get_keyboard */
+  NULL, /* get_touch */
+};
 
-  return NULL;
+static void
+wl_seat_destructor (struct wl_resource *resource)
+{
 }
 
-static int
-create_anonymous_file (gsize size)
+static void
+bind_seat (struct wl_client *client,
+           void *data,
+           uint32_t version,
+           uint32_t id)
 {
-  char *tmpname;
-  int fd;
-  int ret;
+  WakefieldCompositor *compositor = wakefield_server_get_client_compositor (data, client);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *cr;
 
-  tmpname = g_build_filename (g_get_user_runtime_dir (), "/weston-shared-XXXXXX", NULL);
-  fd = g_mkstemp (tmpname);
-  unlink (tmpname);
-  free (tmpname);
+  cr = wl_resource_create (client, &wl_seat_interface, version, id);
+  wl_resource_set_implementation (cr, &seat_interface, &priv->seat, wl_seat_destructor);
+  wl_seat_send_capabilities (cr, WL_SEAT_CAPABILITY_POINTER | WL_SEAT_CAPABILITY_KEYBOARD);
+  wl_seat_send_name (cr, "seat0");
+}
 
-  if (fd < 0)
-    return -1;
+static void
+wakefield_seat_init (WakefieldCompositor *compositor,
+                     struct WakefieldSeat *seat)
+{
+  wakefield_pointer_init (&seat->pointer);
+  wakefield_keyboard_init (compositor, &seat->keyboard);
+}
 
-#ifdef HAVE_POSIX_FALLOCATE
-  ret = posix_fallocate (fd, 0, size);
-  if (ret != 0)
-    {
-      close (fd);
-      errno = ret;
-      return -1;
-    }
-#else
-  ret = ftruncate (fd, size);
-  if (ret < 0)
-    {
-      close (fd);
-      return -1;
-    }
-#endif
+static void
+output_destructor (struct wl_resource *resource)
+{
+  struct WakefieldOutput *output = wl_resource_get_user_data (resource);
 
-  return fd;
+  unbind_resource (resource);
+  wakefield_client_unset_binding (resource, WAKEFIELD_CLIENT_BINDING_OUTPUT,
+                                  &output->resource_list);
 }
 
 static void
-write_all (int           fd,
-           const char*    buf,
-           gsize         len)
+bind_output (struct wl_client *client,
+             void *data,
+             uint32_t version,
+             uint32_t id)
 {
-  while (len > 0)
+  WakefieldCompositor *compositor = wakefield_server_get_client_compositor (data, client);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldOutput *output = &priv->output;
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wl_output_interface, version, id);
+  wl_resource_set_implementation (cr, NULL, output, output_destructor);
+  wl_list_insert (&output->resource_list, wl_resource_get_link (cr));
+  wakefield_client_set_binding (client, WAKEFIELD_CLIENT_BINDING_OUTPUT, cr);
+
+  wl_output_send_geometry (cr,
+                           0, 0,
+                           0, 0, /* mm */
+                           0, /* subpixel */
+                           "Wakefield", "Gtk",
+                           WL_OUTPUT_TRANSFORM_NORMAL);
+
+  /* The new output is in the list already, so this covers it too */
+  if (update_output_mode (compositor))
     {
-      gssize bytes_written = write (fd, buf, len);
-      if (bytes_written < 0)
-        g_error ("Failed to write to fd %d: %s",
-                 fd, strerror (errno));
-      buf += bytes_written;
-      len -= bytes_written;
+      wl_resource_for_each (cr, &output->resource_list)
+        {
+          refresh_output (compositor, cr);
+        }
     }
+  else
+    refresh_output (compositor, cr);
 }
 
+#define WL_OUTPUT_VERSION 2
+
 static void
-update_keymap (WakefieldCompositor *compositor,
-               struct WakefieldKeyboard *keyboard)
+scale_factor_changed (WakefieldCompositor *compositor)
 {
-  struct wl_resource *keyboard_resource;
-  struct xkb_keymap *keymap;
-  char *str;
-  gsize size;
-
-  if (keyboard->keymap)
-    xkb_keymap_unref (keyboard->keymap);
-  keyboard->keymap = NULL;
-  if (keyboard->keymap_fd != -1)
-    close (keyboard->keymap_fd);
-  keyboard->keymap_fd = -1;
-  keyboard->keymap_size = 0;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *surface_resource, *output;
+  int scale = wakefield_compositor_get_preferred_scale (compositor);
 
-  keymap = get_keymap (compositor, keyboard);
-  if (keymap)
+  if (update_output_mode (compositor))
     {
-      str = xkb_keymap_get_as_string (keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
-      if (str)
+      wl_resource_for_each (output, &priv->output.resource_list)
         {
-          size = strlen (str);
-          keyboard->keymap_fd = create_anonymous_file (size);
-          if (keyboard->keymap_fd != -1)
-            {
-              write_all (keyboard->keymap_fd, str, size);
-              keyboard->keymap = xkb_keymap_ref (keymap);
-              keyboard->keymap_size = size;
-            }
-          free (str);
+          refresh_output (compositor, output);
         }
+    }
 
-      keyboard->shift_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_SHIFT);
-      keyboard->caps_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_CAPS);
-      keyboard->ctrl_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_CTRL);
-      keyboard->alt_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_ALT);
-      keyboard->mod2_mod = xkb_keymap_mod_get_index (keymap, "Mod2");
-      keyboard->mod3_mod = xkb_keymap_mod_get_index (keymap, "Mod3");
-      keyboard->super_mod = xkb_keymap_mod_get_index (keymap, XKB_MOD_NAME_LOGO);
-      keyboard->mod5_mod = xkb_keymap_mod_get_index (keymap, "Mod5");
+  wl_resource_for_each (surface_resource, &priv->surfaces)
+    {
+      wakefield_surface_send_preferred_scale (surface_resource, scale);
+    }
+}
 
-      keyboard->num_led = xkb_keymap_led_get_index (keymap, XKB_LED_NAME_NUM);
-      keyboard->caps_led = xkb_keymap_led_get_index (keymap, XKB_LED_NAME_CAPS);
-      keyboard->scroll_led = xkb_keymap_led_get_index (keymap, XKB_LED_NAME_SCROLL);
+static void
+wakefield_output_init (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  wl_list_init (&priv->output.resource_list);
+
+  g_signal_connect (compositor, "notify::scale-factor",
+                    G_CALLBACK (scale_factor_changed), NULL);
+}
+
+#define RELATIVE_POINTER_MANAGER_VERSION 1
+
+static void
+relative_pointer_destructor (struct wl_resource *resource)
+{
+  WakefieldCompositor *compositor = wl_resource_get_user_data (resource);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  unbind_resource (resource);
+  wakefield_server_unwatch_raw_motion (priv->server);
+}
+
+static const struct zwp_relative_pointer_v1_interface relative_pointer_implementation = {
+  resource_release,
+};
+
+static void
+relative_pointer_manager_get_relative_pointer (struct wl_client   *client,
+                                               struct wl_resource *manager_resource,
+                                               uint32_t            id,
+                                               struct wl_resource *pointer_resource)
+{
+  WakefieldCompositor *compositor =
+    wakefield_server_get_client_compositor (wl_resource_get_user_data (manager_resource), client);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct WakefieldPointer *pointer = wl_resource_get_user_data (pointer_resource);
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_relative_pointer_v1_interface,
+                           wl_resource_get_version (manager_resource), id);
+  wl_resource_set_implementation (cr, &relative_pointer_implementation,
+                                  compositor, relative_pointer_destructor);
+  wl_list_insert (&pointer->relative_resource_list, wl_resource_get_link (cr));
+
+  pointer->relative_raw = wakefield_server_watch_raw_motion (priv->server);
+}
+
+static const struct zwp_relative_pointer_manager_v1_interface relative_pointer_manager_implementation = {
+  resource_release,
+  relative_pointer_manager_get_relative_pointer,
+};
+
+static void
+bind_relative_pointer_manager (struct wl_client *client,
+                               void *data,
+                               uint32_t version,
+                               uint32_t id)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &zwp_relative_pointer_manager_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &relative_pointer_manager_implementation, data, NULL);
+}
+
+#define POINTER_CONSTRAINTS_VERSION 1
 
-      xkb_keymap_unref (keymap);
+static void
+pointer_constraint_surface_committed (struct wl_listener *listener, void *data)
+{
+  struct WakefieldPointerConstraint *constraint =
+    wl_container_of (listener, constraint, surface_commit_listener);
+
+  if (constraint->has_pending_region)
+    {
+      g_clear_pointer (&constraint->region, cairo_region_destroy);
+      constraint->region = constraint->pending_region;
+      constraint->pending_region = NULL;
+      constraint->has_pending_region = FALSE;
     }
 
-  if (keyboard->keymap_fd != -1)
+  if (constraint->has_pending_hint)
     {
-      wl_resource_for_each (keyboard_resource, &keyboard->resource_list)
-        wl_keyboard_send_keymap (keyboard_resource,
-                                 WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
-                                 keyboard->keymap_fd,
-                                 keyboard->keymap_size);
+      constraint->has_hint = TRUE;
+      constraint->hint_x = constraint->pending_hint_x;
+      constraint->hint_y = constraint->pending_hint_y;
+      constraint->has_pending_hint = FALSE;
     }
+
+  maybe_activate_pointer_constraint (constraint->compositor);
 }
 
 static void
-wakefield_keyboard_init (WakefieldCompositor *compositor,
-                         struct WakefieldKeyboard *keyboard)
+pointer_constraint_surface_destroyed (struct wl_listener *listener, void *data)
 {
-  GdkDisplay *display = gtk_widget_get_display (GTK_WIDGET (compositor));
+  struct WakefieldPointerConstraint *constraint =
+    wl_container_of (listener, constraint, surface_destroy_listener);
 
-  wl_list_init (&keyboard->resource_list);
+  deactivate_pointer_constraint (constraint);
 
-  keyboard->context = xkb_context_new (XKB_CONTEXT_NO_FLAGS);
+  wl_list_remove (&constraint->surface_commit_listener.link);
+  wl_list_remove (&constraint->surface_destroy_listener.link);
+  wl_list_remove (&constraint->link);
+  wl_list_init (&constraint->link);
+  constraint->surface = NULL;
+  constraint->defunct = TRUE;
+}
 
-#if defined(GDK_WINDOWING_X11)
-  if (GDK_IS_X11_DISPLAY (display))
-    {
-      Display *xdisplay = gdk_x11_display_get_xdisplay (display);
-      xcb_connection_t *conn = XGetXCBConnection (xdisplay);
+static void
+pointer_constraint_destructor (struct wl_resource *resource)
+{
+  struct WakefieldPointerConstraint *constraint = wl_resource_get_user_data (resource);
 
-      keyboard->has_x11_xkb =
-        xkb_x11_setup_xkb_extension (conn,
-                                     XKB_X11_MIN_MAJOR_XKB_VERSION, XKB_X11_MIN_MINOR_XKB_VERSION,
-                                     0,
-                                     NULL, NULL, NULL, NULL);
+  if (constraint->surface)
+    {
+      deactivate_pointer_constraint (constraint);
+      wl_list_remove (&constraint->surface_commit_listener.link);
+      wl_list_remove (&constraint->surface_destroy_listener.link);
     }
-#endif
 
-  keyboard->keymap_fd = -1;
-  update_keymap (compositor, keyboard);
+  wl_list_remove (&constraint->link);
+  g_clear_pointer (&constraint->region, cairo_region_destroy);
+  g_clear_pointer (&constraint->pending_region, cairo_region_destroy);
+  g_slice_free (struct WakefieldPointerConstraint, constraint);
 }
 
-#define SEAT_VERSION 4
+static void
+pointer_constraint_set_region (struct wl_client   *client,
+                               struct wl_resource *resource,
+                               struct wl_resource *region_resource)
+{
+  struct WakefieldPointerConstraint *constraint = wl_resource_get_user_data (resource);
 
-static const struct wl_seat_interface seat_interface = {
-  seat_get_pointer,
-  seat_get_keyboard, /* get_keyboard */
-  NULL, /* get_touch */
-};
+  g_clear_pointer (&constraint->pending_region, cairo_region_destroy);
+  if (region_resource)
+    constraint->pending_region = wakefield_region_get_region (region_resource);
+  constraint->has_pending_region = TRUE;
+}
 
 static void
-wl_seat_destructor (struct wl_resource *resource)
+locked_pointer_set_cursor_position_hint (struct wl_client   *client,
+                                         struct wl_resource *resource,
+                                         wl_fixed_t          surface_x,
+                                         wl_fixed_t          surface_y)
 {
+  struct WakefieldPointerConstraint *constraint = wl_resource_get_user_data (resource);
+
+  constraint->pending_hint_x = wl_fixed_to_double (surface_x);
+  constraint->pending_hint_y = wl_fixed_to_double (surface_y);
+  constraint->has_pending_hint = TRUE;
 }
 
+static const struct zwp_locked_pointer_v1_interface locked_pointer_implementation = {
+  resource_release,
+  locked_pointer_set_cursor_position_hint,
+  pointer_constraint_set_region,
+};
+
+static const struct zwp_confined_pointer_v1_interface confined_pointer_implementation = {
+  resource_release,
+  pointer_constraint_set_region,
+};
+
 static void
-bind_seat (struct wl_client *client,
-           void *data,
-           uint32_t version,
-           uint32_t id)
-{
-  struct WaylandSeat *seat = data;
-  struct wl_resource *cr;
+pointer_constraints_create (struct wl_client   *client,
+                            struct wl_resource *constraints_resource,
+                            uint32_t            id,
+                            struct wl_resource *surface_resource,
+                            struct wl_resource *pointer_resource,
+                            struct wl_resource *region_resource,
+                            uint32_t            lifetime,
+                            gboolean            lock)
+{
+  struct WakefieldPointer *pointer = wl_resource_get_user_data (pointer_resource);
+  struct WakefieldPointerConstraint *constraint;
+
+  if (find_pointer_constraint (pointer, surface_resource) != NULL)
+    {
+      wl_resource_post_error (constraints_resource,
+                              ZWP_POINTER_CONSTRAINTS_V1_ERROR_ALREADY_CONSTRAINED,
+                              "the pointer is already constrained to this wl_surface");
+      return;
+    }
 
-  cr = wl_resource_create (client, &wl_seat_interface, version, id);
-  wl_resource_set_implementation (cr, &seat_interface, seat, wl_seat_destructor);
-  wl_seat_send_capabilities (cr, WL_SEAT_CAPABILITY_POINTER | WL_SEAT_CAPABILITY_KEYBOARD);
-  wl_seat_send_name (cr, "seat0");
+  constraint = g_slice_new0 (struct WakefieldPointerConstraint);
+  constraint->compositor = wakefield_surface_get_compositor (surface_resource);
+  constraint->surface = surface_resource;
+  constraint->lock = lock;
+  constraint->lifetime = lifetime;
+  if (region_resource)
+    constraint->region = wakefield_region_get_region (region_resource);
+
+  constraint->resource =
+    wl_resource_create (client,
+                        lock ? &zwp_locked_pointer_v1_interface : &zwp_confined_pointer_v1_interface,
+                        wl_resource_get_version (constraints_resource), id);
+  wl_resource_set_implementation (constraint->resource,
+                                  lock ? (const void *)&locked_pointer_implementation
+                                       : (const void *)&confined_pointer_implementation,
+                                  constraint, pointer_constraint_destructor);
+
+  wl_list_insert (&pointer->constraints, &constraint->link);
+  constraint->surface_destroy_listener.notify = pointer_constraint_surface_destroyed;
+  wl_resource_add_destroy_listener (surface_resource, &constraint->surface_destroy_listener);
+  constraint->surface_commit_listener.notify = pointer_constraint_surface_committed;
+  wakefield_surface_add_commit_listener (surface_resource, &constraint->surface_commit_listener);
+
+  maybe_activate_pointer_constraint (constraint->compositor);
 }
 
 static void
-wakefield_seat_init (WakefieldCompositor *compositor,
-                     struct WakefieldSeat *seat,
-                     struct wl_display    *wl_display)
+pointer_constraints_lock_pointer (struct wl_client   *client,
+                                  struct wl_resource *resource,
+                                  uint32_t            id,
+                                  struct wl_resource *surface_resource,
+                                  struct wl_resource *pointer_resource,
+                                  struct wl_resource *region_resource,
+                                  uint32_t            lifetime)
 {
-  wakefield_pointer_init (&seat->pointer);
-  wakefield_keyboard_init (compositor, &seat->keyboard);
-
-  wl_global_create (wl_display, &wl_seat_interface, SEAT_VERSION, seat, bind_seat);
+  pointer_constraints_create (client, resource, id, surface_resource,
+                              pointer_resource, region_resource, lifetime, TRUE);
 }
 
 static void
-bind_output (struct wl_client *client,
-             void *data,
-             uint32_t version,
-             uint32_t id)
+pointer_constraints_confine_pointer (struct wl_client   *client,
+                                     struct wl_resource *resource,
+                                     uint32_t            id,
+                                     struct wl_resource *surface_resource,
+                                     struct wl_resource *pointer_resource,
+                                     struct wl_resource *region_resource,
+                                     uint32_t            lifetime)
 {
-  WakefieldCompositor *compositor = data;
-  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  struct WakefieldOutput *output = &priv->output;
-  struct wl_resource *cr;
-
-  cr = wl_resource_create (client, &wl_output_interface, version, id);
-  wl_resource_set_implementation (cr, NULL, output, unbind_resource);
-  wl_list_insert (&output->resource_list, wl_resource_get_link (cr));
-
-  wl_output_send_geometry (cr,
-                           0, 0,
-                           0, 0, /* mm */
-                           0, /* subpixel */
-                           "Wakefield", "Gtk",
-                           WL_OUTPUT_TRANSFORM_NORMAL);
-
-  refresh_output (compositor, cr);
+  pointer_constraints_create (client, resource, id, surface_resource,
+                              pointer_resource, region_resource, lifetime, FALSE);
 }
 
-#define WL_OUTPUT_VERSION 2
+static const struct zwp_pointer_constraints_v1_interface pointer_constraints_implementation = {
+  resource_release,
+  pointer_constraints_lock_pointer,
+  pointer_constraints_confine_pointer,
+};
 
 static void
-wakefield_output_init (WakefieldCompositor *compositor)
+bind_pointer_constraints (struct wl_client *client,
+                          void *data,
+                          uint32_t version,
+                          uint32_t id)
 {
-  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  wl_list_init (&priv->output.resource_list);
-  wl_global_create (priv->wl_display, &wl_output_interface,
-                    WL_OUTPUT_VERSION, compositor, bind_output);
-}
+  struct wl_resource *cr;
 
-static GSource * wayland_event_source_new (struct wl_display *display);
+  cr = wl_resource_create (client, &zwp_pointer_constraints_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &pointer_constraints_implementation, data, NULL);
+}
 
 cairo_region_t *
 wakefield_region_get_region (struct wl_resource *region_resource)
@@ -1426,6 +2789,9 @@ wl_region_destructor (struct wl_resource *resource)
 {
   struct WakefieldRegion *region = wl_resource_get_user_data (resource);
 
+  wakefield_client_release (wl_resource_get_client (resource),
+                            WAKEFIELD_CLIENT_RESOURCE_REGIONS, 1);
+
   cairo_region_destroy (region->region);
   g_slice_free (struct WakefieldRegion, region);
 }
@@ -1435,8 +2801,12 @@ wl_compositor_create_region (struct wl_client *client,
                              struct wl_resource *compositor_resource,
                              uint32_t id)
 {
-  struct WakefieldRegion *region = g_slice_new0 (struct WakefieldRegion);
+  struct WakefieldRegion *region;
+
+  if (!wakefield_client_charge (client, WAKEFIELD_CLIENT_RESOURCE_REGIONS, 1))
+    return;
 
+  region = g_slice_new0 (struct WakefieldRegion);
   region->resource = wl_resource_create (client, &wl_region_interface, wl_resource_get_version (compositor_resource), id);
   wl_resource_set_implementation (region->resource, &region_interface, region, wl_region_destructor);
 
@@ -1452,6 +2822,9 @@ wakefield_compositor_surface_unmapped (WakefieldCompositor *compositor,
   struct WakefieldKeyboard *keyboard = &priv->seat.keyboard;
   struct wl_resource *xdg_surface = wakefield_surface_get_xdg_surface (surface);
 
+  if (pointer->active_constraint && pointer->active_constraint->surface == surface)
+    deactivate_pointer_constraint (pointer->active_constraint);
+
   if (keyboard->focus == surface)
     {
       wakefield_compositor_send_keyboard_leave (compositor, surface);
@@ -1486,7 +2859,7 @@ wakefield_compositor_surface_unmapped (WakefieldCompositor *compositor,
       pointer->current_surface = NULL;
     }
 
-  if (xdg_surface)
+  if (xdg_surface || is_overlay_popup (surface))
     gtk_widget_queue_draw (GTK_WIDGET (compositor));
 
 }
@@ -1518,6 +2891,9 @@ wl_compositor_create_surface (struct wl_client *client,
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *surface;
 
+  if (!wakefield_client_charge (client, WAKEFIELD_CLIENT_RESOURCE_SURFACES, 1))
+    return;
+
   surface = wakefield_surface_new (compositor, client, compositor_resource, id);
   wl_list_insert (&priv->surfaces, wl_resource_get_link (surface));
 }
@@ -1579,10 +2955,11 @@ xdg_get_xdg_surface (struct wl_client *client,
   xdg_surface = wakefield_xdg_surface_new (client, shell_resource, id, surface_resource);
   wl_list_insert (priv->xdg_surfaces.prev, wl_resource_get_link (xdg_surface));
 
-  output_resource = wl_resource_find_for_client (&priv->output.resource_list, client);
-  wl_surface_send_enter (surface_resource, output_resource);
+  output_resource = wakefield_client_get_binding (client, WAKEFIELD_CLIENT_BINDING_OUTPUT);
+  if (output_resource)
+    wl_surface_send_enter (surface_resource, output_resource);
 
-  send_xdg_configure_request (compositor, xdg_surface);
+  wakefield_compositor_send_xdg_configure (compositor, xdg_surface);
 }
 
 static void
@@ -1652,22 +3029,22 @@ xdg_get_xdg_popup (struct wl_client *client,
   xdg_popup = wakefield_xdg_popup_new (compositor, client, shell_resource, id, surface_resource, parent_resource, serial, x, y);
   wl_list_insert (&priv->xdg_popups, wl_resource_get_link (xdg_popup));
 
-  output_resource = wl_resource_find_for_client (&priv->output.resource_list, client);
-  wl_surface_send_enter (surface_resource, output_resource);
+  output_resource = wakefield_client_get_binding (client, WAKEFIELD_CLIENT_BINDING_OUTPUT);
+  if (output_resource)
+    wl_surface_send_enter (surface_resource, output_resource);
 
   if (wakefield_xdg_popup_get_serial (xdg_popup) == pointer->grab_serial)
     {
+      /* The popup grab takes over the pointer */
+      if (pointer->active_constraint)
+        deactivate_pointer_constraint (pointer->active_constraint);
+
       pointer->grab_popup_surface = surface_resource;
       gdk_device_grab (pointer->grab_device,
                        wakefield_surface_get_window (parent_resource),
                        GDK_OWNERSHIP_NONE,
                        TRUE,
-                       GDK_POINTER_MOTION_MASK |
-                       GDK_BUTTON_PRESS_MASK |
-                       GDK_BUTTON_RELEASE_MASK |
-                       GDK_SCROLL_MASK |
-                       GDK_ENTER_NOTIFY_MASK |
-                       GDK_LEAVE_NOTIFY_MASK,
+                       GRAB_EVENT_MASK,
                        NULL,
                        pointer->grab_time);
     }
@@ -1677,13 +3054,95 @@ xdg_get_xdg_popup (struct wl_client *client,
     }
 }
 
+/* Clients get pinged every PING_INTERVAL, and are considered hung when
+   they didn't answer by the next one */
+#define PING_INTERVAL 5 /* s */
+
+static void
+emit_client_signal (WakefieldCompositor *compositor,
+                    guint                signal_id,
+                    struct wl_client    *client)
+{
+  gpointer client_data;
+  GPid pid;
+
+  wakefield_client_get_identity (client, &pid, &client_data);
+  g_signal_emit (compositor, signal_id, 0, pid, client_data);
+}
+
+static gboolean
+ping_clients (gpointer user_data)
+{
+  WakefieldCompositor *compositor = user_data;
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *shell_resource;
+  gint64 now = g_get_monotonic_time ();
+
+  if (wl_list_empty (&priv->shell_resources))
+    {
+      priv->ping_source_id = 0;
+      return G_SOURCE_REMOVE;
+    }
+
+  wl_resource_for_each (shell_resource, &priv->shell_resources)
+    {
+      struct wl_client *client = wl_resource_get_client (shell_resource);
+      gint64 ping_time;
+      guint32 serial;
+
+      if (wakefield_client_get_ping (client, &ping_time))
+        {
+          /* The timeout may fire a bit early, so allow for that */
+          if (now - ping_time >= PING_INTERVAL * G_USEC_PER_SEC / 2 &&
+              !wakefield_client_is_unresponsive (client))
+            {
+              wakefield_client_set_unresponsive (client);
+              emit_client_signal (compositor, signals[CLIENT_NOT_RESPONDING], client);
+            }
+          continue;
+        }
+
+      /* 0 means no ping outstanding */
+      serial = wl_display_next_serial (priv->wl_display);
+      if (serial == 0)
+        serial = wl_display_next_serial (priv->wl_display);
+
+      wakefield_client_set_ping (client, serial, now);
+      xdg_shell_send_ping (shell_resource, serial);
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Whatever we held back while the client was hung goes out now */
+static void
+client_responding (WakefieldCompositor *compositor,
+                   struct wl_client    *client)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+  struct wl_resource *surface_resource;
+
+  wl_resource_for_each (surface_resource, &priv->surfaces)
+    {
+      if (wl_resource_get_client (surface_resource) == client)
+        wakefield_surface_send_frame_callbacks (surface_resource);
+    }
+
+  if (!wakefield_client_is_backed_up (client))
+    wakefield_compositor_client_unblocked (compositor, client);
+
+  emit_client_signal (compositor, signals[CLIENT_RESPONDING], client);
+}
+
 static void
 xdg_pong (struct wl_client *client,
           struct wl_resource *resource,
           uint32_t serial)
 {
-  wl_resource_post_error (resource, 1,
-                          "xdg-shell:: pong not implemented yet.");
+  WakefieldCompositor *compositor = wl_resource_get_user_data (resource);
+
+  if (wakefield_client_pong (client, serial))
+    client_responding (compositor, client);
 }
 
 static const struct xdg_shell_interface xdg_implementation = {
@@ -1699,13 +3158,16 @@ static const struct xdg_shell_interface xdg_implementation = {
 static void
 bind_xdg_shell(struct wl_client *client, void *data, uint32_t version, uint32_t id)
 {
-  WakefieldCompositor *compositor = data;
+  WakefieldCompositor *compositor = wakefield_server_get_client_compositor (data, client);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
   struct wl_resource *cr;
 
   cr = wl_resource_create (client,  &xdg_shell_interface, XDG_SHELL_VERSION, id);
   wl_resource_set_implementation (cr, &xdg_implementation, compositor, unbind_resource);
   wl_list_insert (&priv->shell_resources, wl_resource_get_link (cr));
+
+  if (priv->ping_source_id == 0)
+    priv->ping_source_id = g_timeout_add_seconds (PING_INTERVAL, ping_clients, compositor);
 }
 
 static void
@@ -1714,14 +3176,176 @@ bind_compositor (struct wl_client *client,
                  uint32_t version,
                  uint32_t id)
 {
-  WakefieldCompositor *compositor = data;
+  WakefieldCompositor *compositor = wakefield_server_get_client_compositor (data, client);
   struct wl_resource *cr;
 
   cr = wl_resource_create (client, &wl_compositor_interface, version, id);
   wl_resource_set_implementation (cr, &compositor_interface, compositor, NULL);
 }
 
-#define WL_COMPOSITOR_VERSION 3
+#define WL_COMPOSITOR_VERSION 6
+
+static void
+fifo_manager_get_fifo (struct wl_client *client,
+                       struct wl_resource *manager_resource,
+                       uint32_t id,
+                       struct wl_resource *surface_resource)
+{
+  if (wakefield_surface_get_fifo (surface_resource) != NULL)
+    {
+      wl_resource_post_error (manager_resource,
+                              WP_FIFO_MANAGER_V1_ERROR_ALREADY_EXISTS,
+                              "This wl_surface already has a wp_fifo_v1");
+      return;
+    }
+
+  wakefield_fifo_new (client, manager_resource, id, surface_resource);
+}
+
+static const struct wp_fifo_manager_v1_interface fifo_manager_implementation = {
+  resource_release,
+  fifo_manager_get_fifo
+};
+
+static void
+bind_fifo_manager (struct wl_client *client,
+                   void *data,
+                   uint32_t version,
+                   uint32_t id)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wp_fifo_manager_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &fifo_manager_implementation, data, NULL);
+}
+
+#define FIFO_MANAGER_VERSION 1
+
+static void
+commit_timing_manager_get_timer (struct wl_client *client,
+                                 struct wl_resource *manager_resource,
+                                 uint32_t id,
+                                 struct wl_resource *surface_resource)
+{
+  if (wakefield_surface_get_commit_timer (surface_resource) != NULL)
+    {
+      wl_resource_post_error (manager_resource,
+                              WP_COMMIT_TIMING_MANAGER_V1_ERROR_COMMIT_TIMER_EXISTS,
+                              "This wl_surface already has a wp_commit_timer_v1");
+      return;
+    }
+
+  wakefield_commit_timer_new (client, manager_resource, id, surface_resource);
+}
+
+static const struct wp_commit_timing_manager_v1_interface commit_timing_manager_implementation = {
+  resource_release,
+  commit_timing_manager_get_timer
+};
+
+static void
+bind_commit_timing_manager (struct wl_client *client,
+                            void *data,
+                            uint32_t version,
+                            uint32_t id)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wp_commit_timing_manager_v1_interface, version, id);
+  wl_resource_set_implementation (cr, &commit_timing_manager_implementation, data, NULL);
+}
+
+#define COMMIT_TIMING_MANAGER_VERSION 1
+
+static void
+viewporter_get_viewport (struct wl_client *client,
+                         struct wl_resource *viewporter_resource,
+                         uint32_t id,
+                         struct wl_resource *surface_resource)
+{
+  if (wakefield_surface_get_viewport (surface_resource) != NULL)
+    {
+      wl_resource_post_error (viewporter_resource,
+                              WP_VIEWPORTER_ERROR_VIEWPORT_EXISTS,
+                              "This wl_surface already has a wp_viewport");
+      return;
+    }
+
+  wakefield_viewport_new (client, viewporter_resource, id, surface_resource);
+}
+
+static const struct wp_viewporter_interface viewporter_implementation = {
+  resource_release,
+  viewporter_get_viewport
+};
+
+static void
+bind_viewporter (struct wl_client *client,
+                 void *data,
+                 uint32_t version,
+                 uint32_t id)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &wp_viewporter_interface, version, id);
+  wl_resource_set_implementation (cr, &viewporter_implementation, data, NULL);
+}
+
+#define VIEWPORTER_VERSION 1
+
+/* We are embedded in a host window that already has a frame, so we ask
+   clients to leave out their titlebars and shadows. Those that insist
+   get to draw them, clipped to their window geometry. */
+#define DEFAULT_DECORATION_MODE ORG_KDE_KWIN_SERVER_DECORATION_MANAGER_MODE_SERVER
+
+static void
+server_decoration_request_mode (struct wl_client *client,
+                                struct wl_resource *resource,
+                                uint32_t mode)
+{
+  if (mode > ORG_KDE_KWIN_SERVER_DECORATION_MODE_SERVER)
+    mode = DEFAULT_DECORATION_MODE;
+
+  org_kde_kwin_server_decoration_send_mode (resource, mode);
+}
+
+static const struct org_kde_kwin_server_decoration_interface server_decoration_implementation = {
+  resource_release,
+  server_decoration_request_mode
+};
+
+static void
+server_decoration_manager_create (struct wl_client *client,
+                                  struct wl_resource *manager_resource,
+                                  uint32_t id,
+                                  struct wl_resource *surface_resource)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &org_kde_kwin_server_decoration_interface,
+                           wl_resource_get_version (manager_resource), id);
+  wl_resource_set_implementation (cr, &server_decoration_implementation, NULL, NULL);
+  org_kde_kwin_server_decoration_send_mode (cr, DEFAULT_DECORATION_MODE);
+}
+
+static const struct org_kde_kwin_server_decoration_manager_interface server_decoration_manager_implementation = {
+  server_decoration_manager_create
+};
+
+static void
+bind_server_decoration_manager (struct wl_client *client,
+                                void *data,
+                                uint32_t version,
+                                uint32_t id)
+{
+  struct wl_resource *cr;
+
+  cr = wl_resource_create (client, &org_kde_kwin_server_decoration_manager_interface, version, id);
+  wl_resource_set_implementation (cr, &server_decoration_manager_implementation, data, NULL);
+  org_kde_kwin_server_decoration_manager_send_default_mode (cr, DEFAULT_DECORATION_MODE);
+}
+
+#define SERVER_DECORATION_MANAGER_VERSION 1
 
 struct wl_display *
 wakefield_compositor_get_display (WakefieldCompositor *compositor)
@@ -1731,6 +3355,43 @@ wakefield_compositor_get_display (WakefieldCompositor *compositor)
   return priv->wl_display;
 }
 
+/* The globals belong to the server, and are shared by all its
+   compositors. Binding them finds the compositor of the client. */
+void
+wakefield_compositor_create_globals (WakefieldServer *server)
+{
+  struct wl_display *wl_display = wakefield_server_get_display (server);
+
+  wl_global_create (wl_display, &wl_compositor_interface,
+                    WL_COMPOSITOR_VERSION, server, bind_compositor);
+  wl_global_create (wl_display, &xdg_shell_interface,
+                    XDG_SHELL_VERSION, server, bind_xdg_shell);
+  wl_global_create (wl_display, &wp_fifo_manager_v1_interface,
+                    FIFO_MANAGER_VERSION, server, bind_fifo_manager);
+  wl_global_create (wl_display, &wp_commit_timing_manager_v1_interface,
+                    COMMIT_TIMING_MANAGER_VERSION, server, bind_commit_timing_manager);
+  wl_global_create (wl_display, &wp_viewporter_interface,
+                    VIEWPORTER_VERSION, server, bind_viewporter);
+  wl_global_create (wl_display, &org_kde_kwin_server_decoration_manager_interface,
+                    SERVER_DECORATION_MANAGER_VERSION, server, bind_server_decoration_manager);
+  wl_global_create (wl_display, &wl_seat_interface,
+                    SEAT_VERSION, server, bind_seat);
+  wl_global_create (wl_display, &wl_output_interface,
+                    WL_OUTPUT_VERSION, server, bind_output);
+  wl_global_create (wl_display, &zwp_relative_pointer_manager_v1_interface,
+                    RELATIVE_POINTER_MANAGER_VERSION, server, bind_relative_pointer_manager);
+  wl_global_create (wl_display, &zwp_pointer_constraints_v1_interface,
+                    POINTER_CONSTRAINTS_VERSION, server, bind_pointer_constraints);
+}
+
+struct WakefieldDataDevice *
+wakefield_compositor_get_data_device (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->data_device;
+}
+
 static void
 wakefield_compositor_init (WakefieldCompositor *compositor)
 {
@@ -1739,28 +3400,31 @@ wakefield_compositor_init (WakefieldCompositor *compositor)
   gtk_widget_set_has_window (GTK_WIDGET (compositor), FALSE);
   gtk_widget_set_can_focus (GTK_WIDGET (compositor), TRUE);
 
-  priv->wl_display = wl_display_create ();
-  wl_display_init_shm (priv->wl_display);
+  wl_list_init (&priv->shell_resources);
+  wl_list_init (&priv->surfaces);
+  wl_list_init (&priv->xdg_surfaces);
+  wl_list_init (&priv->xdg_popups);
+}
 
-  wl_global_create (priv->wl_display, &wl_compositor_interface,
-                    WL_COMPOSITOR_VERSION, compositor, bind_compositor);
+static void
+wakefield_compositor_constructed (GObject *object)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-  wl_global_create (priv->wl_display, &xdg_shell_interface,
-                    XDG_SHELL_VERSION, compositor, bind_xdg_shell);
-  wl_list_init (&priv->shell_resources);
+  G_OBJECT_CLASS (wakefield_compositor_parent_class)->constructed (object);
 
-  priv->data_device = wakefield_data_device_new (compositor);
+  /* Without one we get a server of our own */
+  if (priv->server == NULL)
+    priv->server = wakefield_server_new ();
 
-  wakefield_seat_init (compositor, &priv->seat, priv->wl_display);
-  wakefield_output_init (compositor);
+  priv->wl_display = wakefield_server_get_display (priv->server);
+  wakefield_server_add_compositor (priv->server, compositor);
 
-  wl_list_init (&priv->surfaces);
-  wl_list_init (&priv->xdg_surfaces);
-  wl_list_init (&priv->xdg_popups);
+  priv->data_device = wakefield_data_device_new (compositor);
 
-  /* Attach the wl_event_loop to ours */
-  priv->wayland_source = wayland_event_source_new (priv->wl_display);
-  g_source_attach (priv->wayland_source, NULL);
+  wakefield_seat_init (compositor, &priv->seat);
+  wakefield_output_init (compositor);
 }
 
 WakefieldCompositor *
@@ -1769,6 +3433,20 @@ wakefield_compositor_new (void)
   return g_object_new (WAKEFIELD_TYPE_COMPOSITOR, NULL);
 }
 
+WakefieldCompositor *
+wakefield_compositor_new_for_server (WakefieldServer *server)
+{
+  return g_object_new (WAKEFIELD_TYPE_COMPOSITOR, "server", server, NULL);
+}
+
+WakefieldServer *
+wakefield_compositor_get_server (WakefieldCompositor *compositor)
+{
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  return priv->server;
+}
+
 gboolean
 wakefield_compositor_add_socket (WakefieldCompositor *compositor,
                                  const char *name,
@@ -1776,20 +3454,7 @@ wakefield_compositor_add_socket (WakefieldCompositor *compositor,
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-  if (wl_display_add_socket (priv->wl_display, name) != 0)
-    {
-      int errsv = errno;
-
-      g_set_error (error,
-                   G_IO_ERROR,
-                   g_io_error_from_errno (errsv),
-                   _("Error adding wayland display '%s' socket: %s"),
-                   name ? name : "NULL",
-                   strerror (errsv));
-      return FALSE;
-    }
-
-  return TRUE;
+  return wakefield_server_add_socket (priv->server, compositor, name, error);
 }
 
 
@@ -1798,36 +3463,8 @@ wakefield_compositor_add_socket_auto (WakefieldCompositor *compositor,
                                       GError **error)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  const char *name;
-
-  name = wl_display_add_socket_auto (priv->wl_display);
-  if (name == NULL)
-    {
-      int errsv = errno;
-
-      g_set_error (error,
-                   G_IO_ERROR,
-                   g_io_error_from_errno (errsv),
-                   _("Error adding automatic socket: %s"),
-                   strerror (errsv));
-      return NULL;
-    }
 
-  return name;
-}
-
-typedef struct {
-  struct wl_listener listener;
-  GDestroyNotify destroy_notify;
-  gpointer user_data;
-} WakefieldClientDestroyListener;
-
-static void
-client_destroyed (struct wl_listener *listener, void *data)
-{
-  WakefieldClientDestroyListener *w_listener = (WakefieldClientDestroyListener *)listener;
-
-  w_listener->destroy_notify (w_listener->user_data);
+  return wakefield_server_add_socket_auto (priv->server, compositor, error);
 }
 
 int
@@ -1837,34 +3474,62 @@ wakefield_compositor_create_client_fd (WakefieldCompositor *compositor,
                                        GError **error)
 {
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
-  struct wl_client *client;
-  int fds[2];
 
-  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
-    {
-      int errsv = errno;
+  return wakefield_server_create_client_fd (priv->server, compositor,
+                                            destroy_notify, user_data, error);
+}
+
+static void
+wakefield_compositor_set_property (GObject      *object,
+                                   guint         prop_id,
+                                   const GValue *value,
+                                   GParamSpec   *pspec)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-      g_set_error (error,
-                   G_IO_ERROR,
-                   g_io_error_from_errno (errsv),
-                   _("Error creating wayland socketpair: %s"),
-                   strerror (errsv));
-      return -1;
+  switch (prop_id)
+    {
+    case PROP_SERVER:
+      priv->server = g_value_dup_object (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
     }
+}
 
-  client = wl_client_create (priv->wl_display, fds[0]);
+static void
+wakefield_compositor_get_property (GObject    *object,
+                                   guint       prop_id,
+                                   GValue     *value,
+                                   GParamSpec *pspec)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-  if (destroy_notify)
+  switch (prop_id)
     {
-      WakefieldClientDestroyListener *listener = g_new0 (WakefieldClientDestroyListener, 1);
-      listener->listener.notify = client_destroyed;
-      listener->destroy_notify = destroy_notify;
-      listener->user_data = user_data;
-
-      wl_client_add_destroy_listener (client, &listener->listener);
+    case PROP_SERVER:
+      g_value_set_object (value, priv->server);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
     }
+}
+
+static void
+wakefield_compositor_dispose (GObject *object)
+{
+  WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
+  WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
+
+  /* Our clients go away with us, the server and its other widgets stay */
+  if (priv->server)
+    wakefield_server_remove_compositor (priv->server, compositor);
 
-  return fds[1];
+  G_OBJECT_CLASS (wakefield_compositor_parent_class)->dispose (object);
 }
 
 static void
@@ -1873,8 +3538,17 @@ wakefield_compositor_finalize (GObject *object)
   WakefieldCompositor *compositor = WAKEFIELD_COMPOSITOR (object);
   WakefieldCompositorPrivate *priv = wakefield_compositor_get_instance_private (compositor);
 
-  g_source_destroy (priv->wayland_source);
-  wl_display_destroy (priv->wl_display);
+  if (priv->frame_callback_source_id != 0)
+    g_source_remove (priv->frame_callback_source_id);
+
+  if (priv->ping_source_id != 0)
+    g_source_remove (priv->ping_source_id);
+
+  if (priv->seat.pointer.frame_idle_id != 0)
+    g_source_remove (priv->seat.pointer.frame_idle_id);
+
+  wakefield_data_device_free (priv->data_device);
+  g_object_unref (priv->server);
 
   G_OBJECT_CLASS (wakefield_compositor_parent_class)->finalize (object);
 }
@@ -1886,6 +3560,10 @@ wakefield_compositor_class_init (WakefieldCompositorClass *klass)
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
+  gobject_class->constructed = wakefield_compositor_constructed;
+  gobject_class->set_property = wakefield_compositor_set_property;
+  gobject_class->get_property = wakefield_compositor_get_property;
+  gobject_class->dispose = wakefield_compositor_dispose;
   gobject_class->finalize = wakefield_compositor_finalize;
 
   widget_class->realize = wakefield_compositor_realize;
@@ -1905,61 +3583,34 @@ wakefield_compositor_class_init (WakefieldCompositorClass *klass)
   widget_class->focus_out_event = wakefield_compositor_focus_out_event;
   widget_class->key_press_event = wakefield_compositor_key_press_event;
   widget_class->key_release_event = wakefield_compositor_key_release_event;
-}
-
-/* Wayland GSource */
-
-typedef struct
-{
-  GSource source;
-  struct wl_display *display;
-} WaylandEventSource;
-
-static gboolean
-wayland_event_source_prepare (GSource *base, int *timeout)
-{
-  WaylandEventSource *source = (WaylandEventSource *)base;
-
-  *timeout = -1;
-
-  wl_display_flush_clients (source->display);
-
-  return FALSE;
-}
-
-static gboolean
-wayland_event_source_dispatch (GSource *base,
-                               GSourceFunc callback,
-                               void *data)
-{
-  WaylandEventSource *source = (WaylandEventSource *)base;
-  struct wl_event_loop *loop = wl_display_get_event_loop (source->display);
-
-  wl_event_loop_dispatch (loop, 0);
-
-  return TRUE;
-}
-
-static GSourceFuncs wayland_event_source_funcs =
-{
-  wayland_event_source_prepare,
-  NULL,
-  wayland_event_source_dispatch,
-  NULL
-};
-
-static GSource *
-wayland_event_source_new (struct wl_display *display)
-{
-  WaylandEventSource *source;
-  struct wl_event_loop *loop = wl_display_get_event_loop (display);
-
-  source = (WaylandEventSource *) g_source_new (&wayland_event_source_funcs,
-                                                sizeof (WaylandEventSource));
-  source->display = display;
-  g_source_add_unix_fd (&source->source,
-                        wl_event_loop_get_fd (loop),
-                        G_IO_IN | G_IO_ERR);
 
-  return &source->source;
+  g_object_class_install_property (gobject_class,
+                                   PROP_SERVER,
+                                   g_param_spec_object ("server",
+                                                        "Server",
+                                                        "The server this compositor's clients connect to",
+                                                        WAKEFIELD_TYPE_SERVER,
+                                                        G_PARAM_READWRITE |
+                                                        G_PARAM_CONSTRUCT_ONLY |
+                                                        G_PARAM_STATIC_STRINGS));
+
+  /* A client stopped answering pings. Until it answers again it gets no
+     frame callbacks and only coalesced input. The arguments identify it:
+     the pid of a client that connected through a socket, or 0 and the
+     user_data given to wakefield_compositor_create_client_fd(), whose
+     peer pid would be our own. */
+  signals[CLIENT_NOT_RESPONDING] = g_signal_new ("client-not-responding",
+                                                 G_TYPE_FROM_CLASS (klass),
+                                                 G_SIGNAL_RUN_LAST,
+                                                 0,
+                                                 NULL, NULL, NULL,
+                                                 G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_POINTER);
+
+  /* A client that was not responding answered a ping */
+  signals[CLIENT_RESPONDING] = g_signal_new ("client-responding",
+                                             G_TYPE_FROM_CLASS (klass),
+                                             G_SIGNAL_RUN_LAST,
+                                             0,
+                                             NULL, NULL, NULL,
+                                             G_TYPE_NONE, 2, G_TYPE_INT, G_TYPE_POINTER);
 }
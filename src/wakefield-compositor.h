@@ -24,6 +24,8 @@
 
 #include <gtk/gtk.h>
 
+#include "wakefield-server.h"
+
 #define WAKEFIELD_TYPE_COMPOSITOR            (wakefield_compositor_get_type ())
 #define WAKEFIELD_COMPOSITOR(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), WAKEFIELD_TYPE_COMPOSITOR, WakefieldCompositor))
 #define WAKEFIELD_COMPOSITOR_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass),  WAKEFIELD_TYPE_COMPOSITOR, WakefieldCompositorClass))
@@ -47,6 +49,8 @@ struct _WakefieldCompositorClass
 GType wakefield_compositor_get_type (void) G_GNUC_CONST;
 
 WakefieldCompositor *wakefield_compositor_new              (void);
+WakefieldCompositor *wakefield_compositor_new_for_server   (WakefieldServer     *server);
+WakefieldServer *    wakefield_compositor_get_server       (WakefieldCompositor *compositor);
 const char *         wakefield_compositor_add_socket_auto  (WakefieldCompositor *compositor,
                                                             GError              **error);
 gboolean             wakefield_compositor_add_socket       (WakefieldCompositor *compositor,
@@ -56,3 +60,6 @@ int                  wakefield_compositor_create_client_fd (WakefieldCompositor
                                                             GDestroyNotify       destroy_notify,
                                                             gpointer             user_data,
                                                             GError             **error);
+void                 wakefield_compositor_set_low_latency  (WakefieldCompositor *compositor,
+                                                            gboolean             low_latency);
+gboolean             wakefield_compositor_get_low_latency  (WakefieldCompositor *compositor);
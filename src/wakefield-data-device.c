@@ -20,71 +20,1326 @@
  *     Alexander Larsson <alexl@redhat.com>
  */
 
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
 #include <sys/time.h>
 
-#include "wakefield-private.h"
-#include "xdg-shell-server-protocol.h"
+#include <glib-unix.h>
+
+#include "wakefield-private.h"
+#include "xdg-shell-server-protocol.h"
+
+/* How long a client that owns the selection gets to produce each chunk
+   of it when the host pastes */
+#define SOURCE_READ_TIMEOUT_MS 1000
+/* ... and for all of it, and how much of it we hold in memory */
+#define SOURCE_READ_TOTAL_TIMEOUT_MS 5000
+#define SOURCE_READ_MAX_SIZE (64 * 1024 * 1024)
+
+struct WakefieldDataDevice {
+  WakefieldCompositor *compositor;
+
+  struct wl_list data_source_resources;
+  struct wl_list manager_resources;
+  struct wl_list device_resources;
+  struct wl_list offer_resources;
+
+  GtkClipboard *clipboard;
+  gulong owner_change_id;
+  /* Bumped whenever the selection changes, to drop stale replies */
+  guint selection_serial;
+
+  /* The selection is either a client's source, or the host's, with
+     host_mime_types being NULL if there is none */
+  struct WakefieldDataSource *selection;
+  GPtrArray *host_mime_types;
+  /* Mime type -> WakefieldCacheEntry, of the host selection */
+  GHashTable *host_cache;
+
+  struct wl_client *focus_client;
+
+  struct WakefieldDrag *drag;
+  /* WakefieldDragRequest, for data of host drags on its way */
+  GSList *drag_requests;
+};
+
+struct WakefieldDataSource {
+  struct WakefieldDataDevice *data_device;
+  struct wl_resource *resource;
+  GPtrArray *mime_types;
+};
+
+struct WakefieldDataOffer {
+  struct WakefieldDataDevice *data_device;
+  struct wl_resource *resource;
+  /* NULL for host offers, and for offers whose source is gone */
+  struct WakefieldDataSource *source;
+  gboolean host;
+
+  /* The drag it was sent with the enter of, until that leaves */
+  struct WakefieldDrag *drag;
+  /* Of host drags; finished once the offer that got the drop goes */
+  GdkDragContext *host_context;
+  gboolean dropped;
+};
+
+/* A drag of a client, within the widget or out to the host, or of the
+   host into the widget */
+struct WakefieldDrag {
+  struct WakefieldDataDevice *data_device;
+  struct wl_client *client;
+  /* NULL for drags within a client, and from the host */
+  struct WakefieldDataSource *source;
+  GdkDragContext *host_context;
+  /* What the offers list, NULL for drags within a client */
+  GPtrArray *mime_types;
+  /* Set once GTK took a client drag out of the widget */
+  GdkDragContext *out_context;
+  guint host_leave_id;
+
+  /* The icon is only turned into an image when it is committed */
+  struct wl_resource *icon;
+  struct wl_listener icon_commit_listener;
+  struct wl_listener icon_destroy_listener;
+  cairo_surface_t *icon_image;
+  int icon_width, icon_height;
+  gboolean icon_drawn;
+  double icon_x, icon_y;
+
+  struct wl_resource *focus;
+  struct wl_listener focus_listener;
+  gboolean accepted;
+
+  /* In compositor coordinates, and relative to the focus */
+  gboolean has_position;
+  double x, y;
+  double focus_x, focus_y;
+  guint32 time;
+  gboolean motion_pending;
+  guint tick_id;
+};
+
+static void send_selection (struct WakefieldDataDevice *data_device,
+                            struct wl_resource *device_resource);
+static void end_drag (struct WakefieldDrag *drag);
+
+static void
+data_source_offer (struct wl_client *client,
+                   struct wl_resource *source_resource,
+                   const char *type)
+{
+  struct WakefieldDataSource *data_source = wl_resource_get_user_data (source_resource);
+
+  g_ptr_array_add (data_source->mime_types, g_strdup (type));
+}
+
+
+static void
+data_source_destroy (struct wl_client *client, struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static struct wl_data_source_interface data_source_implementation = {
+  data_source_offer,
+  data_source_destroy
+};
+
+static void
+data_source_finalize (struct wl_resource *resource)
+{
+  struct WakefieldDataSource *data_source = wl_resource_get_user_data (resource);
+  struct WakefieldDataDevice *data_device = data_source->data_device;
+  struct wl_resource *offer_resource, *device_resource;
+
+  wl_list_remove (wl_resource_get_link (resource));
+
+  wl_resource_for_each (offer_resource, &data_device->offer_resources)
+    {
+      struct WakefieldDataOffer *offer = wl_resource_get_user_data (offer_resource);
+
+      if (offer->source == data_source)
+        offer->source = NULL;
+    }
+
+  /* The source resource is going away, so the drag must not send
+     anything to it on the way out */
+  if (data_device->drag && data_device->drag->source == data_source)
+    {
+      data_device->drag->source = NULL;
+      end_drag (data_device->drag);
+    }
+
+  if (data_device->selection == data_source)
+    {
+      data_device->selection = NULL;
+      data_device->selection_serial++;
+
+      if (gtk_clipboard_get_owner (data_device->clipboard) == G_OBJECT (data_device->compositor))
+        gtk_clipboard_clear (data_device->clipboard);
+
+      wl_resource_for_each (device_resource, &data_device->device_resources)
+        send_selection (data_device, device_resource);
+    }
+
+  g_ptr_array_unref (data_source->mime_types);
+  g_slice_free (struct WakefieldDataSource, data_source);
+}
+
+
+static void
+create_data_source (struct wl_client *client,
+                    struct wl_resource *manager_resource,
+                    uint32_t id)
+{
+  struct WakefieldDataDevice *data_device = wl_resource_get_user_data (manager_resource);
+  struct WakefieldDataSource *data_source;
+
+  data_source = g_slice_new0 (struct WakefieldDataSource);
+  data_source->data_device = data_device;
+  data_source->mime_types = g_ptr_array_new_with_free_func (g_free);
+
+  data_source->resource = wl_resource_create (client, &wl_data_source_interface, 1, id);
+  wl_resource_set_implementation (data_source->resource, &data_source_implementation,
+                                  data_source, data_source_finalize);
+  wl_list_insert (&data_device->data_source_resources,
+                  wl_resource_get_link (data_source->resource));
+}
+
+/* Host clipboard contents, per mime type, in a sealed file that every
+   reader is streamed from. Entries are dropped from the cache when the
+   host clipboard changes, but live on until their readers are done. */
+typedef struct {
+  gint ref_count;
+  char *mime_type;
+  /* -1 until it is loaded, and if that fails */
+  int fd;
+  gsize size;
+  gboolean loading;
+  /* Reader fds waiting for it to load */
+  GSList *waiters;
+} WakefieldCacheEntry;
+
+static WakefieldCacheEntry *
+wakefield_cache_entry_ref (WakefieldCacheEntry *entry)
+{
+  g_atomic_int_inc (&entry->ref_count);
+  return entry;
+}
+
+static void
+wakefield_cache_entry_unref (WakefieldCacheEntry *entry)
+{
+  if (!g_atomic_int_dec_and_test (&entry->ref_count))
+    return;
+
+  g_assert (entry->waiters == NULL);
+  if (entry->fd >= 0)
+    close (entry->fd);
+  g_free (entry->mime_type);
+  g_slice_free (WakefieldCacheEntry, entry);
+}
+
+/* Streams to readers from the main loop, a pipe full at a time, so
+   neither a slow reader nor a big paste holds anything up, and a reader
+   that never reads costs us no more than its fd */
+typedef struct {
+  int fd;
+  WakefieldCacheEntry *entry;
+  off_t offset;
+} WakefieldTransfer;
+
+static void
+wakefield_transfer_free (WakefieldTransfer *transfer)
+{
+  close (transfer->fd);
+  wakefield_cache_entry_unref (transfer->entry);
+  g_slice_free (WakefieldTransfer, transfer);
+}
+
+/* The pages go from the file to the reader in the kernel, until its
+   pipe is full. Readers that go away get EPIPE here, rather than taking
+   us down with SIGPIPE. Returns TRUE if there is more to send once the
+   reader made room. */
+static gboolean
+send_to_reader (WakefieldTransfer *transfer)
+{
+  int fd = transfer->fd;
+  int file_fd = transfer->entry->fd;
+  gsize size = transfer->entry->size;
+  sigset_t sigpipe, old_mask;
+  gboolean got_sigpipe = FALSE;
+  gboolean more = FALSE;
+
+  sigemptyset (&sigpipe);
+  sigaddset (&sigpipe, SIGPIPE);
+  pthread_sigmask (SIG_BLOCK, &sigpipe, &old_mask);
+
+  while ((gsize) transfer->offset < size)
+    {
+      gssize bytes_sent = sendfile (fd, file_fd, &transfer->offset,
+                                    size - transfer->offset);
+
+      /* Readers that can't take sendfile get it copied */
+      if (bytes_sent < 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+          guint8 buf[65536];
+
+          bytes_sent = pread (file_fd, buf, MIN (sizeof buf, size - transfer->offset),
+                              transfer->offset);
+          if (bytes_sent > 0)
+            bytes_sent = write (fd, buf, bytes_sent);
+          if (bytes_sent > 0)
+            transfer->offset += bytes_sent;
+        }
+
+      if (bytes_sent < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          more = errno == EAGAIN;
+          got_sigpipe = errno == EPIPE;
+          break;
+        }
+
+      if (bytes_sent == 0)
+        break;
+    }
+
+  if (got_sigpipe)
+    {
+      struct timespec zero = { 0, 0 };
+
+      sigtimedwait (&sigpipe, NULL, &zero);
+    }
+  pthread_sigmask (SIG_SETMASK, &old_mask, NULL);
+
+  return more;
+}
+
+static gboolean
+reader_ready (gint         fd,
+              GIOCondition condition,
+              gpointer     user_data)
+{
+  WakefieldTransfer *transfer = user_data;
+
+  if (send_to_reader (transfer))
+    return G_SOURCE_CONTINUE;
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+start_transfer (WakefieldCacheEntry *entry,
+                int                  fd)
+{
+  WakefieldTransfer *transfer;
+
+  if (entry->fd < 0 ||
+      fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) < 0)
+    {
+      close (fd);
+      return;
+    }
+
+  transfer = g_slice_new0 (WakefieldTransfer);
+  transfer->fd = fd;
+  transfer->entry = wakefield_cache_entry_ref (entry);
+
+  if (send_to_reader (transfer))
+    g_unix_fd_add_full (G_PRIORITY_DEFAULT, fd, G_IO_OUT,
+                        reader_ready, transfer,
+                        (GDestroyNotify) wakefield_transfer_free);
+  else
+    wakefield_transfer_free (transfer);
+}
+
+static void
+store_thread (GTask        *task,
+              gpointer      source_object,
+              gpointer      task_data,
+              GCancellable *cancellable)
+{
+  GBytes *bytes = task_data;
+  gsize size;
+  const char *data = g_bytes_get_data (bytes, &size);
+
+  g_task_return_int (task, wakefield_create_sealed_file ("wakefield-clipboard", data, size));
+}
+
+static void
+store_done (GObject      *source_object,
+            GAsyncResult *result,
+            gpointer      user_data)
+{
+  WakefieldCacheEntry *entry = user_data;
+  struct WakefieldDataDevice *data_device;
+  GBytes *bytes = g_task_get_task_data (G_TASK (result));
+  GSList *waiters, *l;
+
+  entry->fd = g_task_propagate_int (G_TASK (result), NULL);
+  entry->size = g_bytes_get_size (bytes);
+  entry->loading = FALSE;
+
+  /* Let the next paste try again */
+  data_device = wakefield_compositor_get_data_device (WAKEFIELD_COMPOSITOR (source_object));
+  if (entry->fd < 0 &&
+      g_hash_table_lookup (data_device->host_cache, entry->mime_type) == entry)
+    g_hash_table_remove (data_device->host_cache, entry->mime_type);
+
+  waiters = entry->waiters;
+  entry->waiters = NULL;
+  for (l = waiters; l != NULL; l = l->next)
+    start_transfer (entry, GPOINTER_TO_INT (l->data));
+  g_slist_free (waiters);
+
+  wakefield_cache_entry_unref (entry);
+}
+
+typedef struct {
+  WakefieldCompositor *compositor;
+  WakefieldCacheEntry *entry;
+} WakefieldContentsRequest;
+
+static void
+store_contents (WakefieldCompositor *compositor,
+                WakefieldCacheEntry *entry,
+                GtkSelectionData    *selection_data)
+{
+  const guchar *data;
+  gint length;
+  GTask *task;
+
+  data = gtk_selection_data_get_data_with_length (selection_data, &length);
+
+  task = g_task_new (compositor, NULL, store_done, wakefield_cache_entry_ref (entry));
+  if (data != NULL && length >= 0)
+    {
+      g_task_set_task_data (task, g_bytes_new (data, length), (GDestroyNotify) g_bytes_unref);
+      g_task_run_in_thread (task, store_thread);
+    }
+  else
+    {
+      g_task_set_task_data (task, g_bytes_new (NULL, 0), (GDestroyNotify) g_bytes_unref);
+      g_task_return_int (task, -1);
+    }
+  g_object_unref (task);
+}
+
+static void
+host_contents_received (GtkClipboard     *clipboard,
+                        GtkSelectionData *selection_data,
+                        gpointer          user_data)
+{
+  WakefieldContentsRequest *request = user_data;
+
+  store_contents (request->compositor, request->entry, selection_data);
+
+  wakefield_cache_entry_unref (request->entry);
+  g_object_unref (request->compositor);
+  g_slice_free (WakefieldContentsRequest, request);
+}
+
+static WakefieldCacheEntry *
+wakefield_cache_entry_new (const char *mime_type)
+{
+  WakefieldCacheEntry *entry;
+
+  entry = g_slice_new0 (WakefieldCacheEntry);
+  entry->ref_count = 1;
+  entry->mime_type = g_strdup (mime_type);
+  entry->fd = -1;
+  entry->loading = TRUE;
+
+  return entry;
+}
+
+static void
+receive_from_host (struct WakefieldDataDevice *data_device,
+                   const char *mime_type,
+                   int fd)
+{
+  WakefieldCacheEntry *entry;
+  WakefieldContentsRequest *request;
+
+  entry = g_hash_table_lookup (data_device->host_cache, mime_type);
+  if (entry == NULL)
+    {
+      entry = wakefield_cache_entry_new (mime_type);
+      g_hash_table_insert (data_device->host_cache, entry->mime_type, entry);
+
+      request = g_slice_new0 (WakefieldContentsRequest);
+      request->compositor = g_object_ref (data_device->compositor);
+      request->entry = wakefield_cache_entry_ref (entry);
+      gtk_clipboard_request_contents (data_device->clipboard,
+                                      gdk_atom_intern (mime_type, FALSE),
+                                      host_contents_received, request);
+    }
+
+  if (entry->loading)
+    entry->waiters = g_slist_prepend (entry->waiters, GINT_TO_POINTER (fd));
+  else
+    start_transfer (entry, fd);
+}
+
+/* Data of host drags comes through the widget's drag-data-received,
+   matched up by context and target */
+typedef struct {
+  GdkDragContext *context;
+  GdkAtom target;
+  WakefieldCacheEntry *entry;
+} WakefieldDragRequest;
+
+static void
+drag_request_free (WakefieldDragRequest *request)
+{
+  g_object_unref (request->context);
+  wakefield_cache_entry_unref (request->entry);
+  g_slice_free (WakefieldDragRequest, request);
+}
+
+static void
+receive_from_host_drag (struct WakefieldDataDevice *data_device,
+                        GdkDragContext *context,
+                        const char *mime_type,
+                        int fd)
+{
+  WakefieldDragRequest *request;
+
+  request = g_slice_new0 (WakefieldDragRequest);
+  request->context = g_object_ref (context);
+  request->target = gdk_atom_intern (mime_type, FALSE);
+  request->entry = wakefield_cache_entry_new (mime_type);
+  request->entry->waiters = g_slist_prepend (NULL, GINT_TO_POINTER (fd));
+
+  data_device->drag_requests = g_slist_append (data_device->drag_requests, request);
+  gtk_drag_get_data (GTK_WIDGET (data_device->compositor), context,
+                     request->target, GDK_CURRENT_TIME);
+}
+
+static void
+drag_data_received (GtkWidget        *widget,
+                    GdkDragContext   *context,
+                    gint              x,
+                    gint              y,
+                    GtkSelectionData *selection_data,
+                    guint             info,
+                    guint             time,
+                    struct WakefieldDataDevice *data_device)
+{
+  GdkAtom target = gtk_selection_data_get_target (selection_data);
+  GSList *l;
+
+  for (l = data_device->drag_requests; l != NULL; l = l->next)
+    {
+      WakefieldDragRequest *request = l->data;
+
+      if (request->context == context && request->target == target)
+        {
+          data_device->drag_requests = g_slist_delete_link (data_device->drag_requests, l);
+          store_contents (data_device->compositor, request->entry, selection_data);
+          drag_request_free (request);
+          break;
+        }
+    }
+}
+
+static void
+data_offer_accept (struct wl_client *client,
+                   struct wl_resource *offer_resource,
+                   uint32_t serial,
+                   const char *mime_type)
+{
+  struct WakefieldDataOffer *offer = wl_resource_get_user_data (offer_resource);
+  struct WakefieldDrag *drag = offer->drag;
+
+  if (drag == NULL)
+    return;
+
+  drag->accepted = mime_type != NULL;
+
+  if (drag->source)
+    wl_data_source_send_target (drag->source->resource, mime_type);
+  else if (drag->host_context)
+    gdk_drag_status (drag->host_context,
+                     drag->accepted ? GDK_ACTION_COPY : 0,
+                     drag->time);
+}
+
+static void
+data_offer_receive (struct wl_client *client,
+                    struct wl_resource *offer_resource,
+                    const char *mime_type,
+                    int32_t fd)
+{
+  struct WakefieldDataOffer *offer = wl_resource_get_user_data (offer_resource);
+  struct WakefieldDataDevice *data_device = offer->data_device;
+  struct WakefieldDataSource *source = offer->source;
+  GObject *owner;
+
+  /* The same goes for drags from another compositor's client */
+  if (offer->host_context)
+    {
+      GtkWidget *source_widget = gtk_drag_get_source_widget (offer->host_context);
+
+      if (source_widget != NULL && WAKEFIELD_IS_COMPOSITOR (source_widget))
+        {
+          struct WakefieldDrag *drag =
+            wakefield_compositor_get_data_device (WAKEFIELD_COMPOSITOR (source_widget))->drag;
+
+          if (drag != NULL && drag->out_context == offer->host_context)
+            source = drag->source;
+        }
+    }
+  /* Another compositor in this process may own the host clipboard, then
+     its client can write to this one directly too */
+  else if (offer->host)
+    {
+      owner = gtk_clipboard_get_owner (data_device->clipboard);
+      if (owner != NULL && WAKEFIELD_IS_COMPOSITOR (owner))
+        source = wakefield_compositor_get_data_device (WAKEFIELD_COMPOSITOR (owner))->selection;
+    }
+
+  /* Between clients the fd is handed through, and the bytes never pass
+     through us */
+  if (source != NULL)
+    {
+      wl_data_source_send_send (source->resource, mime_type, fd);
+      close (fd);
+      return;
+    }
+
+  if (offer->host_context)
+    receive_from_host_drag (data_device, offer->host_context, mime_type, fd);
+  else if (offer->host)
+    receive_from_host (data_device, mime_type, fd);
+  else
+    close (fd);
+}
+
+static void
+data_offer_destroy (struct wl_client *client,
+                    struct wl_resource *offer_resource)
+{
+  wl_resource_destroy (offer_resource);
+}
+
+static const struct wl_data_offer_interface data_offer_implementation = {
+  data_offer_accept,
+  data_offer_receive,
+  data_offer_destroy
+};
+
+static void
+data_offer_finalize (struct wl_resource *resource)
+{
+  struct WakefieldDataOffer *offer = wl_resource_get_user_data (resource);
+
+  wl_list_remove (wl_resource_get_link (resource));
+
+  /* The client is done with what was dropped */
+  if (offer->host_context)
+    {
+      if (offer->dropped)
+        gtk_drag_finish (offer->host_context, TRUE, FALSE, GDK_CURRENT_TIME);
+      g_object_unref (offer->host_context);
+    }
+
+  g_slice_free (struct WakefieldDataOffer, offer);
+}
+
+/* Sends a new offer to the client of device_resource, for the source,
+   or from the host if that is NULL */
+static struct WakefieldDataOffer *
+create_offer (struct WakefieldDataDevice *data_device,
+              struct wl_resource *device_resource,
+              struct WakefieldDataSource *source,
+              GPtrArray *mime_types)
+{
+  struct WakefieldDataOffer *offer;
+  guint i;
+
+  offer = g_slice_new0 (struct WakefieldDataOffer);
+  offer->data_device = data_device;
+  offer->source = source;
+  offer->host = source == NULL;
+
+  offer->resource = wl_resource_create (wl_resource_get_client (device_resource),
+                                        &wl_data_offer_interface,
+                                        wl_resource_get_version (device_resource), 0);
+  if (offer->resource == NULL)
+    {
+      g_slice_free (struct WakefieldDataOffer, offer);
+      wl_resource_post_no_memory (device_resource);
+      return NULL;
+    }
+
+  wl_resource_set_implementation (offer->resource, &data_offer_implementation,
+                                  offer, data_offer_finalize);
+  wl_list_insert (&data_device->offer_resources,
+                  wl_resource_get_link (offer->resource));
+
+  wl_data_device_send_data_offer (device_resource, offer->resource);
+  for (i = 0; i < mime_types->len; i++)
+    wl_data_offer_send_offer (offer->resource, g_ptr_array_index (mime_types, i));
+
+  return offer;
+}
+
+/* Only the client with the keyboard focus gets to see the selection */
+static void
+send_selection (struct WakefieldDataDevice *data_device,
+                struct wl_resource *device_resource)
+{
+  struct WakefieldDataOffer *offer;
+  struct wl_client *client = wl_resource_get_client (device_resource);
+  GPtrArray *mime_types;
+
+  if (client != data_device->focus_client)
+    return;
+
+  if (data_device->selection)
+    mime_types = data_device->selection->mime_types;
+  else
+    mime_types = data_device->host_mime_types;
+
+  if (mime_types == NULL)
+    {
+      wl_data_device_send_selection (device_resource, NULL);
+      return;
+    }
+
+  offer = create_offer (data_device, device_resource,
+                        data_device->selection, mime_types);
+  if (offer)
+    wl_data_device_send_selection (device_resource, offer->resource);
+}
+
+static void
+selection_changed (struct WakefieldDataDevice *data_device)
+{
+  struct wl_resource *device_resource;
+
+  data_device->selection_serial++;
+
+  wl_resource_for_each (device_resource, &data_device->device_resources)
+    send_selection (data_device, device_resource);
+}
+
+static void
+clear_client_selection (struct WakefieldDataDevice *data_device)
+{
+  if (data_device->selection)
+    {
+      wl_data_source_send_cancelled (data_device->selection->resource);
+      data_device->selection = NULL;
+    }
+}
+
+/* The host pastes or drops what a client offers. GTK wants it all at
+   once, so this is the one direction where we read the data, and we do
+   it on the main thread. Nothing else runs meanwhile, including our own
+   wayland dispatch, so a source client that round-trips to us before it
+   writes stalls the UI until the timeout. Pastes that go quiet for
+   SOURCE_READ_TIMEOUT_MS, take longer than SOURCE_READ_TOTAL_TIMEOUT_MS
+   or grow beyond SOURCE_READ_MAX_SIZE are given up on, rather than
+   handed over cut short. */
+static void
+read_from_source (struct WakefieldDataSource *source,
+                  guint                       info,
+                  GtkSelectionData           *selection_data)
+{
+  GByteArray *contents;
+  gint64 deadline;
+  gboolean complete = FALSE;
+  int fds[2];
+
+  if (source == NULL || info >= source->mime_types->len)
+    return;
+
+  if (pipe2 (fds, O_CLOEXEC) != 0)
+    return;
+
+  wl_data_source_send_send (source->resource,
+                            g_ptr_array_index (source->mime_types, info),
+                            fds[1]);
+  close (fds[1]);
+  wl_client_flush (wl_resource_get_client (source->resource));
+
+  contents = g_byte_array_new ();
+  deadline = g_get_monotonic_time () + SOURCE_READ_TOTAL_TIMEOUT_MS * 1000;
+  for (;;)
+    {
+      struct pollfd pfd = { fds[0], POLLIN, 0 };
+      guint8 buf[4096];
+      gint64 remaining;
+      gssize n;
+      int ret;
+
+      remaining = (deadline - g_get_monotonic_time ()) / 1000;
+      if (remaining <= 0)
+        break;
+
+      ret = poll (&pfd, 1, MIN (remaining, SOURCE_READ_TIMEOUT_MS));
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret < 0)
+        break;
+      /* Only EOF means we have it all */
+      if (ret == 0)
+        break;
+
+      n = read (fds[0], buf, sizeof buf);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n == 0)
+        {
+          complete = TRUE;
+          break;
+        }
+      if (n < 0)
+        break;
+
+      if (contents->len + n > SOURCE_READ_MAX_SIZE)
+        break;
+
+      g_byte_array_append (contents, buf, n);
+    }
+  close (fds[0]);
+
+  if (complete)
+    gtk_selection_data_set (selection_data,
+                            gtk_selection_data_get_target (selection_data),
+                            8, contents->data, contents->len);
+  g_byte_array_unref (contents);
+}
+
+static void
+get_client_selection (GtkClipboard     *clipboard,
+                      GtkSelectionData *selection_data,
+                      guint             info,
+                      gpointer          owner)
+{
+  struct WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (owner);
+
+  read_from_source (data_device->selection, info, selection_data);
+}
+
+static void
+clear_client_selection_func (GtkClipboard *clipboard,
+                             gpointer      owner)
+{
+}
+
+static void
+data_device_set_selection (struct wl_client *client,
+                           struct wl_resource *device_resource,
+                           struct wl_resource *source_resource,
+                           uint32_t serial)
+{
+  struct WakefieldDataDevice *data_device = wl_resource_get_user_data (device_resource);
+  struct WakefieldDataSource *source = NULL;
+
+  if (source_resource)
+    source = wl_resource_get_user_data (source_resource);
+
+  if (source == data_device->selection)
+    return;
+
+  clear_client_selection (data_device);
+  g_clear_pointer (&data_device->host_mime_types, g_ptr_array_unref);
+  g_hash_table_remove_all (data_device->host_cache);
+  data_device->selection = source;
+
+  if (source != NULL)
+    {
+      GtkTargetEntry *targets;
+      guint i;
+
+      targets = g_new0 (GtkTargetEntry, source->mime_types->len);
+      for (i = 0; i < source->mime_types->len; i++)
+        {
+          targets[i].target = g_ptr_array_index (source->mime_types, i);
+          targets[i].info = i;
+        }
+
+      gtk_clipboard_set_with_owner (data_device->clipboard,
+                                    targets, source->mime_types->len,
+                                    get_client_selection,
+                                    clear_client_selection_func,
+                                    G_OBJECT (data_device->compositor));
+      g_free (targets);
+    }
+  else if (gtk_clipboard_get_owner (data_device->clipboard) == G_OBJECT (data_device->compositor))
+    gtk_clipboard_clear (data_device->clipboard);
+
+  selection_changed (data_device);
+}
+
+typedef struct {
+  WakefieldCompositor *compositor;
+  guint selection_serial;
+} WakefieldTargetsRequest;
+
+static void
+host_targets_received (GtkClipboard *clipboard,
+                       GdkAtom      *atoms,
+                       gint          n_atoms,
+                       gpointer      user_data)
+{
+  WakefieldTargetsRequest *request = user_data;
+  struct WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (request->compositor);
+  gint i;
+
+  if (request->selection_serial == data_device->selection_serial)
+    {
+      g_clear_pointer (&data_device->host_mime_types, g_ptr_array_unref);
+
+      if (n_atoms > 0)
+        {
+          data_device->host_mime_types = g_ptr_array_new_with_free_func (g_free);
+          for (i = 0; i < n_atoms; i++)
+            {
+              char *name = gdk_atom_name (atoms[i]);
+
+              /* The X selection machinery, not something to paste */
+              if (strcmp (name, "TARGETS") == 0 ||
+                  strcmp (name, "TIMESTAMP") == 0 ||
+                  strcmp (name, "MULTIPLE") == 0 ||
+                  strcmp (name, "SAVE_TARGETS") == 0)
+                g_free (name);
+              else
+                g_ptr_array_add (data_device->host_mime_types, name);
+            }
+        }
+
+      selection_changed (data_device);
+    }
+
+  g_object_unref (request->compositor);
+  g_slice_free (WakefieldTargetsRequest, request);
+}
+
+static void
+clipboard_owner_change (GtkClipboard        *clipboard,
+                        GdkEvent            *event,
+                        struct WakefieldDataDevice *data_device)
+{
+  WakefieldTargetsRequest *request;
+
+  /* Our own set_selection */
+  if (gtk_clipboard_get_owner (clipboard) == G_OBJECT (data_device->compositor))
+    return;
+
+  clear_client_selection (data_device);
+  g_clear_pointer (&data_device->host_mime_types, g_ptr_array_unref);
+  g_hash_table_remove_all (data_device->host_cache);
+  selection_changed (data_device);
+
+  request = g_slice_new0 (WakefieldTargetsRequest);
+  request->compositor = g_object_ref (data_device->compositor);
+  request->selection_serial = data_device->selection_serial;
+  gtk_clipboard_request_targets (clipboard, host_targets_received, request);
+}
 
-struct WakefieldDataDevice {
-  WakefieldCompositor *compositor;
+/* Drags */
 
-  struct wl_list data_source_resources;
-  struct wl_list manager_resources;
-  struct wl_list device_resources;
-};
+static void
+queue_draw_drag_icon (struct WakefieldDrag *drag)
+{
+  GtkWidget *widget = GTK_WIDGET (drag->data_device->compositor);
+  GtkAllocation allocation;
 
-struct WakefieldDataSource {
-  struct WakefieldDataDevice *data_device;
+  if (!drag->icon_drawn)
+    return;
+
+  gtk_widget_get_allocation (widget, &allocation);
+  gtk_widget_queue_draw_area (widget,
+                              allocation.x + (int) drag->icon_x,
+                              allocation.y + (int) drag->icon_y,
+                              drag->icon_width + 1, drag->icon_height + 1);
+}
+
+/* Where the icon is drawn only moves once per frame, with the motion */
+static void
+move_drag_icon (struct WakefieldDrag *drag)
+{
+  queue_draw_drag_icon (drag);
+
+  drag->icon_drawn = drag->icon_image != NULL && drag->has_position &&
+    drag->out_context == NULL;
+  drag->icon_x = drag->x;
+  drag->icon_y = drag->y;
+
+  queue_draw_drag_icon (drag);
+}
+
+static void
+update_drag_icon (struct WakefieldDrag *drag)
+{
+  queue_draw_drag_icon (drag);
+
+  g_clear_pointer (&drag->icon_image, cairo_surface_destroy);
+  drag->icon_image = wakefield_surface_create_cairo_surface (drag->icon,
+                                                             &drag->icon_width,
+                                                             &drag->icon_height);
+
+  move_drag_icon (drag);
+}
+
+static void
+drag_icon_committed (struct wl_listener *listener, void *data)
+{
+  struct WakefieldDrag *drag = wl_container_of (listener, drag, icon_commit_listener);
+
+  update_drag_icon (drag);
+}
+
+static void
+unset_drag_icon (struct WakefieldDrag *drag)
+{
+  if (drag->icon == NULL)
+    return;
+
+  wl_list_remove (&drag->icon_commit_listener.link);
+  wl_list_remove (&drag->icon_destroy_listener.link);
+  drag->icon = NULL;
+}
+
+/* We keep showing the last image of the icon */
+static void
+drag_icon_destroyed (struct wl_listener *listener, void *data)
+{
+  struct WakefieldDrag *drag = wl_container_of (listener, drag, icon_destroy_listener);
+
+  unset_drag_icon (drag);
+}
+
+void
+wakefield_data_device_draw_drag_icon (struct WakefieldDataDevice *data_device,
+                                      cairo_t *cr)
+{
+  struct WakefieldDrag *drag = data_device->drag;
+
+  if (drag == NULL || !drag->icon_drawn || drag->icon_image == NULL)
+    return;
+
+  cairo_save (cr);
+  cairo_set_source_surface (cr, drag->icon_image, drag->icon_x, drag->icon_y);
+  cairo_paint (cr);
+  cairo_restore (cr);
+}
+
+/* What the offers of the last enter accept means nothing after it */
+static void
+forget_drag_offers (struct WakefieldDrag *drag)
+{
   struct wl_resource *resource;
-};
+
+  wl_resource_for_each (resource, &drag->data_device->offer_resources)
+    {
+      struct WakefieldDataOffer *offer = wl_resource_get_user_data (resource);
+
+      if (offer->drag == drag)
+        offer->drag = NULL;
+    }
+}
 
 static void
-data_source_offer (struct wl_client *client,
-                   struct wl_resource *source_resource,
-                   const char *type)
+send_drag_leave (struct WakefieldDrag *drag)
+{
+  struct WakefieldDataDevice *data_device = drag->data_device;
+  struct wl_client *client = wl_resource_get_client (drag->focus);
+  struct wl_resource *resource;
+
+  wl_resource_for_each (resource, &data_device->device_resources)
+    {
+      if (wl_resource_get_client (resource) == client)
+        wl_data_device_send_leave (resource);
+    }
+
+  forget_drag_offers (drag);
+
+  wl_list_remove (&drag->focus_listener.link);
+  drag->focus = NULL;
+  drag->accepted = FALSE;
+  drag->motion_pending = FALSE;
+
+  if (drag->source)
+    wl_data_source_send_target (drag->source->resource, NULL);
+}
+
+static void
+drag_focus_destroyed (struct wl_listener *listener,
+                      void *data)
 {
-  wl_resource_post_error (source_resource, 1,
-                          "data-source:: offer not implemented yet.");
+  struct WakefieldDrag *drag = wl_container_of (listener, drag, focus_listener);
+
+  forget_drag_offers (drag);
+  wl_list_remove (&drag->focus_listener.link);
+  drag->focus = NULL;
+  drag->accepted = FALSE;
+  drag->motion_pending = FALSE;
 }
 
+static void
+send_drag_enter (struct WakefieldDrag *drag,
+                 struct wl_resource *surface)
+{
+  struct WakefieldDataDevice *data_device = drag->data_device;
+  struct wl_client *client = wl_resource_get_client (surface);
+  struct wl_display *display = wl_client_get_display (client);
+  struct wl_resource *device_resource;
+  uint32_t serial = wl_display_next_serial (display);
+
+  drag->focus = surface;
+  drag->focus_listener.notify = drag_focus_destroyed;
+  wl_resource_add_destroy_listener (surface, &drag->focus_listener);
+
+  wl_resource_for_each (device_resource, &data_device->device_resources)
+    {
+      struct WakefieldDataOffer *offer = NULL;
+
+      if (wl_resource_get_client (device_resource) != client)
+        continue;
+
+      if (drag->mime_types)
+        {
+          offer = create_offer (data_device, device_resource,
+                                drag->source, drag->mime_types);
+          if (offer == NULL)
+            continue;
+
+          offer->drag = drag;
+          if (drag->host_context)
+            offer->host_context = g_object_ref (drag->host_context);
+        }
+
+      wl_data_device_send_enter (device_resource, serial, surface,
+                                 wl_fixed_from_double (drag->focus_x),
+                                 wl_fixed_from_double (drag->focus_y),
+                                 offer ? offer->resource : NULL);
+    }
+}
 
 static void
-data_source_destroy (struct wl_client *client, struct wl_resource *resource)
+send_drag_motion (struct WakefieldDrag *drag)
 {
-  wl_resource_destroy (resource);
+  struct WakefieldDataDevice *data_device = drag->data_device;
+  struct wl_client *client = wl_resource_get_client (drag->focus);
+  struct wl_resource *device_resource;
+
+  wl_resource_for_each (device_resource, &data_device->device_resources)
+    {
+      if (wl_resource_get_client (device_resource) == client)
+        wl_data_device_send_motion (device_resource, drag->time,
+                                    wl_fixed_from_double (drag->focus_x),
+                                    wl_fixed_from_double (drag->focus_y));
+    }
+
+  drag->motion_pending = FALSE;
 }
 
-static struct wl_data_source_interface data_source_implementation = {
-  data_source_offer,
-  data_source_destroy
-};
+/* Motion goes out once per frame of the widget, with everything since
+   the last one folded together, and not at all while the client is
+   backed up */
+static gboolean
+drag_tick (GtkWidget     *widget,
+           GdkFrameClock *frame_clock,
+           gpointer       user_data)
+{
+  struct WakefieldDrag *drag = user_data;
+
+  if (drag->motion_pending && drag->focus != NULL)
+    {
+      if (wakefield_client_is_backed_up (wl_resource_get_client (drag->focus)))
+        return G_SOURCE_CONTINUE;
+
+      send_drag_motion (drag);
+    }
+
+  move_drag_icon (drag);
+
+  drag->tick_id = 0;
+  return G_SOURCE_REMOVE;
+}
 
 static void
-data_source_finalize (struct wl_resource *resource)
+start_host_drag (struct WakefieldDrag *drag)
 {
-  struct WakefieldDataSource *data_source = wl_resource_get_user_data (resource);
+  WakefieldCompositor *compositor = drag->data_device->compositor;
+  GtkTargetList *targets;
+  GdkDragContext *context;
+  guint i;
 
-  wl_list_remove (wl_resource_get_link (resource));
-  g_slice_free (struct WakefieldDataSource, data_source);
+  targets = gtk_target_list_new (NULL, 0);
+  for (i = 0; i < drag->mime_types->len; i++)
+    gtk_target_list_add (targets,
+                         gdk_atom_intern (g_ptr_array_index (drag->mime_types, i), FALSE),
+                         0, i);
+
+  context = gtk_drag_begin_with_coordinates (GTK_WIDGET (compositor), targets,
+                                             GDK_ACTION_COPY, 1, NULL,
+                                             (int) drag->x, (int) drag->y);
+  gtk_target_list_unref (targets);
+
+  if (context == NULL)
+    return;
+
+  drag->out_context = g_object_ref (context);
+  if (drag->icon_image)
+    gtk_drag_set_icon_surface (context, drag->icon_image);
+  else
+    gtk_drag_set_icon_default (context);
+
+  if (drag->focus)
+    send_drag_leave (drag);
+  move_drag_icon (drag);
+
+  wakefield_compositor_release_pointer_grab (compositor);
 }
 
+gboolean
+wakefield_data_device_is_dragging (struct WakefieldDataDevice *data_device)
+{
+  return data_device->drag != NULL && data_device->drag->host_context == NULL;
+}
 
 static void
-create_data_source (struct wl_client *client,
-                    struct wl_resource *manager_resource,
-                    uint32_t id)
+update_drag (struct WakefieldDrag *drag,
+             double x, double y,
+             guint32 time)
 {
-  struct WakefieldDataDevice *data_device = wl_resource_get_user_data (manager_resource);
-  struct WakefieldDataSource *data_source;
+  WakefieldCompositor *compositor = drag->data_device->compositor;
+  GtkWidget *widget = GTK_WIDGET (compositor);
+  struct wl_resource *surface;
 
-  data_source = g_slice_new0 (struct WakefieldDataSource);
-  data_source->data_device = data_device;
+  if (drag->out_context != NULL)
+    return;
 
-  data_source->resource = wl_resource_create (client, &wl_data_source_interface, 1, id);
-  wl_resource_set_implementation (data_source->resource, &data_source_implementation,
-                                  data_source, data_source_finalize);
-  wl_list_insert (&data_device->data_source_resources,
-                  wl_resource_get_link (data_source->resource));
+  drag->has_position = TRUE;
+  drag->x = x;
+  drag->y = y;
+  drag->time = time;
+
+  /* Leaving the widget hands the drag over to the host */
+  if (drag->source != NULL &&
+      (x < 0 || y < 0 ||
+       x >= gtk_widget_get_allocated_width (widget) ||
+       y >= gtk_widget_get_allocated_height (widget)))
+    {
+      start_host_drag (drag);
+      return;
+    }
+
+  surface = wakefield_compositor_surface_at (compositor, &x, &y);
+  /* Drags without a source stay within their client */
+  if (surface != NULL && drag->client != NULL && drag->source == NULL &&
+      wl_resource_get_client (surface) != drag->client)
+    surface = NULL;
+
+  drag->focus_x = x;
+  drag->focus_y = y;
+
+  if (surface != drag->focus)
+    {
+      if (drag->focus)
+        send_drag_leave (drag);
+      if (surface)
+        send_drag_enter (drag, surface);
+    }
+  else if (surface != NULL)
+    drag->motion_pending = TRUE;
+
+  if (drag->tick_id == 0)
+    drag->tick_id = gtk_widget_add_tick_callback (widget, drag_tick, drag, NULL);
+}
+
+void
+wakefield_data_device_drag_motion (struct WakefieldDataDevice *data_device,
+                                   double x, double y,
+                                   guint32 time)
+{
+  if (data_device->drag)
+    update_drag (data_device->drag, x, y, time);
+}
+
+static void
+send_drop (struct WakefieldDrag *drag)
+{
+  struct WakefieldDataDevice *data_device = drag->data_device;
+  struct wl_client *client = wl_resource_get_client (drag->focus);
+  struct wl_resource *resource;
+
+  /* The drop goes with where the pointer is now */
+  if (drag->motion_pending)
+    send_drag_motion (drag);
+
+  wl_resource_for_each (resource, &data_device->offer_resources)
+    {
+      struct WakefieldDataOffer *offer = wl_resource_get_user_data (resource);
+
+      if (offer->drag == drag)
+        offer->dropped = TRUE;
+    }
+
+  wl_resource_for_each (resource, &data_device->device_resources)
+    {
+      if (wl_resource_get_client (resource) == client)
+        wl_data_device_send_drop (resource);
+    }
+}
+
+void
+wakefield_data_device_drag_drop (struct WakefieldDataDevice *data_device,
+                                 guint32 time)
+{
+  struct WakefieldDrag *drag = data_device->drag;
+
+  if (drag == NULL)
+    return;
+
+  if (drag->focus != NULL && (drag->accepted || drag->mime_types == NULL))
+    send_drop (drag);
+  else if (drag->source != NULL)
+    wl_data_source_send_cancelled (drag->source->resource);
+
+  end_drag (drag);
+}
+
+static void
+end_drag (struct WakefieldDrag *drag)
+{
+  struct WakefieldDataDevice *data_device = drag->data_device;
+
+  if (drag->focus)
+    send_drag_leave (drag);
+  forget_drag_offers (drag);
+
+  queue_draw_drag_icon (drag);
+  unset_drag_icon (drag);
+  g_clear_pointer (&drag->icon_image, cairo_surface_destroy);
+
+  if (drag->tick_id != 0)
+    gtk_widget_remove_tick_callback (GTK_WIDGET (data_device->compositor), drag->tick_id);
+  if (drag->host_leave_id != 0)
+    g_source_remove (drag->host_leave_id);
+
+  g_clear_object (&drag->host_context);
+  g_clear_object (&drag->out_context);
+  g_clear_pointer (&drag->mime_types, g_ptr_array_unref);
+
+  data_device->drag = NULL;
+  g_slice_free (struct WakefieldDrag, drag);
 }
 
 static void
@@ -95,18 +1350,187 @@ data_device_start_drag (struct wl_client *client,
                         struct wl_resource *icon_resource,
                         uint32_t serial)
 {
-  wl_resource_post_error (device_resource, 1,
-                          "data-device:: start_drag not implemented yet.");
+  struct WakefieldDataDevice *data_device = wl_resource_get_user_data (device_resource);
+  struct WakefieldDataSource *source = NULL;
+  struct WakefieldDrag *drag;
+
+  if (source_resource)
+    source = wl_resource_get_user_data (source_resource);
+
+  if (icon_resource)
+    {
+      WakefieldSurfaceRole role = wakefield_surface_get_role (icon_resource);
+
+      if (role != WAKEFIELD_SURFACE_ROLE_NONE &&
+          role != WAKEFIELD_SURFACE_ROLE_DND_ICON)
+        {
+          wl_resource_post_error (device_resource, WL_DATA_DEVICE_ERROR_ROLE,
+                                  "This wl_surface already has a role");
+          return;
+        }
+
+      wakefield_surface_set_role (icon_resource, WAKEFIELD_SURFACE_ROLE_DND_ICON);
+    }
+
+  if (data_device->drag != NULL ||
+      !wakefield_compositor_start_drag (data_device->compositor, client, serial))
+    {
+      if (source)
+        wl_data_source_send_cancelled (source->resource);
+      return;
+    }
+
+  drag = g_slice_new0 (struct WakefieldDrag);
+  drag->data_device = data_device;
+  drag->client = client;
+  drag->source = source;
+  if (source)
+    drag->mime_types = g_ptr_array_ref (source->mime_types);
+  data_device->drag = drag;
+
+  if (icon_resource)
+    {
+      drag->icon = icon_resource;
+      drag->icon_commit_listener.notify = drag_icon_committed;
+      wakefield_surface_add_commit_listener (icon_resource, &drag->icon_commit_listener);
+      drag->icon_destroy_listener.notify = drag_icon_destroyed;
+      wl_resource_add_destroy_listener (icon_resource, &drag->icon_destroy_listener);
+      update_drag_icon (drag);
+    }
+}
+
+/* Drags from the host. GTK sends drag-leave before drag-drop as well,
+   so the drag only ends if no drop follows. */
+
+static gboolean
+host_drag_leave_idle (gpointer user_data)
+{
+  struct WakefieldDrag *drag = user_data;
+
+  drag->host_leave_id = 0;
+  end_drag (drag);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+host_drag_motion (GtkWidget      *widget,
+                  GdkDragContext *context,
+                  gint            x,
+                  gint            y,
+                  guint           time,
+                  struct WakefieldDataDevice *data_device)
+{
+  struct WakefieldDrag *drag = data_device->drag;
+  GList *l;
+
+  /* Our client's drag that left for the host came back */
+  if (drag != NULL && drag->out_context == context)
+    {
+      gdk_drag_status (context, 0, time);
+      return TRUE;
+    }
+
+  if (drag != NULL && drag->host_context != context)
+    return FALSE;
+
+  if (drag == NULL)
+    {
+      drag = g_slice_new0 (struct WakefieldDrag);
+      drag->data_device = data_device;
+      drag->host_context = g_object_ref (context);
+      drag->mime_types = g_ptr_array_new_with_free_func (g_free);
+      for (l = gdk_drag_context_list_targets (context); l != NULL; l = l->next)
+        g_ptr_array_add (drag->mime_types, gdk_atom_name (l->data));
+      data_device->drag = drag;
+    }
+
+  if (drag->host_leave_id != 0)
+    {
+      g_source_remove (drag->host_leave_id);
+      drag->host_leave_id = 0;
+    }
+
+  update_drag (drag, x, y, time);
+  gdk_drag_status (context, drag->accepted ? GDK_ACTION_COPY : 0, time);
+
+  return TRUE;
+}
+
+static void
+host_drag_leave (GtkWidget      *widget,
+                 GdkDragContext *context,
+                 guint           time,
+                 struct WakefieldDataDevice *data_device)
+{
+  struct WakefieldDrag *drag = data_device->drag;
+
+  if (drag != NULL && drag->host_context == context && drag->host_leave_id == 0)
+    drag->host_leave_id = g_idle_add (host_drag_leave_idle, drag);
+}
+
+static gboolean
+host_drag_drop (GtkWidget      *widget,
+                GdkDragContext *context,
+                gint            x,
+                gint            y,
+                guint           time,
+                struct WakefieldDataDevice *data_device)
+{
+  struct WakefieldDrag *drag = data_device->drag;
+
+  if (drag == NULL || drag->host_context != context)
+    return FALSE;
+
+  if (drag->focus != NULL && drag->accepted)
+    send_drop (drag);
+  else
+    gtk_drag_finish (context, FALSE, FALSE, time);
+
+  end_drag (drag);
+
+  return TRUE;
 }
 
+/* Drags of our clients out to the host */
+
 static void
-data_device_set_selection (struct wl_client *client,
-                           struct wl_resource *device_resource,
-                           struct wl_resource *source_resource,
-                           uint32_t serial)
+client_drag_data_get (GtkWidget        *widget,
+                      GdkDragContext   *context,
+                      GtkSelectionData *selection_data,
+                      guint             info,
+                      guint             time,
+                      struct WakefieldDataDevice *data_device)
+{
+  struct WakefieldDrag *drag = data_device->drag;
+
+  if (drag != NULL && drag->out_context == context)
+    read_from_source (drag->source, info, selection_data);
+}
+
+static gboolean
+client_drag_failed (GtkWidget      *widget,
+                    GdkDragContext *context,
+                    GtkDragResult   result,
+                    struct WakefieldDataDevice *data_device)
+{
+  struct WakefieldDrag *drag = data_device->drag;
+
+  if (drag != NULL && drag->out_context == context && drag->source != NULL)
+    wl_data_source_send_cancelled (drag->source->resource);
+
+  return FALSE;
+}
+
+static void
+client_drag_end (GtkWidget      *widget,
+                 GdkDragContext *context,
+                 struct WakefieldDataDevice *data_device)
 {
-  wl_resource_post_error (device_resource, 1,
-                          "data-device:: set_selection not implemented yet.");
+  struct WakefieldDrag *drag = data_device->drag;
+
+  if (drag != NULL && drag->out_context == context)
+    end_drag (drag);
 }
 
 static void
@@ -128,6 +1552,31 @@ data_device_finalize (struct wl_resource *resource)
   wl_list_remove (wl_resource_get_link (resource));
 }
 
+void
+wakefield_data_device_set_focus (struct WakefieldDataDevice *data_device,
+                                 struct wl_client *client)
+{
+  struct wl_resource *device_resource;
+
+  if (data_device->focus_client == client)
+    return;
+
+  data_device->focus_client = client;
+
+  /* The host clipboard only matters once a client could paste it */
+  if (data_device->owner_change_id == 0)
+    {
+      data_device->owner_change_id =
+        g_signal_connect (data_device->clipboard, "owner-change",
+                          G_CALLBACK (clipboard_owner_change), data_device);
+      clipboard_owner_change (data_device->clipboard, NULL, data_device);
+      return;
+    }
+
+  wl_resource_for_each (device_resource, &data_device->device_resources)
+    send_selection (data_device, device_resource);
+}
+
 static void
 get_data_device (struct wl_client *client,
                  struct wl_resource *manager_resource,
@@ -149,6 +1598,8 @@ get_data_device (struct wl_client *client,
                   wl_resource_get_link (device_resource));
   wl_resource_set_implementation (device_resource, &data_device_implementation,
                                   data_device, data_device_finalize);
+
+  send_selection (data_device, device_resource);
 }
 
 static const struct wl_data_device_manager_interface manager_implementation = {
@@ -168,7 +1619,8 @@ bind_data_device_manager (struct wl_client *client,
                           uint32_t version,
                           uint32_t id)
 {
-  struct WakefieldDataDevice *data_device = data;
+  WakefieldCompositor *compositor = wakefield_server_get_client_compositor (data, client);
+  struct WakefieldDataDevice *data_device = wakefield_compositor_get_data_device (compositor);
   struct wl_resource *manager_resource;
 
   manager_resource = wl_resource_create (client, &wl_data_device_manager_interface, version, id);
@@ -196,9 +1648,63 @@ wakefield_data_device_new (WakefieldCompositor *compositor)
   wl_list_init (&data_device->manager_resources);
   wl_list_init (&data_device->data_source_resources);
   wl_list_init (&data_device->device_resources);
+  wl_list_init (&data_device->offer_resources);
+
+  data_device->clipboard = gtk_clipboard_get_for_display (gdk_display_get_default (),
+                                                          GDK_SELECTION_CLIPBOARD);
+  data_device->host_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL,
+                                                   (GDestroyNotify) wakefield_cache_entry_unref);
 
-  wl_global_create (wakefield_compositor_get_display (compositor), &wl_data_device_manager_interface, DATA_DEVICE_MANAGER_VERSION,
-                    data_device, bind_data_device_manager);
+  /* We answer drag motion and drops ourselves, depending on what the
+     client under the pointer accepts */
+  gtk_drag_dest_set (GTK_WIDGET (compositor), 0, NULL, 0, GDK_ACTION_COPY);
+  g_signal_connect (compositor, "drag-motion", G_CALLBACK (host_drag_motion), data_device);
+  g_signal_connect (compositor, "drag-leave", G_CALLBACK (host_drag_leave), data_device);
+  g_signal_connect (compositor, "drag-drop", G_CALLBACK (host_drag_drop), data_device);
+  g_signal_connect (compositor, "drag-data-received", G_CALLBACK (drag_data_received), data_device);
+  g_signal_connect (compositor, "drag-data-get", G_CALLBACK (client_drag_data_get), data_device);
+  g_signal_connect (compositor, "drag-failed", G_CALLBACK (client_drag_failed), data_device);
+  g_signal_connect (compositor, "drag-end", G_CALLBACK (client_drag_end), data_device);
 
   return data_device;
 }
+
+void
+wakefield_data_device_free (struct WakefieldDataDevice *data_device)
+{
+  GSList *l;
+
+  if (data_device->drag)
+    end_drag (data_device->drag);
+
+  /* Readers waiting for drag data that won't come */
+  for (l = data_device->drag_requests; l != NULL; l = l->next)
+    {
+      WakefieldDragRequest *request = l->data;
+      GSList *w;
+
+      for (w = request->entry->waiters; w != NULL; w = w->next)
+        close (GPOINTER_TO_INT (w->data));
+      g_slist_free (request->entry->waiters);
+      request->entry->waiters = NULL;
+      drag_request_free (request);
+    }
+  g_slist_free (data_device->drag_requests);
+
+  if (data_device->owner_change_id != 0)
+    g_signal_handler_disconnect (data_device->clipboard, data_device->owner_change_id);
+
+  if (gtk_clipboard_get_owner (data_device->clipboard) == G_OBJECT (data_device->compositor))
+    gtk_clipboard_clear (data_device->clipboard);
+
+  g_clear_pointer (&data_device->host_mime_types, g_ptr_array_unref);
+  g_hash_table_unref (data_device->host_cache);
+  g_slice_free (struct WakefieldDataDevice, data_device);
+}
+
+void
+wakefield_data_device_create_global (WakefieldServer *server)
+{
+  wl_global_create (wakefield_server_get_display (server), &wl_data_device_manager_interface,
+                    DATA_DEVICE_MANAGER_VERSION, server, bind_data_device_manager);
+}
@@ -26,6 +26,79 @@
 #include <wayland-server.h>
 
 typedef struct _WakefieldSurface WakefieldSurface;
+struct xkb_keymap;
+
+struct wl_display *  wakefield_server_get_display           (WakefieldServer     *server);
+void                 wakefield_server_add_compositor        (WakefieldServer     *server,
+                                                             WakefieldCompositor *compositor);
+void                 wakefield_server_remove_compositor     (WakefieldServer     *server,
+                                                             WakefieldCompositor *compositor);
+WakefieldCompositor *wakefield_server_get_client_compositor (WakefieldServer     *server,
+                                                             struct wl_client    *client);
+void                 wakefield_server_set_focus_client      (WakefieldServer     *server,
+                                                             struct wl_client    *client);
+void                 wakefield_server_unset_focus_client    (WakefieldServer     *server,
+                                                             struct wl_client    *client);
+gboolean             wakefield_server_add_socket            (WakefieldServer     *server,
+                                                             WakefieldCompositor *compositor,
+                                                             const char          *name,
+                                                             GError             **error);
+const char *         wakefield_server_add_socket_auto       (WakefieldServer     *server,
+                                                             WakefieldCompositor *compositor,
+                                                             GError             **error);
+int                  wakefield_server_create_client_fd      (WakefieldServer     *server,
+                                                             WakefieldCompositor *compositor,
+                                                             GDestroyNotify       destroy_notify,
+                                                             gpointer             user_data,
+                                                             GError             **error);
+struct xkb_keymap *  wakefield_server_get_keymap            (WakefieldServer     *server,
+                                                             int                 *fd,
+                                                             gsize               *size);
+gboolean             wakefield_server_watch_raw_motion      (WakefieldServer     *server);
+void                 wakefield_server_unwatch_raw_motion    (WakefieldServer     *server);
+
+int                  wakefield_create_sealed_file           (const char          *name,
+                                                             const char          *data,
+                                                             gsize                size);
+
+gboolean             wakefield_client_charge                (struct wl_client       *client,
+                                                             WakefieldClientResource resource,
+                                                             guint64                 amount);
+void                 wakefield_client_release               (struct wl_client       *client,
+                                                             WakefieldClientResource resource,
+                                                             guint64                 amount);
+gboolean             wakefield_client_is_backed_up          (struct wl_client       *client);
+gboolean             wakefield_client_get_ping              (struct wl_client       *client,
+                                                             gint64                 *ping_time);
+void                 wakefield_client_set_ping              (struct wl_client       *client,
+                                                             guint32                 serial,
+                                                             gint64                  ping_time);
+gboolean             wakefield_client_pong                  (struct wl_client       *client,
+                                                             guint32                 serial);
+void                 wakefield_client_set_unresponsive      (struct wl_client       *client);
+gboolean             wakefield_client_is_unresponsive       (struct wl_client       *client);
+void                 wakefield_client_get_identity          (struct wl_client       *client,
+                                                             GPid                   *pid,
+                                                             gpointer               *user_data);
+
+typedef enum {
+  WAKEFIELD_CLIENT_BINDING_POINTER,
+  WAKEFIELD_CLIENT_BINDING_KEYBOARD,
+  WAKEFIELD_CLIENT_BINDING_OUTPUT,
+  WAKEFIELD_N_CLIENT_BINDINGS
+} WakefieldClientBinding;
+
+void                 wakefield_client_set_binding           (struct wl_client       *client,
+                                                             WakefieldClientBinding  binding,
+                                                             struct wl_resource     *resource);
+void                 wakefield_client_unset_binding         (struct wl_resource     *resource,
+                                                             WakefieldClientBinding  binding,
+                                                             struct wl_list         *list);
+struct wl_resource * wakefield_client_get_binding           (struct wl_client       *client,
+                                                             WakefieldClientBinding  binding);
+
+void                wakefield_compositor_create_globals         (WakefieldServer     *server);
+struct WakefieldDataDevice *wakefield_compositor_get_data_device (WakefieldCompositor *compositor);
 
 struct wl_display * wakefield_compositor_get_display            (WakefieldCompositor *compositor);
 void                wakefield_compositor_surface_unmapped       (WakefieldCompositor *compositor,
@@ -47,12 +120,39 @@ void                wakefield_compositor_send_scroll            (WakefieldCompos
 void                wakefield_compositor_send_motion            (WakefieldCompositor *compositor,
                                                                  struct wl_resource  *surface,
                                                                  GdkEventMotion      *event);
+gboolean            wakefield_compositor_get_frame_timings      (WakefieldCompositor *compositor,
+                                                                 gint64              *presented_frame,
+                                                                 gint64              *presentation_time);
+void                wakefield_compositor_schedule_commit_queue  (WakefieldCompositor *compositor);
+void                wakefield_compositor_send_xdg_configure     (WakefieldCompositor *compositor,
+                                                                 struct wl_resource  *xdg_surface);
+gint64              wakefield_compositor_get_refresh_interval   (WakefieldCompositor *compositor);
+int                 wakefield_compositor_get_preferred_scale    (WakefieldCompositor *compositor);
+void                wakefield_compositor_schedule_frame_callbacks (WakefieldCompositor *compositor,
+                                                                   gint64               lead);
+void                wakefield_compositor_client_unblocked       (WakefieldCompositor *compositor,
+                                                                 struct wl_client    *client);
+void                wakefield_compositor_keymap_loaded          (WakefieldCompositor *compositor);
+struct wl_resource *wakefield_compositor_surface_at             (WakefieldCompositor *compositor,
+                                                                 double              *x,
+                                                                 double              *y);
+gboolean            wakefield_compositor_start_drag             (WakefieldCompositor *compositor,
+                                                                 struct wl_client    *client,
+                                                                 uint32_t             serial);
+void                wakefield_compositor_release_pointer_grab   (WakefieldCompositor *compositor);
+void                wakefield_compositor_send_relative_motion   (WakefieldCompositor *compositor,
+                                                                 guint64              utime,
+                                                                 double               dx,
+                                                                 double               dy,
+                                                                 double               dx_unaccel,
+                                                                 double               dy_unaccel);
 
 typedef enum {
   WAKEFIELD_SURFACE_ROLE_NONE,
   WAKEFIELD_SURFACE_ROLE_XDG_SURFACE,
   WAKEFIELD_SURFACE_ROLE_XDG_POPUP,
   WAKEFIELD_SURFACE_ROLE_POINTER_CURSOR,
+  WAKEFIELD_SURFACE_ROLE_DND_ICON,
 } WakefieldSurfaceRole;
 
 struct wl_resource * wakefield_surface_new              (WakefieldCompositor *compositor,
@@ -61,18 +161,35 @@ struct wl_resource * wakefield_surface_new              (WakefieldCompositor *co
                                                          uint32_t             id);
 void                 wakefield_surface_draw             (struct wl_resource  *surface_resource,
                                                          cairo_t             *cr);
+void                 wakefield_surface_send_frame_callbacks (struct wl_resource *surface_resource);
+gint64               wakefield_surface_get_frame_callback_lead (struct wl_resource *surface_resource);
 struct wl_resource * wakefield_surface_get_xdg_surface  (struct wl_resource  *surface_resource);
 struct wl_resource * wakefield_surface_get_xdg_popup    (struct wl_resource  *surface_resource);
 WakefieldSurfaceRole wakefield_surface_get_role         (struct wl_resource  *surface_resource);
 void                 wakefield_surface_set_role         (struct wl_resource *surface_resource,
                                                          WakefieldSurfaceRole role);
 GdkWindow *          wakefield_surface_get_window       (struct wl_resource  *surface_resource);
+void                 wakefield_surface_get_window_geometry (struct wl_resource *surface_resource,
+                                                            int                *x,
+                                                            int                *y,
+                                                            int                *width,
+                                                            int                *height);
 gboolean             wakefield_surface_is_mapped        (struct wl_resource  *surface_resource);
+gboolean             wakefield_surface_process_commit_queue (struct wl_resource *surface_resource,
+                                                             gint64              presented_frame,
+                                                             gint64              presentation_time);
+struct wl_resource * wakefield_surface_get_fifo         (struct wl_resource  *surface_resource);
+struct wl_resource * wakefield_surface_get_commit_timer (struct wl_resource  *surface_resource);
+struct wl_resource * wakefield_surface_get_viewport     (struct wl_resource  *surface_resource);
+void                 wakefield_surface_send_preferred_scale (struct wl_resource *surface_resource,
+                                                             int                 scale);
 
-WakefieldCompositor *wakefield_surface_get_compositor   (WakefieldSurface *surface);
-cairo_surface_t *    wakefield_surface_create_cairo_surface (WakefieldSurface *surface,
-                                                             int              *width,
-                                                             int              *height);
+WakefieldCompositor *wakefield_surface_get_compositor   (struct wl_resource  *surface_resource);
+void                 wakefield_surface_add_commit_listener (struct wl_resource *surface_resource,
+                                                            struct wl_listener *listener);
+cairo_surface_t *    wakefield_surface_create_cairo_surface (struct wl_resource *surface_resource,
+                                                             int                *width,
+                                                             int                *height);
 
 struct wl_resource *wakefield_xdg_surface_new (struct wl_client   *client,
                                                struct wl_resource *shell_resource,
@@ -84,6 +201,11 @@ void                wakefield_xdg_surface_realize (struct wl_resource *xdg_surfa
                                                    GdkWindow *parent);
 void                wakefield_xdg_surface_unrealize (struct wl_resource *xdg_surface_resource);
 GdkWindow *         wakefield_xdg_surface_get_window (struct wl_resource *xdg_surface_resource);
+GQuark              wakefield_xdg_surface_window_quark (void);
+void                wakefield_xdg_surface_configure (struct wl_resource *xdg_surface_resource,
+                                                     int                 width,
+                                                     int                 height,
+                                                     gboolean            activated);
 
 struct wl_resource *wakefield_xdg_popup_new (WakefieldCompositor *compositor,
                                              struct wl_client   *client,
@@ -96,8 +218,37 @@ struct wl_resource *wakefield_xdg_popup_new (WakefieldCompositor *compositor,
 
 guint32             wakefield_xdg_popup_get_serial (struct wl_resource *xdg_popup_resource);
 GdkWindow *         wakefield_xdg_popup_get_window (struct wl_resource *xdg_popup_resource);
+struct wl_resource *wakefield_xdg_popup_get_overlay (struct wl_resource *xdg_popup_resource,
+                                                     int *x, int *y,
+                                                     int *width, int *height);
 void                wakefield_xdg_popup_close      (struct wl_resource *xdg_popup_resource);
+void                wakefield_xdg_popup_prepare    (GdkScreen          *screen);
+
+struct wl_resource *wakefield_fifo_new         (struct wl_client   *client,
+                                                struct wl_resource *manager_resource,
+                                                uint32_t            id,
+                                                struct wl_resource *surface_resource);
+struct wl_resource *wakefield_commit_timer_new (struct wl_client   *client,
+                                                struct wl_resource *manager_resource,
+                                                uint32_t            id,
+                                                struct wl_resource *surface_resource);
+struct wl_resource *wakefield_viewport_new     (struct wl_client   *client,
+                                                struct wl_resource *viewporter_resource,
+                                                uint32_t            id,
+                                                struct wl_resource *surface_resource);
 
 cairo_region_t *wakefield_region_get_region (struct wl_resource *region_resource);
 
 struct WakefieldDataDevice *wakefield_data_device_new (WakefieldCompositor *compositor);
+void                        wakefield_data_device_free (struct WakefieldDataDevice *data_device);
+void                        wakefield_data_device_create_global (WakefieldServer *server);
+void                        wakefield_data_device_set_focus (struct WakefieldDataDevice *data_device,
+                                                             struct wl_client *client);
+gboolean                    wakefield_data_device_is_dragging (struct WakefieldDataDevice *data_device);
+void                        wakefield_data_device_drag_motion (struct WakefieldDataDevice *data_device,
+                                                               double x, double y,
+                                                               guint32 time);
+void                        wakefield_data_device_drag_drop (struct WakefieldDataDevice *data_device,
+                                                             guint32 time);
+void                        wakefield_data_device_draw_drag_icon (struct WakefieldDataDevice *data_device,
+                                                                  cairo_t *cr);
@@ -0,0 +1,1620 @@
+/*
+ * Copyright (C) 2015 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include "config.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <glib/gi18n-lib.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
+
+#include "wakefield-server.h"
+#include "wakefield-private.h"
+
+#include <xkbcommon/xkbcommon.h>
+
+#if defined(GDK_WINDOWING_X11)
+#include <xkbcommon/xkbcommon-x11.h>
+#include <gdk/gdkx.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/XInput2.h>
+#endif
+
+/* The server owns the wl_display and everything that can be shared
+   between compositor widgets. Each client belongs to one widget: the one
+   that created its fd, or the one that added the socket it connected
+   through. */
+
+struct WakefieldClient
+{
+  WakefieldServer *server;
+  WakefieldCompositor *compositor;
+  struct wl_client *client;
+  struct wl_listener destroy_listener;
+  struct wl_list link;
+
+  /* How the host tells clients apart: the pid of those that came in
+     through a socket, or the user_data passed to
+     wakefield_server_create_client_fd(). Both ends of a socketpair we
+     made ourselves carry our own pid, so those get 0. */
+  GPid pid;
+  gpointer user_data;
+
+  /* In the dirty_clients list while we have events queued for it */
+  struct wl_list flush_link;
+  /* The last flush found its socket full */
+  gboolean backed_up;
+
+  /* The xdg_shell ping we are waiting for an answer to, if any, and
+     whether we gave up waiting */
+  guint32 ping_serial;
+  gint64 ping_time;
+  gboolean unresponsive;
+
+  guint64 usage[WAKEFIELD_N_CLIENT_RESOURCES];
+  struct wl_listener resource_created_listener;
+  /* Size of the wl_shm_pool the request being dispatched creates */
+  gint32 pending_pool_size;
+
+  /* The newest wl_pointer, wl_keyboard and wl_output it bound */
+  struct wl_resource *bindings[WAKEFIELD_N_CLIENT_BINDINGS];
+};
+
+struct WakefieldShmPool
+{
+  struct wl_listener destroy_listener;
+  gint32 size;
+};
+
+/* A keymap, and the sealed file clients read it from */
+typedef struct {
+  gint ref_count;
+  char *checksum;
+  struct xkb_keymap *keymap;
+  int fd;
+  gsize size;
+} WakefieldKeymap;
+
+typedef struct {
+  struct wl_listener listener;
+  WakefieldServer *server;
+} WakefieldClientCreatedListener;
+
+struct _WakefieldServerPrivate
+{
+  struct wl_display *wl_display;
+  GSource *wayland_source;
+
+  GList *compositors;
+  /* Socket path -> WakefieldCompositor */
+  GHashTable *socket_routes;
+  /* Set while we create a client for wakefield_server_create_client_fd() */
+  WakefieldCompositor *pending_compositor;
+
+  WakefieldClientCreatedListener client_created_listener;
+  struct wl_protocol_logger *protocol_logger;
+  struct wl_list clients;
+  struct wl_list dirty_clients;
+  struct WakefieldClient *focus_client;
+  GSource *focus_source;
+
+  /* 0 means no limit */
+  guint64 client_limits[WAKEFIELD_N_CLIENT_RESOURCES];
+
+  gboolean keymap_loading;
+  gboolean keymap_loaded;
+  WakefieldKeymap *keymap;
+
+  /* XI2 raw motion, selected while some client has a relative pointer */
+  guint raw_motion_users;
+  gboolean raw_motion_selected;
+  int xi_opcode;
+  /* Device id -> whether its motion valuators are absolute */
+  GHashTable *raw_motion_devices;
+};
+typedef struct _WakefieldServerPrivate WakefieldServerPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (WakefieldServer, wakefield_server, G_TYPE_OBJECT);
+
+static GSource * wayland_event_source_new (WakefieldServer *server);
+static void load_keymap (WakefieldServer *server);
+
+/* Client tracking */
+
+static void
+wakefield_client_destroyed (struct wl_listener *listener, void *data)
+{
+  struct WakefieldClient *client = wl_container_of (listener, client, destroy_listener);
+
+  /* The fd is closed right after this */
+  wakefield_server_unset_focus_client (client->server, client->client);
+
+  wl_list_remove (&client->link);
+  wl_list_remove (&client->flush_link);
+  wl_list_remove (&client->resource_created_listener.link);
+  g_slice_free (struct WakefieldClient, client);
+}
+
+static struct WakefieldClient *
+wakefield_client_get (struct wl_client *wl_client)
+{
+  struct wl_listener *listener;
+  struct WakefieldClient *client;
+
+  listener = wl_client_get_destroy_listener (wl_client, wakefield_client_destroyed);
+  if (listener == NULL)
+    return NULL;
+
+  return wl_container_of (listener, client, destroy_listener);
+}
+
+static WakefieldCompositor *
+route_client (WakefieldServer *server,
+              struct wl_client *wl_client)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  struct sockaddr_un addr;
+  socklen_t len = sizeof (addr);
+  WakefieldCompositor *compositor;
+  char *path;
+
+  if (priv->pending_compositor)
+    return priv->pending_compositor;
+
+  /* For an accepted connection this is the address of the listening socket */
+  if (getsockname (wl_client_get_fd (wl_client), (struct sockaddr *)&addr, &len) != 0 ||
+      len <= offsetof (struct sockaddr_un, sun_path))
+    return NULL;
+
+  path = g_strndup (addr.sun_path, len - offsetof (struct sockaddr_un, sun_path));
+  compositor = g_hash_table_lookup (priv->socket_routes, path);
+  g_free (path);
+
+  return compositor;
+}
+
+/* Per-client accounting */
+
+static const char *resource_names[WAKEFIELD_N_CLIENT_RESOURCES] = {
+  "surfaces",
+  "regions",
+  "frame callbacks",
+  "bytes of shm pools",
+};
+
+/* Returns FALSE, and disconnects the client, if this takes it over the
+   limit. The caller must not create the object then. */
+gboolean
+wakefield_client_charge (struct wl_client       *wl_client,
+                         WakefieldClientResource resource,
+                         guint64                 amount)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+  WakefieldServerPrivate *priv;
+  guint64 limit;
+
+  if (client == NULL)
+    return TRUE;
+
+  priv = wakefield_server_get_instance_private (client->server);
+  limit = priv->client_limits[resource];
+
+  if (limit != 0 && client->usage[resource] + amount > limit)
+    {
+      wl_resource_post_error (wl_client_get_object (wl_client, 1),
+                              WL_DISPLAY_ERROR_NO_MEMORY,
+                              "client exceeded its limit of %" G_GUINT64_FORMAT " %s",
+                              limit, resource_names[resource]);
+      return FALSE;
+    }
+
+  client->usage[resource] += amount;
+
+  return TRUE;
+}
+
+/* During client destruction the record is already gone, so this does
+   nothing then */
+void
+wakefield_client_release (struct wl_client       *wl_client,
+                          WakefieldClientResource resource,
+                          guint64                 amount)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  if (client == NULL)
+    return;
+
+  g_warn_if_fail (client->usage[resource] >= amount);
+  client->usage[resource] -= MIN (amount, client->usage[resource]);
+}
+
+/* Binding cache. Input and surface creation look these up for every
+   event, so we don't want to walk the per-compositor resource lists. */
+
+void
+wakefield_client_set_binding (struct wl_client       *wl_client,
+                              WakefieldClientBinding  binding,
+                              struct wl_resource     *resource)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  if (client == NULL)
+    return;
+
+  client->bindings[binding] = resource;
+}
+
+/* Call this after removing resource from list. If the client bound more
+   than one, we fall back to another one from the list. */
+void
+wakefield_client_unset_binding (struct wl_resource     *resource,
+                                WakefieldClientBinding  binding,
+                                struct wl_list         *list)
+{
+  struct wl_client *wl_client = wl_resource_get_client (resource);
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  if (client == NULL || client->bindings[binding] != resource)
+    return;
+
+  client->bindings[binding] = wl_resource_find_for_client (list, wl_client);
+}
+
+struct wl_resource *
+wakefield_client_get_binding (struct wl_client       *wl_client,
+                              WakefieldClientBinding  binding)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  if (client == NULL)
+    return NULL;
+
+  return client->bindings[binding];
+}
+
+/* The shm pools are libwayland's, so we follow them through the
+   requests and watch them being destroyed. We count the pool sizes,
+   even though the memory really goes away with the last buffer. */
+static void
+shm_pool_destroyed (struct wl_listener *listener, void *data)
+{
+  struct WakefieldShmPool *pool = wl_container_of (listener, pool, destroy_listener);
+  struct wl_resource *resource = data;
+
+  wakefield_client_release (wl_resource_get_client (resource),
+                            WAKEFIELD_CLIENT_RESOURCE_SHM_BYTES, pool->size);
+  g_slice_free (struct WakefieldShmPool, pool);
+}
+
+static void
+resource_created (struct wl_listener *listener, void *data)
+{
+  struct WakefieldClient *client = wl_container_of (listener, client, resource_created_listener);
+  struct wl_resource *resource = data;
+  struct WakefieldShmPool *pool;
+
+  if (client->pending_pool_size == 0 ||
+      strcmp (wl_resource_get_class (resource), wl_shm_pool_interface.name) != 0)
+    return;
+
+  pool = g_slice_new0 (struct WakefieldShmPool);
+  pool->size = client->pending_pool_size;
+  client->pending_pool_size = 0;
+
+  pool->destroy_listener.notify = shm_pool_destroyed;
+  wl_resource_add_destroy_listener (resource, &pool->destroy_listener);
+}
+
+static void
+account_request (struct WakefieldClient *client,
+                 const struct wl_protocol_logger_message *message)
+{
+  struct wl_listener *listener;
+  struct WakefieldShmPool *pool;
+  gint32 size;
+
+  /* Requests are logged before they are dispatched, so a charge still
+     pending now is for a create_pool that failed without making a pool */
+  if (client->pending_pool_size != 0)
+    {
+      wakefield_client_release (client->client, WAKEFIELD_CLIENT_RESOURCE_SHM_BYTES,
+                                client->pending_pool_size);
+      client->pending_pool_size = 0;
+    }
+
+  if (message->message == &wl_shm_interface.methods[0]) /* create_pool */
+    {
+      size = message->arguments[2].i;
+      if (size > 0 &&
+          wakefield_client_charge (client->client, WAKEFIELD_CLIENT_RESOURCE_SHM_BYTES, size))
+        client->pending_pool_size = size;
+    }
+  else if (message->message == &wl_shm_pool_interface.methods[2]) /* resize */
+    {
+      listener = wl_resource_get_destroy_listener (message->resource, shm_pool_destroyed);
+      if (listener == NULL)
+        return;
+
+      pool = wl_container_of (listener, pool, destroy_listener);
+      size = message->arguments[0].i;
+      if (size > pool->size &&
+          wakefield_client_charge (client->client, WAKEFIELD_CLIENT_RESOURCE_SHM_BYTES,
+                                   size - pool->size))
+        pool->size = size;
+    }
+}
+
+void
+wakefield_server_set_client_limit (WakefieldServer        *server,
+                                   WakefieldClientResource resource,
+                                   guint64                 limit)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  g_return_if_fail (resource < WAKEFIELD_N_CLIENT_RESOURCES);
+
+  priv->client_limits[resource] = limit;
+}
+
+guint64
+wakefield_server_get_client_limit (WakefieldServer        *server,
+                                   WakefieldClientResource resource)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  g_return_val_if_fail (resource < WAKEFIELD_N_CLIENT_RESOURCES, 0);
+
+  return priv->client_limits[resource];
+}
+
+void
+wakefield_server_foreach_client (WakefieldServer         *server,
+                                 WakefieldClientUsageFunc func,
+                                 gpointer                 user_data)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  struct WakefieldClient *client;
+
+  wl_list_for_each (client, &priv->clients, link)
+    func (client->pid, client->user_data, client->usage, user_data);
+}
+
+static void
+client_created (struct wl_listener *listener, void *data)
+{
+  WakefieldClientCreatedListener *w_listener = (WakefieldClientCreatedListener *)listener;
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (w_listener->server);
+  struct WakefieldClient *client;
+
+  client = g_slice_new0 (struct WakefieldClient);
+  client->server = w_listener->server;
+  client->client = data;
+  client->compositor = route_client (client->server, client->client);
+  if (priv->pending_compositor == NULL)
+    wl_client_get_credentials (client->client, &client->pid, NULL, NULL);
+  wl_list_init (&client->flush_link);
+  wl_list_insert (priv->clients.prev, &client->link);
+
+  client->destroy_listener.notify = wakefield_client_destroyed;
+  wl_client_add_destroy_listener (client->client, &client->destroy_listener);
+
+  client->resource_created_listener.notify = resource_created;
+  wl_client_add_resource_created_listener (client->client, &client->resource_created_listener);
+
+  /* Most likely it binds a keyboard soon */
+  load_keymap (client->server);
+}
+
+/* Clients whose widget went away (or that came in through a socket we
+   don't know) get to see no globals at all */
+static bool
+global_filter (const struct wl_client *wl_client,
+               const struct wl_global *global,
+               void *data)
+{
+  struct WakefieldClient *client;
+
+  client = wakefield_client_get ((struct wl_client *) wl_client);
+
+  return client != NULL && client->compositor != NULL;
+}
+
+WakefieldCompositor *
+wakefield_server_get_client_compositor (WakefieldServer  *server,
+                                        struct wl_client *wl_client)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  if (client == NULL)
+    return NULL;
+
+  return client->compositor;
+}
+
+/* Requests go to the accounting. We only see events through the logger,
+   but that is enough to know which clients need flushing at the end of
+   the iteration. */
+static void
+protocol_logger (void *user_data,
+                 enum wl_protocol_logger_type type,
+                 const struct wl_protocol_logger_message *message)
+{
+  WakefieldServer *server = user_data;
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  struct WakefieldClient *client;
+
+  client = wakefield_client_get (wl_resource_get_client (message->resource));
+  if (client == NULL)
+    return;
+
+  if (type == WL_PROTOCOL_LOGGER_REQUEST)
+    {
+      account_request (client, message);
+      return;
+    }
+
+  if (!wl_list_empty (&client->flush_link))
+    return;
+
+  wl_list_insert (&priv->dirty_clients, &client->flush_link);
+}
+
+/* A client that stopped answering pings is treated like one that stopped
+   reading, so it doesn't pile up events it won't look at anyway */
+gboolean
+wakefield_client_is_backed_up (struct wl_client *wl_client)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  return client != NULL && (client->backed_up || client->unresponsive);
+}
+
+/* Liveness tracking. The compositor sends the pings, we just remember
+   the outstanding one. */
+
+/* Returns TRUE if a ping is outstanding, and when it was sent */
+gboolean
+wakefield_client_get_ping (struct wl_client *wl_client,
+                           gint64           *ping_time)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  if (client == NULL || client->ping_serial == 0)
+    return FALSE;
+
+  *ping_time = client->ping_time;
+
+  return TRUE;
+}
+
+void
+wakefield_client_set_ping (struct wl_client *wl_client,
+                           guint32           serial,
+                           gint64            ping_time)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  if (client == NULL)
+    return;
+
+  client->ping_serial = serial;
+  client->ping_time = ping_time;
+}
+
+/* Returns TRUE if this answers the outstanding ping of a client we had
+   given up on */
+gboolean
+wakefield_client_pong (struct wl_client *wl_client,
+                       guint32           serial)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+  gboolean was_unresponsive;
+
+  if (client == NULL || client->ping_serial == 0 || client->ping_serial != serial)
+    return FALSE;
+
+  was_unresponsive = client->unresponsive;
+  client->ping_serial = 0;
+  client->unresponsive = FALSE;
+
+  return was_unresponsive;
+}
+
+void
+wakefield_client_set_unresponsive (struct wl_client *wl_client)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  if (client)
+    client->unresponsive = TRUE;
+}
+
+/* See WakefieldClientUsageFunc for what the host gets to know */
+void
+wakefield_client_get_identity (struct wl_client *wl_client,
+                               GPid             *pid,
+                               gpointer         *user_data)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  *pid = client ? client->pid : 0;
+  *user_data = client ? client->user_data : NULL;
+}
+
+gboolean
+wakefield_client_is_unresponsive (struct wl_client *wl_client)
+{
+  struct WakefieldClient *client = wakefield_client_get (wl_client);
+
+  return client != NULL && client->unresponsive;
+}
+
+static void
+flush_dirty_clients (WakefieldServer *server)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  struct WakefieldClient *client, *tmp;
+  struct wl_list backed_up;
+  gboolean blocked = FALSE;
+
+  wl_list_init (&backed_up);
+
+  wl_list_for_each_safe (client, tmp, &priv->dirty_clients, flush_link)
+    {
+      wl_list_remove (&client->flush_link);
+      wl_list_init (&client->flush_link);
+
+      /* wl_client_flush() doesn't report errors, but leaves errno alone */
+      errno = 0;
+      wl_client_flush (client->client);
+      if (errno == EAGAIN)
+        {
+          /* Keep trying until it drains, so we notice when it does */
+          client->backed_up = TRUE;
+          wl_list_insert (&backed_up, &client->flush_link);
+          blocked = TRUE;
+        }
+      else if (client->backed_up)
+        {
+          client->backed_up = FALSE;
+          if (client->compositor && !client->unresponsive)
+            wakefield_compositor_client_unblocked (client->compositor, client->client);
+
+          /* What we held back goes out right away too */
+          wl_list_remove (&client->flush_link);
+          wl_list_init (&client->flush_link);
+          errno = 0;
+          wl_client_flush (client->client);
+          if (errno == EAGAIN)
+            {
+              client->backed_up = TRUE;
+              wl_list_insert (&backed_up, &client->flush_link);
+              blocked = TRUE;
+            }
+        }
+    }
+
+  wl_list_insert_list (&priv->dirty_clients, &backed_up);
+
+  /* Only the display-wide flush knows to wait for a full socket to
+     become writable again, so let it handle the stragglers */
+  if (blocked)
+    wl_display_flush_clients (priv->wl_display);
+}
+
+/* libwayland can only dispatch the whole event loop, so this makes a
+   single pass over it, which serves any other ready client at most once.
+   Everything after that is left to the budgeted, normal priority source,
+   so busy clients can't ride along above the frame clock. */
+static gboolean
+focus_client_ready (gint fd,
+                    GIOCondition condition,
+                    gpointer user_data)
+{
+  WakefieldServer *server = user_data;
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  wl_event_loop_dispatch (wl_display_get_event_loop (priv->wl_display), 0);
+
+  return G_SOURCE_CONTINUE;
+}
+
+void
+wakefield_server_set_focus_client (WakefieldServer  *server,
+                                   struct wl_client *wl_client)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  struct WakefieldClient *client = NULL;
+
+  if (wl_client)
+    client = wakefield_client_get (wl_client);
+
+  if (client == priv->focus_client)
+    return;
+
+  if (priv->focus_source)
+    {
+      g_source_destroy (priv->focus_source);
+      g_source_unref (priv->focus_source);
+      priv->focus_source = NULL;
+    }
+
+  priv->focus_client = client;
+
+  /* Watch the focused client on its own, at a priority above the other
+     clients and the frame clock, so typing stays responsive when the rest
+     of them are busy */
+  if (client)
+    {
+      priv->focus_source = g_unix_fd_source_new (wl_client_get_fd (client->client),
+                                                 G_IO_IN | G_IO_ERR | G_IO_HUP);
+      g_source_set_priority (priv->focus_source, G_PRIORITY_HIGH);
+      g_source_set_callback (priv->focus_source, (GSourceFunc) focus_client_ready,
+                             server, NULL);
+      g_source_attach (priv->focus_source, NULL);
+    }
+}
+
+/* Widgets share the server, so one losing focus must not take it away
+   from a client another one just gave it to */
+void
+wakefield_server_unset_focus_client (WakefieldServer  *server,
+                                     struct wl_client *wl_client)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  if (priv->focus_client != NULL && priv->focus_client->client == wl_client)
+    wakefield_server_set_focus_client (server, NULL);
+}
+
+/* Compositors */
+
+struct wl_display *
+wakefield_server_get_display (WakefieldServer *server)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  return priv->wl_display;
+}
+
+void
+wakefield_server_add_compositor (WakefieldServer     *server,
+                                 WakefieldCompositor *compositor)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  priv->compositors = g_list_prepend (priv->compositors, compositor);
+}
+
+static gboolean
+route_is_compositor (gpointer key,
+                     gpointer value,
+                     gpointer user_data)
+{
+  return value == user_data;
+}
+
+/* Disconnects all the clients of the compositor */
+void
+wakefield_server_remove_compositor (WakefieldServer     *server,
+                                    WakefieldCompositor *compositor)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  struct WakefieldClient *client, *tmp;
+
+  if (g_list_find (priv->compositors, compositor) == NULL)
+    return;
+
+  priv->compositors = g_list_remove (priv->compositors, compositor);
+
+  /* There is no way to remove a socket from a wl_display, so later
+     connections on it just end up without a compositor */
+  g_hash_table_foreach_remove (priv->socket_routes, route_is_compositor, compositor);
+
+  wl_list_for_each_safe (client, tmp, &priv->clients, link)
+    {
+      if (client->compositor == compositor)
+        wl_client_destroy (client->client);
+    }
+}
+
+static char *
+get_socket_path (const char *name)
+{
+  const char *runtime_dir;
+
+  /* Same lookup as wl_display_add_socket() */
+  if (name == NULL)
+    name = g_getenv ("WAYLAND_DISPLAY");
+  if (name == NULL)
+    name = "wayland-0";
+
+  if (g_path_is_absolute (name))
+    return g_strdup (name);
+
+  runtime_dir = g_getenv ("XDG_RUNTIME_DIR");
+  if (runtime_dir == NULL)
+    return NULL;
+
+  return g_build_filename (runtime_dir, name, NULL);
+}
+
+static void
+add_socket_route (WakefieldServer     *server,
+                  WakefieldCompositor *compositor,
+                  const char          *name)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  char *path;
+
+  path = get_socket_path (name);
+  if (path)
+    g_hash_table_insert (priv->socket_routes, path, compositor);
+}
+
+gboolean
+wakefield_server_add_socket (WakefieldServer     *server,
+                             WakefieldCompositor *compositor,
+                             const char          *name,
+                             GError             **error)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  if (wl_display_add_socket (priv->wl_display, name) != 0)
+    {
+      int errsv = errno;
+
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (errsv),
+                   _("Error adding wayland display '%s' socket: %s"),
+                   name ? name : "NULL",
+                   strerror (errsv));
+      return FALSE;
+    }
+
+  add_socket_route (server, compositor, name);
+
+  return TRUE;
+}
+
+const char *
+wakefield_server_add_socket_auto (WakefieldServer     *server,
+                                  WakefieldCompositor *compositor,
+                                  GError             **error)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  const char *name;
+
+  name = wl_display_add_socket_auto (priv->wl_display);
+  if (name == NULL)
+    {
+      int errsv = errno;
+
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (errsv),
+                   _("Error adding automatic socket: %s"),
+                   strerror (errsv));
+      return NULL;
+    }
+
+  add_socket_route (server, compositor, name);
+
+  return name;
+}
+
+typedef struct {
+  struct wl_listener listener;
+  GDestroyNotify destroy_notify;
+  gpointer user_data;
+} WakefieldClientDestroyListener;
+
+static void
+client_destroyed (struct wl_listener *listener, void *data)
+{
+  WakefieldClientDestroyListener *w_listener = (WakefieldClientDestroyListener *)listener;
+
+  w_listener->destroy_notify (w_listener->user_data);
+}
+
+int
+wakefield_server_create_client_fd (WakefieldServer     *server,
+                                   WakefieldCompositor *compositor,
+                                   GDestroyNotify       destroy_notify,
+                                   gpointer             user_data,
+                                   GError             **error)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  struct wl_client *client;
+  int fds[2];
+
+  if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+    {
+      int errsv = errno;
+
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (errsv),
+                   _("Error creating wayland socketpair: %s"),
+                   strerror (errsv));
+      return -1;
+    }
+
+  priv->pending_compositor = compositor;
+  client = wl_client_create (priv->wl_display, fds[0]);
+  priv->pending_compositor = NULL;
+
+  if (client == NULL)
+    {
+      int errsv = errno;
+
+      close (fds[0]);
+      close (fds[1]);
+      g_set_error (error,
+                   G_IO_ERROR,
+                   g_io_error_from_errno (errsv),
+                   _("Error creating wayland client: %s"),
+                   strerror (errsv));
+      return -1;
+    }
+
+  wakefield_client_get (client)->user_data = user_data;
+
+  if (destroy_notify)
+    {
+      WakefieldClientDestroyListener *listener = g_new0 (WakefieldClientDestroyListener, 1);
+      listener->listener.notify = client_destroyed;
+      listener->destroy_notify = destroy_notify;
+      listener->user_data = user_data;
+
+      wl_client_add_destroy_listener (client, &listener->listener);
+    }
+
+  return fds[1];
+}
+
+/* Shared files */
+
+static int
+create_anonymous_file (gsize size)
+{
+  char *tmpname;
+  int fd;
+  int ret;
+
+  tmpname = g_build_filename (g_get_user_runtime_dir (), "/weston-shared-XXXXXX", NULL);
+  fd = g_mkstemp (tmpname);
+  unlink (tmpname);
+  free (tmpname);
+
+  if (fd < 0)
+    return -1;
+
+#ifdef HAVE_POSIX_FALLOCATE
+  ret = posix_fallocate (fd, 0, size);
+  if (ret != 0)
+    {
+      close (fd);
+      errno = ret;
+      return -1;
+    }
+#else
+  ret = ftruncate (fd, size);
+  if (ret < 0)
+    {
+      close (fd);
+      return -1;
+    }
+#endif
+
+  return fd;
+}
+
+static gboolean
+write_all (int           fd,
+           const char*    buf,
+           gsize         len)
+{
+  while (len > 0)
+    {
+      gssize bytes_written = write (fd, buf, len);
+      if (bytes_written < 0 && errno == EINTR)
+        continue;
+      if (bytes_written < 0)
+        {
+          g_warning ("Failed to write to fd %d: %s",
+                     fd, strerror (errno));
+          return FALSE;
+        }
+      buf += bytes_written;
+      len -= bytes_written;
+    }
+
+  return TRUE;
+}
+
+/* Sealed, so one fd can go to every client: none of them can change
+   what the others read. Safe to call from any thread. */
+int
+wakefield_create_sealed_file (const char *name,
+                              const char *data,
+                              gsize       size)
+{
+  int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create (name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd >= 0)
+    {
+      if (!write_all (fd, data, size) ||
+          fcntl (fd, F_ADD_SEALS,
+                 F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0)
+        {
+          close (fd);
+          return -1;
+        }
+      return fd;
+    }
+#endif
+
+  /* Kernels without memfd */
+  fd = create_anonymous_file (size);
+  if (fd >= 0 && !write_all (fd, data, size))
+    {
+      close (fd);
+      return -1;
+    }
+
+  return fd;
+}
+
+/* Keymap */
+
+/* Keymaps are shared by every server in the process, and by all their
+   clients: there is one sealed, read-only fd per distinct keymap text,
+   and the keymap GDK has now is kept around until it changes. */
+G_LOCK_DEFINE_STATIC (keymaps);
+/* SHA-256 of the keymap text -> WakefieldKeymap */
+static GHashTable *keymaps;
+static WakefieldKeymap *current_keymap;
+/* Bumped on keys-changed, so a compile that started before that doesn't
+   become the current keymap */
+static guint keymap_generation;
+
+/* Compiling takes an X round trip, so it has a lock of its own that
+   keys_changed() on the main thread never waits for. The xkb_context
+   is only used under it. */
+G_LOCK_DEFINE_STATIC (keymap_compile);
+static struct xkb_context *xkb_context;
+
+/* This runs in a worker thread, so it talks to the X server over a
+   connection of its own rather than GDK's */
+static struct xkb_keymap *
+compile_keymap (const char *display_name)
+{
+#if defined(GDK_WINDOWING_X11)
+  struct xkb_keymap *keymap = NULL;
+  xcb_connection_t *conn;
+  int32_t core_id;
+
+  conn = xcb_connect (display_name, NULL);
+  if (xcb_connection_has_error (conn))
+    {
+      xcb_disconnect (conn);
+      return NULL;
+    }
+
+  if (xkb_x11_setup_xkb_extension (conn,
+                                   XKB_X11_MIN_MAJOR_XKB_VERSION, XKB_X11_MIN_MINOR_XKB_VERSION,
+                                   0,
+                                   NULL, NULL, NULL, NULL))
+    {
+      core_id = xkb_x11_get_core_keyboard_device_id (conn);
+      keymap = xkb_x11_keymap_new_from_device (xkb_context,
+                                               conn,
+                                               core_id,
+                                               XKB_KEYMAP_COMPILE_NO_FLAGS);
+    }
+
+  xcb_disconnect (conn);
+
+  return keymap;
+#else
+  return NULL;
+#endif
+}
+
+static void
+wakefield_keymap_unref_locked (WakefieldKeymap *keymap)
+{
+  if (--keymap->ref_count > 0)
+    return;
+
+  g_hash_table_remove (keymaps, keymap->checksum);
+  if (keymap->fd != -1)
+    close (keymap->fd);
+  xkb_keymap_unref (keymap->keymap);
+  g_free (keymap->checksum);
+  g_slice_free (WakefieldKeymap, keymap);
+}
+
+static void
+wakefield_keymap_unref (WakefieldKeymap *keymap)
+{
+  G_LOCK (keymaps);
+  wakefield_keymap_unref_locked (keymap);
+  G_UNLOCK (keymaps);
+}
+
+/* Takes over xkb_keymap. A recompile that comes out the same, say after
+   a spurious keys-changed, ends up with the old fd. */
+static WakefieldKeymap *
+wakefield_keymap_lookup_locked (struct xkb_keymap *xkb_keymap)
+{
+  WakefieldKeymap *keymap;
+  char *str, *checksum;
+
+  str = xkb_keymap_get_as_string (xkb_keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+  if (str == NULL)
+    {
+      xkb_keymap_unref (xkb_keymap);
+      return NULL;
+    }
+
+  checksum = g_compute_checksum_for_string (G_CHECKSUM_SHA256, str, -1);
+  keymap = g_hash_table_lookup (keymaps, checksum);
+  if (keymap)
+    {
+      keymap->ref_count++;
+      xkb_keymap_unref (xkb_keymap);
+      g_free (checksum);
+    }
+  else
+    {
+      keymap = g_slice_new0 (WakefieldKeymap);
+      keymap->ref_count = 1;
+      keymap->checksum = checksum;
+      keymap->keymap = xkb_keymap;
+      keymap->size = strlen (str);
+      keymap->fd = wakefield_create_sealed_file ("wakefield-keymap", str, keymap->size);
+      g_hash_table_insert (keymaps, keymap->checksum, keymap);
+    }
+
+  free (str);
+
+  return keymap;
+}
+
+static void
+keys_changed (GdkKeymap *gdk_keymap,
+              gpointer   user_data)
+{
+  G_LOCK (keymaps);
+  keymap_generation++;
+  if (current_keymap)
+    {
+      wakefield_keymap_unref_locked (current_keymap);
+      current_keymap = NULL;
+    }
+  G_UNLOCK (keymaps);
+}
+
+/* Returns a new reference to the keymap of the X display, or NULL.
+   Safe to call from any thread. */
+static WakefieldKeymap *
+wakefield_keymap_get (const char *display_name)
+{
+  WakefieldKeymap *keymap = NULL;
+  struct xkb_keymap *xkb_keymap;
+  guint generation;
+
+  G_LOCK (keymaps);
+  if (keymaps == NULL)
+    keymaps = g_hash_table_new (g_str_hash, g_str_equal);
+
+  if (current_keymap)
+    {
+      keymap = current_keymap;
+      keymap->ref_count++;
+    }
+  generation = keymap_generation;
+  G_UNLOCK (keymaps);
+
+  if (keymap)
+    return keymap;
+
+  G_LOCK (keymap_compile);
+  if (xkb_context == NULL)
+    xkb_context = xkb_context_new (XKB_CONTEXT_NO_FLAGS);
+  xkb_keymap = compile_keymap (display_name);
+  G_UNLOCK (keymap_compile);
+
+  if (xkb_keymap == NULL)
+    return NULL;
+
+  G_LOCK (keymaps);
+  keymap = wakefield_keymap_lookup_locked (xkb_keymap);
+  if (keymap && current_keymap == NULL && generation == keymap_generation)
+    {
+      current_keymap = keymap;
+      keymap->ref_count++;
+    }
+  G_UNLOCK (keymaps);
+
+  return keymap;
+}
+
+/* Raw motion. The relative pointer wants unaccelerated deltas, which
+   only XInput2 has. Raw events go to the root window, and we hand them
+   to every compositor; only the one with the pointer uses them. */
+
+#if defined(GDK_WINDOWING_X11)
+static gboolean
+raw_motion_device_is_absolute (WakefieldServer *server,
+                               Display         *xdisplay,
+                               int              deviceid)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  gpointer value;
+  gboolean absolute = FALSE;
+  XIDeviceInfo *info;
+  int i, n_devices;
+
+  if (g_hash_table_lookup_extended (priv->raw_motion_devices,
+                                    GINT_TO_POINTER (deviceid), NULL, &value))
+    return GPOINTER_TO_INT (value);
+
+  /* Tablets and touchscreens give positions, not deltas */
+  gdk_x11_display_error_trap_push (gdk_display_get_default ());
+  info = XIQueryDevice (xdisplay, deviceid, &n_devices);
+  gdk_x11_display_error_trap_pop_ignored (gdk_display_get_default ());
+
+  if (info != NULL)
+    {
+      for (i = 0; i < info->num_classes; i++)
+        {
+          XIValuatorClassInfo *valuator = (XIValuatorClassInfo *)info->classes[i];
+
+          if (valuator->type == XIValuatorClass &&
+              valuator->number <= 1 &&
+              valuator->mode == XIModeAbsolute)
+            absolute = TRUE;
+        }
+      XIFreeDeviceInfo (info);
+    }
+
+  g_hash_table_insert (priv->raw_motion_devices,
+                       GINT_TO_POINTER (deviceid), GINT_TO_POINTER (absolute));
+
+  return absolute;
+}
+
+static GdkFilterReturn
+raw_motion_filter (GdkXEvent *gdk_xevent,
+                   GdkEvent  *event,
+                   gpointer   user_data)
+{
+  WakefieldServer *server = user_data;
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  XGenericEventCookie *cookie = &((XEvent *)gdk_xevent)->xcookie;
+  XIRawEvent *raw;
+  double delta[2] = { 0, 0 }, delta_unaccel[2] = { 0, 0 };
+  double *values, *raw_values;
+  GList *l;
+  int i;
+
+  /* GDK has fetched the cookie data for us */
+  if (cookie->type != GenericEvent ||
+      cookie->extension != priv->xi_opcode ||
+      cookie->data == NULL)
+    return GDK_FILTER_CONTINUE;
+
+  if (cookie->evtype == XI_HierarchyChanged)
+    {
+      /* Device ids get reused */
+      g_hash_table_remove_all (priv->raw_motion_devices);
+      return GDK_FILTER_CONTINUE;
+    }
+
+  if (cookie->evtype != XI_RawMotion)
+    return GDK_FILTER_CONTINUE;
+
+  raw = cookie->data;
+  if (raw_motion_device_is_absolute (server, cookie->display, raw->sourceid))
+    return GDK_FILTER_CONTINUE;
+
+  values = raw->valuators.values;
+  raw_values = raw->raw_values;
+  for (i = 0; i < raw->valuators.mask_len * 8; i++)
+    {
+      if (!XIMaskIsSet (raw->valuators.mask, i))
+        continue;
+
+      if (i < 2)
+        {
+          delta[i] = *values;
+          delta_unaccel[i] = *raw_values;
+        }
+      values++;
+      raw_values++;
+    }
+
+  if (delta[0] == 0 && delta[1] == 0 &&
+      delta_unaccel[0] == 0 && delta_unaccel[1] == 0)
+    return GDK_FILTER_CONTINUE;
+
+  for (l = priv->compositors; l != NULL; l = l->next)
+    wakefield_compositor_send_relative_motion (l->data,
+                                               (guint64) raw->time * 1000,
+                                               delta[0], delta[1],
+                                               delta_unaccel[0], delta_unaccel[1]);
+
+  return GDK_FILTER_CONTINUE;
+}
+
+static void
+select_raw_motion (WakefieldServer *server,
+                   gboolean         select)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  GdkDisplay *display = gdk_display_get_default ();
+  Display *xdisplay = gdk_x11_display_get_xdisplay (display);
+  unsigned char mask_bits[XIMaskLen (XI_LASTEVENT)] = { 0 };
+  XIEventMask mask;
+
+  if (select)
+    XISetMask (mask_bits, XI_RawMotion);
+
+  /* GDK selects for XIAllDevices on the root window, this doesn't
+     replace its mask */
+  mask.deviceid = XIAllMasterDevices;
+  mask.mask_len = sizeof (mask_bits);
+  mask.mask = mask_bits;
+
+  gdk_x11_display_error_trap_push (display);
+  XISelectEvents (xdisplay, DefaultRootWindow (xdisplay), &mask, 1);
+  priv->raw_motion_selected = gdk_x11_display_error_trap_pop (display) == 0 && select;
+}
+#endif
+
+/* Returns FALSE if there are no raw events, and the caller has to work
+   out the deltas from the pointer position */
+gboolean
+wakefield_server_watch_raw_motion (WakefieldServer *server)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  if (priv->raw_motion_users++ > 0)
+    return priv->raw_motion_selected;
+
+#if defined(GDK_WINDOWING_X11)
+  if (GDK_IS_X11_DISPLAY (gdk_display_get_default ()))
+    {
+      Display *xdisplay = gdk_x11_display_get_xdisplay (gdk_display_get_default ());
+      int event, error;
+
+      if (priv->xi_opcode == 0 &&
+          !XQueryExtension (xdisplay, "XInputExtension", &priv->xi_opcode, &event, &error))
+        priv->xi_opcode = -1;
+
+      if (priv->xi_opcode != -1)
+        select_raw_motion (server, TRUE);
+
+      if (priv->raw_motion_selected)
+        gdk_window_add_filter (NULL, raw_motion_filter, server);
+    }
+#endif
+
+  return priv->raw_motion_selected;
+}
+
+void
+wakefield_server_unwatch_raw_motion (WakefieldServer *server)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  g_return_if_fail (priv->raw_motion_users > 0);
+
+  if (--priv->raw_motion_users > 0)
+    return;
+
+#if defined(GDK_WINDOWING_X11)
+  if (priv->raw_motion_selected)
+    {
+      gdk_window_remove_filter (NULL, raw_motion_filter, server);
+      select_raw_motion (server, FALSE);
+    }
+#endif
+}
+
+static void
+load_keymap_thread (GTask        *task,
+                    gpointer      source_object,
+                    gpointer      task_data,
+                    GCancellable *cancellable)
+{
+  g_task_return_pointer (task, wakefield_keymap_get (task_data),
+                         (GDestroyNotify) wakefield_keymap_unref);
+}
+
+static void
+load_keymap_done (GObject      *source_object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  WakefieldServer *server = WAKEFIELD_SERVER (source_object);
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  GList *l;
+
+  priv->keymap = g_task_propagate_pointer (G_TASK (result), NULL);
+  priv->keymap_loading = FALSE;
+  priv->keymap_loaded = TRUE;
+
+  for (l = priv->compositors; l != NULL; l = l->next)
+    wakefield_compositor_keymap_loaded (l->data);
+}
+
+/* Compiling the keymap takes a round trip to the X server and then a
+   while, so we only start once a client shows up, and do it in a
+   thread */
+static void
+load_keymap (WakefieldServer *server)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  GdkDisplay *display = gdk_display_get_default ();
+  static gsize watching = 0;
+  GTask *task;
+
+  if (priv->keymap_loaded || priv->keymap_loading)
+    return;
+
+#if defined(GDK_WINDOWING_X11)
+  if (GDK_IS_X11_DISPLAY (display))
+    {
+      if (g_once_init_enter (&watching))
+        {
+          g_signal_connect (gdk_keymap_get_for_display (display), "keys-changed",
+                            G_CALLBACK (keys_changed), NULL);
+          g_once_init_leave (&watching, 1);
+        }
+
+      priv->keymap_loading = TRUE;
+
+      task = g_task_new (server, NULL, load_keymap_done, NULL);
+      g_task_set_source_tag (task, load_keymap);
+      g_task_set_task_data (task, g_strdup (gdk_display_get_name (display)), g_free);
+      g_task_run_in_thread (task, load_keymap_thread);
+      g_object_unref (task);
+      return;
+    }
+#endif
+
+  priv->keymap_loaded = TRUE;
+}
+
+/* Shared by the keyboards of all our compositors. Returns NULL if there
+   is no keymap, or while it is still loading; the compositors hear from
+   wakefield_compositor_keymap_loaded() once it is there. *fd is -1 if
+   we couldn't serialize it. */
+struct xkb_keymap *
+wakefield_server_get_keymap (WakefieldServer *server,
+                             int             *fd,
+                             gsize           *size)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  load_keymap (server);
+
+  if (priv->keymap == NULL)
+    {
+      *fd = -1;
+      *size = 0;
+      return NULL;
+    }
+
+  *fd = priv->keymap->fd;
+  *size = priv->keymap->size;
+
+  return priv->keymap->keymap;
+}
+
+/* Wayland GSource */
+
+/* How long one main loop iteration may spend on client requests */
+#define DISPATCH_BUDGET (G_USEC_PER_SEC / 250)
+
+/* Where we drop to once a dispatch overruns its budget, so that the
+   frame clock gets to paint before we continue */
+#define DISPATCH_PRIORITY_BUSY (GDK_PRIORITY_REDRAW + 10)
+
+static gboolean
+wayland_event_loop_has_events (struct wl_event_loop *loop)
+{
+  struct pollfd pfd = { wl_event_loop_get_fd (loop), POLLIN, 0 };
+
+  return poll (&pfd, 1, 0) > 0;
+}
+
+/* Every pass over the loop reads from each ready client once, and
+   libwayland only reads what fits in a client's connection buffer, so
+   the clients take turns and a chatty one can't get more than its share.
+   Returns TRUE if we ran out of time with requests still waiting. */
+static gboolean
+dispatch_clients (WakefieldServer *server)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  struct wl_event_loop *loop = wl_display_get_event_loop (priv->wl_display);
+  gint64 deadline = g_get_monotonic_time () + DISPATCH_BUDGET;
+
+  do
+    {
+      if (wl_event_loop_dispatch (loop, 0) < 0)
+        return FALSE;
+
+      if (!wayland_event_loop_has_events (loop))
+        return FALSE;
+    }
+  while (g_get_monotonic_time () < deadline);
+
+  return TRUE;
+}
+
+typedef struct
+{
+  GSource source;
+  WakefieldServer *server;
+} WaylandEventSource;
+
+static gboolean
+wayland_event_source_prepare (GSource *base, int *timeout)
+{
+  WaylandEventSource *source = (WaylandEventSource *)base;
+
+  *timeout = -1;
+
+  flush_dirty_clients (source->server);
+
+  return FALSE;
+}
+
+static gboolean
+wayland_event_source_dispatch (GSource *base,
+                               GSourceFunc callback,
+                               void *data)
+{
+  WaylandEventSource *source = (WaylandEventSource *)base;
+
+  if (dispatch_clients (source->server))
+    g_source_set_priority (base, DISPATCH_PRIORITY_BUSY);
+  else
+    g_source_set_priority (base, G_PRIORITY_DEFAULT);
+
+  return TRUE;
+}
+
+static GSourceFuncs wayland_event_source_funcs =
+{
+  wayland_event_source_prepare,
+  NULL,
+  wayland_event_source_dispatch,
+  NULL
+};
+
+static GSource *
+wayland_event_source_new (WakefieldServer *server)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+  WaylandEventSource *source;
+  struct wl_event_loop *loop = wl_display_get_event_loop (priv->wl_display);
+
+  source = (WaylandEventSource *) g_source_new (&wayland_event_source_funcs,
+                                                sizeof (WaylandEventSource));
+  source->server = server;
+  g_source_add_unix_fd (&source->source,
+                        wl_event_loop_get_fd (loop),
+                        G_IO_IN | G_IO_ERR);
+
+  return &source->source;
+}
+
+static void
+wakefield_server_init (WakefieldServer *server)
+{
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  priv->socket_routes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  priv->raw_motion_devices = g_hash_table_new (NULL, NULL);
+
+  priv->wl_display = wl_display_create ();
+  wl_display_init_shm (priv->wl_display);
+
+  wl_list_init (&priv->clients);
+  wl_list_init (&priv->dirty_clients);
+  priv->client_created_listener.listener.notify = client_created;
+  priv->client_created_listener.server = server;
+  wl_display_add_client_created_listener (priv->wl_display,
+                                          &priv->client_created_listener.listener);
+  priv->protocol_logger = wl_display_add_protocol_logger (priv->wl_display,
+                                                          protocol_logger, server);
+  wl_display_set_global_filter (priv->wl_display, global_filter, server);
+
+  wakefield_compositor_create_globals (server);
+  wakefield_data_device_create_global (server);
+
+  /* Attach the wl_event_loop to ours */
+  priv->wayland_source = wayland_event_source_new (server);
+  g_source_attach (priv->wayland_source, NULL);
+}
+
+WakefieldServer *
+wakefield_server_new (void)
+{
+  return g_object_new (WAKEFIELD_TYPE_SERVER, NULL);
+}
+
+static void
+wakefield_server_finalize (GObject *object)
+{
+  WakefieldServer *server = WAKEFIELD_SERVER (object);
+  WakefieldServerPrivate *priv = wakefield_server_get_instance_private (server);
+
+  /* Every compositor holds a reference on us */
+  g_assert (priv->compositors == NULL);
+
+  wl_display_destroy_clients (priv->wl_display);
+
+  if (priv->focus_source)
+    {
+      g_source_destroy (priv->focus_source);
+      g_source_unref (priv->focus_source);
+    }
+
+  g_source_destroy (priv->wayland_source);
+  g_source_unref (priv->wayland_source);
+  wl_protocol_logger_destroy (priv->protocol_logger);
+  wl_display_destroy (priv->wl_display);
+
+  if (priv->keymap)
+    wakefield_keymap_unref (priv->keymap);
+
+  g_hash_table_destroy (priv->socket_routes);
+  g_hash_table_destroy (priv->raw_motion_devices);
+
+  G_OBJECT_CLASS (wakefield_server_parent_class)->finalize (object);
+}
+
+static void
+wakefield_server_class_init (WakefieldServerClass *klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = wakefield_server_finalize;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2015 Endless OS Foundation LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#define WAKEFIELD_TYPE_SERVER            (wakefield_server_get_type ())
+#define WAKEFIELD_SERVER(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), WAKEFIELD_TYPE_SERVER, WakefieldServer))
+#define WAKEFIELD_SERVER_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass),  WAKEFIELD_TYPE_SERVER, WakefieldServerClass))
+#define WAKEFIELD_IS_SERVER(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), WAKEFIELD_TYPE_SERVER))
+#define WAKEFIELD_IS_SERVER_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass),  WAKEFIELD_TYPE_SERVER))
+#define WAKEFIELD_SERVER_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj),  WAKEFIELD_TYPE_SERVER, WakefieldServerClass))
+
+typedef enum {
+  WAKEFIELD_CLIENT_RESOURCE_SURFACES,
+  WAKEFIELD_CLIENT_RESOURCE_REGIONS,
+  WAKEFIELD_CLIENT_RESOURCE_FRAME_CALLBACKS,
+  WAKEFIELD_CLIENT_RESOURCE_SHM_BYTES,
+  WAKEFIELD_N_CLIENT_RESOURCES
+} WakefieldClientResource;
+
+/* usage is indexed by WakefieldClientResource. Clients that connected
+   through a socket come with their pid and NULL client_data, those from
+   wakefield_compositor_create_client_fd() with a pid of 0 and the
+   user_data that was passed there. */
+typedef void (* WakefieldClientUsageFunc) (GPid           pid,
+                                           gpointer       client_data,
+                                           const guint64 *usage,
+                                           gpointer       user_data);
+
+typedef struct _WakefieldServer        WakefieldServer;
+typedef struct _WakefieldServerClass   WakefieldServerClass;
+
+struct _WakefieldServer
+{
+  GObject parent;
+};
+
+struct _WakefieldServerClass
+{
+  GObjectClass parent_class;
+};
+
+GType wakefield_server_get_type (void) G_GNUC_CONST;
+
+WakefieldServer *wakefield_server_new              (void);
+void             wakefield_server_set_client_limit (WakefieldServer          *server,
+                                                    WakefieldClientResource   resource,
+                                                    guint64                   limit);
+guint64          wakefield_server_get_client_limit (WakefieldServer          *server,
+                                                    WakefieldClientResource   resource);
+void             wakefield_server_foreach_client   (WakefieldServer          *server,
+                                                    WakefieldClientUsageFunc  func,
+                                                    gpointer                  user_data);
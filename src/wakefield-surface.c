@@ -28,55 +28,97 @@
 
 #include "wakefield-private.h"
 #include "xdg-shell-server-protocol.h"
+#include "fifo-v1-server-protocol.h"
+#include "commit-timing-v1-server-protocol.h"
+#include "viewporter-server-protocol.h"
 
-#define WAKEFIELD_TYPE_SURFACE            (wakefield_surface_get_type ())
-#define WAKEFIELD_SURFACE(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), WAKEFIELD_TYPE_SURFACE, WakefieldSurface))
-#define WAKEFIELD_SURFACE_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass),  WAKEFIELD_TYPE_SURFACE, WakefieldSurfaceClass))
-#define WAKEFIELD_IS_SURFACE(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), WAKEFIELD_TYPE_SURFACE))
-#define WAKEFIELD_IS_SURFACE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass),  WAKEFIELD_TYPE_SURFACE))
-#define WAKEFIELD_SURFACE_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj),  WAKEFIELD_TYPE_SURFACE, WakefieldSurfaceClass))
-
-typedef struct _WakefieldSurfaceClass WakefieldSurfaceClass;
-
-struct _WakefieldSurfaceClass
+/* The wp_viewport state. A src_width of -1 means there is no source
+   rectangle, a dst_width of -1 that there is no destination size. */
+struct WakefieldViewport
 {
-  GObjectClass parent_class;
+  wl_fixed_t src_x, src_y, src_width, src_height;
+  int dst_width, dst_height;
 };
 
-GType wakefield_surface_get_type (void) G_GNUC_CONST;
+/* Damage is kept in place as a few rectangles, so that gathering it
+   never allocates, as cairo regions do whenever they grow. Once they run
+   out, the last one takes in everything else that comes. */
+#define DAMAGE_MAX_RECTANGLES 8
 
-enum {
-  COMMITTED,
-
-  LAST_SIGNAL
+struct WakefieldDamage
+{
+  int n_rectangles;
+  cairo_rectangle_int_t rectangles[DAMAGE_MAX_RECTANGLES];
 };
 
-static guint signals[LAST_SIGNAL];
-
 struct WakefieldSurfacePendingState
 {
   struct wl_resource *buffer;
   int scale;
+  struct WakefieldViewport viewport;
+  /* The xdg_surface window geometry, empty if the client set none */
+  cairo_rectangle_int_t window_geometry;
 
   cairo_region_t *input_region;
   struct wl_list frame_callbacks;
+
+  gboolean fifo_barrier;
+  gboolean fifo_wait;
+  gint64 target_time;
+
+  /* The xdg_surface configure acked before this commit */
+  guint32 configure_serial;
 };
 
-struct _WakefieldSurface
+/* A commit that could not be applied yet, because it waits on the fifo
+   barrier or on its target presentation time */
+struct WakefieldSurfaceCommit
 {
-  GObject parent;
+  struct wl_list link;
 
+  struct WakefieldSurfacePendingState state;
+  struct WakefieldDamage damage;
+  struct wl_listener buffer_destroy_listener;
+  gint64 queued_time;
+};
+
+struct _WakefieldSurface
+{
   WakefieldCompositor *compositor;
   struct wl_resource *resource;
 
+  /* Emitted after each commit is applied; for destruction, listen on
+     the resource */
+  struct wl_signal commit_signal;
+
   WakefieldSurfaceRole role;
 
   struct WakefieldXdgSurface *xdg_surface;
   struct WakefieldXdgPopup *xdg_popup;
 
-  cairo_region_t *damage;
+  struct WakefieldDamage damage;
+  struct WakefieldDamage buffer_damage;
   struct WakefieldSurfacePendingState pending, current;
   gboolean mapped;
+
+  struct wl_list commit_queue;
+  /* Applied commits kept around, so that queueing the next one doesn't
+     allocate */
+  struct wl_list spare_commits;
+  /* The frame that presents the content which set the fifo barrier */
+  gint64 fifo_barrier_frame;
+  struct wl_resource *fifo;
+  struct wl_resource *commit_timer;
+  struct wl_resource *viewport;
+
+  /* Low latency mode: how long before the next paint we send the frame
+     callbacks, adapted to how much margin the client leaves us */
+  gint64 frame_callback_lead;
+  gboolean frame_callbacks_painted;
+  gboolean frame_callbacks_sent;
+  /* A paint went by after they went out, before the client replied */
+  gboolean frame_callbacks_missed;
+  gint64 reply_commit_time;
 };
 
 struct WakefieldXdgSurface
@@ -85,6 +127,33 @@ struct WakefieldXdgSurface
 
   struct wl_resource *resource;
   GdkWindow *window;
+
+  /* We only keep one unacked configure in flight, anything newer waits
+     for the ack and then goes out as a single configure */
+  guint32 configure_serial;
+  gboolean configure_acked;
+  gboolean configure_pending;
+  int configure_width;
+  int configure_height;
+  gboolean configure_activated;
+
+  /* The last configure the client committed a buffer for; while it lags
+     behind configure_serial a resize is in progress */
+  guint32 committed_serial;
+};
+
+/* A popup toplevel, realized and with its handlers connected. They are
+   kept in a pool once their popup goes away, as creating one costs an X
+   window and a round trip. */
+struct WakefieldPopupWindow
+{
+  GtkWidget *toplevel;
+  GtkWidget *drawing_area;
+  GdkScreen *screen;
+  GdkVisual *visual;
+
+  /* NULL while in the pool */
+  struct WakefieldXdgPopup *xdg_popup;
 };
 
 struct WakefieldXdgPopup
@@ -92,15 +161,21 @@ struct WakefieldXdgPopup
   WakefieldSurface *surface;
   WakefieldSurface *parent_surface;
 
-  GtkWidget *toplevel;
-  GtkWidget *drawing_area;
+  /* Set once it is placed, unless it is an overlay */
+  struct WakefieldPopupWindow *window;
   int x, y;
+  /* Popups that fit inside the compositor are drawn by it, above
+     their parent, at overlay_x, overlay_y in its coordinates */
+  gboolean placed;
+  gboolean overlay;
+  int overlay_x, overlay_y;
   guint32 serial;
 
   struct wl_resource *resource;
 };
 
-G_DEFINE_TYPE (WakefieldSurface, wakefield_surface, G_TYPE_OBJECT);
+static void place_xdg_popup (struct WakefieldXdgPopup *xdg_popup,
+                             int width, int height);
 
 struct wl_resource *
 wakefield_surface_get_xdg_surface  (struct wl_resource  *surface_resource)
@@ -165,20 +240,111 @@ wakefield_surface_get_window (struct wl_resource  *surface_resource)
 }
 
 static void
-wakefield_surface_get_current_size (WakefieldSurface *surface,
-                                    int *width, int *height)
+viewport_init (struct WakefieldViewport *viewport)
+{
+  viewport->src_x = viewport->src_y = wl_fixed_from_int (-1);
+  viewport->src_width = viewport->src_height = wl_fixed_from_int (-1);
+  viewport->dst_width = viewport->dst_height = -1;
+}
+
+/* The part of the buffer that is shown, in buffer coordinates divided
+   by the buffer scale */
+static void
+wakefield_surface_state_get_source (struct WakefieldSurfacePendingState *state,
+                                    double *x, double *y,
+                                    double *width, double *height)
 {
   struct wl_shm_buffer *shm_buffer;
 
+  *x = 0;
+  *y = 0;
   *width = 0;
   *height = 0;
 
-  shm_buffer = wl_shm_buffer_get (surface->current.buffer);
+  if (state->viewport.src_width != wl_fixed_from_int (-1))
+    {
+      *x = wl_fixed_to_double (state->viewport.src_x);
+      *y = wl_fixed_to_double (state->viewport.src_y);
+      *width = wl_fixed_to_double (state->viewport.src_width);
+      *height = wl_fixed_to_double (state->viewport.src_height);
+      return;
+    }
+
+  shm_buffer = wl_shm_buffer_get (state->buffer);
   if (shm_buffer)
     {
-      *width = wl_shm_buffer_get_width (shm_buffer) / surface->current.scale;
-      *height = wl_shm_buffer_get_height (shm_buffer) / surface->current.scale;
+      *width = wl_shm_buffer_get_width (shm_buffer) / state->scale;
+      *height = wl_shm_buffer_get_height (shm_buffer) / state->scale;
+    }
+}
+
+/* The size of the surface: the viewport destination if there is one,
+   else the size of what it shows of the buffer */
+static void
+wakefield_surface_state_get_size (struct WakefieldSurfacePendingState *state,
+                                  int *width, int *height)
+{
+  double src_x, src_y, src_width, src_height;
+
+  if (state->buffer == NULL || wl_shm_buffer_get (state->buffer) == NULL)
+    {
+      *width = 0;
+      *height = 0;
+      return;
+    }
+
+  if (state->viewport.dst_width != -1)
+    {
+      *width = state->viewport.dst_width;
+      *height = state->viewport.dst_height;
+      return;
     }
+
+  wakefield_surface_state_get_source (state, &src_x, &src_y, &src_width, &src_height);
+  *width = src_width;
+  *height = src_height;
+}
+
+static void
+wakefield_surface_get_current_size (WakefieldSurface *surface,
+                                    int *width, int *height)
+{
+  wakefield_surface_state_get_size (&surface->current, width, height);
+}
+
+/* The window proper, without the shadows the client draws around it;
+   the whole surface if it didn't tell us */
+static void
+wakefield_surface_state_get_geometry (struct WakefieldSurfacePendingState *state,
+                                      cairo_rectangle_int_t *geometry)
+{
+  cairo_rectangle_int_t bounds = { 0, 0, };
+
+  wakefield_surface_state_get_size (state, &bounds.width, &bounds.height);
+
+  if (state->window_geometry.width <= 0 ||
+      !gdk_rectangle_intersect (&bounds, &state->window_geometry, geometry))
+    *geometry = bounds;
+}
+
+/* Where the window geometry is in the surface, and its size. The
+   compositor shows the geometry at the origin of its allocation. */
+void
+wakefield_surface_get_window_geometry (struct wl_resource *surface_resource,
+                                       int *x, int *y,
+                                       int *width, int *height)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  cairo_rectangle_int_t geometry;
+
+  wakefield_surface_state_get_geometry (&surface->current, &geometry);
+
+  *x = geometry.x;
+  *y = geometry.y;
+  if (width)
+    *width = geometry.width;
+  if (height)
+    *height = geometry.height;
 }
 
 static cairo_format_t
@@ -204,15 +370,27 @@ get_time (void)
 }
 
 WakefieldCompositor *
-wakefield_surface_get_compositor (WakefieldSurface *surface)
+wakefield_surface_get_compositor (struct wl_resource *surface_resource)
 {
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+
   return surface->compositor;
 }
 
+void
+wakefield_surface_add_commit_listener (struct wl_resource *surface_resource,
+                                       struct wl_listener *listener)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  wl_signal_add (&surface->commit_signal, listener);
+}
+
 cairo_surface_t *
-wakefield_surface_create_cairo_surface (WakefieldSurface *surface,
+wakefield_surface_create_cairo_surface (struct wl_resource *surface_resource,
                                         int *width_out, int *height_out)
 {
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
   struct wl_shm_buffer *shm_buffer;
   cairo_surface_t *cr_surface = NULL;
 
@@ -259,6 +437,94 @@ wakefield_surface_create_cairo_surface (WakefieldSurface *surface,
   return cr_surface;
 }
 
+static void
+send_frame_callbacks (struct wl_list *frame_callbacks)
+{
+  struct wl_resource *cr, *next;
+  /* XXX: Should we use the frame clock for this? */
+  uint32_t time = get_time ();
+
+  wl_resource_for_each_safe (cr, next, frame_callbacks)
+    {
+      wl_callback_send_done (cr, time);
+      wl_resource_destroy (cr);
+    }
+
+  wl_list_init (frame_callbacks);
+}
+
+void
+wakefield_surface_send_frame_callbacks (struct wl_resource *surface_resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  if (wl_list_empty (&surface->current.frame_callbacks))
+    return;
+
+  /* A hung client doesn't get to draw; these go out when it answers */
+  if (wakefield_client_is_unresponsive (wl_resource_get_client (surface_resource)))
+    return;
+
+  send_frame_callbacks (&surface->current.frame_callbacks);
+
+  surface->frame_callbacks_painted = FALSE;
+  surface->frame_callbacks_sent = TRUE;
+  surface->frame_callbacks_missed = FALSE;
+  surface->reply_commit_time = 0;
+}
+
+/* Returns how long before the next paint the frame callbacks of this
+   surface should go out, or -1 if there is nothing to send yet */
+gint64
+wakefield_surface_get_frame_callback_lead (struct wl_resource *surface_resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  if (!surface->frame_callbacks_painted ||
+      wl_list_empty (&surface->current.frame_callbacks))
+    return -1;
+
+  return surface->frame_callback_lead;
+}
+
+#define FRAME_CALLBACK_SAFETY_MARGIN 2000 /* us */
+
+static void
+wakefield_surface_update_frame_callback_lead (WakefieldSurface *surface)
+{
+  gint64 refresh_interval = wakefield_compositor_get_refresh_interval (surface->compositor);
+  gint64 lead = surface->frame_callback_lead;
+
+  /* We also paint for other surfaces, and a client that is done drawing
+     never replies, so only a paint that shows the reply tells us
+     anything */
+  if (surface->reply_commit_time == 0)
+    {
+      if (surface->frame_callbacks_sent)
+        surface->frame_callbacks_missed = TRUE;
+      return;
+    }
+
+  if (surface->frame_callbacks_missed)
+    {
+      /* The reply missed a paint, give the client more time */
+      lead += refresh_interval / 8;
+    }
+  else
+    {
+      /* How early the reply to our frame callbacks made it to this paint;
+         anything above the safety margin is latency we can take away */
+      gint64 margin = g_get_monotonic_time () - surface->reply_commit_time;
+
+      if (margin > FRAME_CALLBACK_SAFETY_MARGIN)
+        lead -= (margin - FRAME_CALLBACK_SAFETY_MARGIN) / 8;
+    }
+
+  surface->reply_commit_time = 0;
+  surface->frame_callbacks_missed = FALSE;
+  surface->frame_callback_lead = CLAMP (lead, FRAME_CALLBACK_SAFETY_MARGIN, refresh_interval);
+}
+
 void
 wakefield_surface_draw (struct wl_resource *surface_resource,
                         cairo_t                 *cr)
@@ -280,30 +546,64 @@ wakefield_surface_draw (struct wl_resource *surface_resource,
                                                         wl_shm_buffer_get_stride (shm_buffer));
       cairo_surface_set_device_scale (cr_surface, surface->current.scale, surface->current.scale);
 
+      cairo_save (cr);
+
+      /* Shadows outside the window geometry are not worth compositing */
+      if (surface->xdg_surface)
+        {
+          cairo_rectangle_int_t geometry;
+
+          wakefield_surface_state_get_geometry (&surface->current, &geometry);
+          cairo_rectangle (cr, 0, 0, geometry.width, geometry.height);
+          cairo_clip (cr);
+          cairo_translate (cr, -geometry.x, -geometry.y);
+        }
+
+      /* A client that follows the preferred scale sizes its buffer to
+         the destination in device pixels, so this maps its pixels one
+         to one and cairo copies them without resampling */
+      if (surface->current.viewport.src_width != wl_fixed_from_int (-1) ||
+          surface->current.viewport.dst_width != -1)
+        {
+          double src_x, src_y, src_width, src_height;
+          int width, height;
+
+          wakefield_surface_state_get_source (&surface->current,
+                                              &src_x, &src_y, &src_width, &src_height);
+          wakefield_surface_state_get_size (&surface->current, &width, &height);
+
+          cairo_rectangle (cr, 0, 0, width, height);
+          cairo_clip (cr);
+          cairo_scale (cr, width / src_width, height / src_height);
+          cairo_translate (cr, -src_x, -src_y);
+        }
+
       cairo_set_source_surface (cr, cr_surface, 0, 0);
 
       /* XXX: Do scaling of our surface to match our allocation. */
       cairo_paint (cr);
 
+      cairo_restore (cr);
+
       cairo_surface_destroy (cr_surface);
 
       wl_shm_buffer_end_access (shm_buffer);
     }
 
-  /* Trigger frame callbacks. */
-  {
-    struct wl_resource *cr, *next;
-    /* XXX: Should we use the frame clock for this? */
-    uint32_t time = get_time ();
-
-    wl_resource_for_each_safe (cr, next, &surface->current.frame_callbacks)
-      {
-        wl_callback_send_done (cr, time);
-        wl_resource_destroy (cr);
-      }
+  if (wakefield_compositor_get_low_latency (surface->compositor))
+    {
+      wakefield_surface_update_frame_callback_lead (surface);
 
-    wl_list_init (&surface->current.frame_callbacks);
-  }
+      /* Hold the frame callbacks back until just before the next paint */
+      if (!wl_list_empty (&surface->current.frame_callbacks))
+        {
+          surface->frame_callbacks_painted = TRUE;
+          wakefield_compositor_schedule_frame_callbacks (surface->compositor,
+                                                         surface->frame_callback_lead);
+        }
+    }
+  else
+    wakefield_surface_send_frame_callbacks (surface_resource);
 }
 
 static void
@@ -313,12 +613,6 @@ wl_surface_destroy (struct wl_client *client,
   wl_resource_destroy (resource);
 }
 
-static void
-unbind_resource (struct wl_resource *resource)
-{
-  wl_list_remove (wl_resource_get_link (resource));
-}
-
 
 static void
 wl_surface_attach (struct wl_client *client,
@@ -332,6 +626,75 @@ wl_surface_attach (struct wl_client *client,
   surface->pending.buffer = buffer_resource;
 }
 
+static void
+damage_add_rectangle (struct WakefieldDamage *damage,
+                      const cairo_rectangle_int_t *rectangle)
+{
+  cairo_rectangle_int_t *last;
+  int i;
+
+  if (rectangle->width <= 0 || rectangle->height <= 0)
+    return;
+
+  for (i = 0; i < damage->n_rectangles; i++)
+    {
+      cairo_rectangle_int_t *existing = &damage->rectangles[i];
+
+      if (rectangle->x >= existing->x &&
+          rectangle->y >= existing->y &&
+          rectangle->x + rectangle->width <= existing->x + existing->width &&
+          rectangle->y + rectangle->height <= existing->y + existing->height)
+        return;
+    }
+
+  if (damage->n_rectangles < DAMAGE_MAX_RECTANGLES)
+    {
+      damage->rectangles[damage->n_rectangles++] = *rectangle;
+      return;
+    }
+
+  last = &damage->rectangles[DAMAGE_MAX_RECTANGLES - 1];
+  gdk_rectangle_union (last, rectangle, last);
+}
+
+static void
+damage_add (struct WakefieldDamage *damage,
+            const struct WakefieldDamage *other)
+{
+  int i;
+
+  for (i = 0; i < other->n_rectangles; i++)
+    damage_add_rectangle (damage, &other->rectangles[i]);
+}
+
+static void
+damage_clear (struct WakefieldDamage *damage)
+{
+  damage->n_rectangles = 0;
+}
+
+/* Queues a redraw of the damage, offset by x, y, in widget */
+static void
+damage_queue_draw (const struct WakefieldDamage *damage,
+                   GtkWidget *widget,
+                   int x, int y)
+{
+  int i;
+
+  /* GTK would drop it anyway, but only after making a region of it */
+  if (!gtk_widget_is_drawable (widget))
+    return;
+
+  for (i = 0; i < damage->n_rectangles; i++)
+    {
+      const cairo_rectangle_int_t *rectangle = &damage->rectangles[i];
+
+      gtk_widget_queue_draw_area (widget,
+                                  rectangle->x + x, rectangle->y + y,
+                                  rectangle->width, rectangle->height);
+    }
+}
+
 static void
 wl_surface_damage (struct wl_client *client,
                    struct wl_resource *surface_resource,
@@ -339,21 +702,87 @@ wl_surface_damage (struct wl_client *client,
 {
   WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
   cairo_rectangle_int_t rectangle = { x, y, width, height };
-  cairo_region_union_rectangle (surface->damage, &rectangle);
+  damage_add_rectangle (&surface->damage, &rectangle);
+}
+
+static void
+wl_surface_damage_buffer (struct wl_client *client,
+                          struct wl_resource *surface_resource,
+                          int32_t x, int32_t y, int32_t width, int32_t height)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  cairo_rectangle_int_t rectangle = { x, y, width, height };
+  damage_add_rectangle (&surface->buffer_damage, &rectangle);
+}
+
+/* Buffer damage only turns into surface damage once the scale and the
+   viewport of the commit are known */
+static void
+wakefield_surface_flush_buffer_damage (WakefieldSurface *surface)
+{
+  struct WakefieldSurfacePendingState *state = &surface->pending;
+  int i, n;
+
+  if (surface->buffer_damage.n_rectangles == 0)
+    return;
+
+  if (state->viewport.src_width != wl_fixed_from_int (-1) ||
+      state->viewport.dst_width != -1)
+    {
+      struct WakefieldSurfacePendingState size_state = *state;
+      cairo_rectangle_int_t rectangle = { 0, 0, };
+
+      /* Not worth mapping through the viewport, just take it all */
+      if (size_state.buffer == NULL)
+        size_state.buffer = surface->current.buffer;
+      wakefield_surface_state_get_size (&size_state, &rectangle.width, &rectangle.height);
+      damage_add_rectangle (&surface->damage, &rectangle);
+    }
+  else
+    {
+      n = surface->buffer_damage.n_rectangles;
+      for (i = 0; i < n; i++)
+        {
+          cairo_rectangle_int_t rectangle = surface->buffer_damage.rectangles[i];
+          int x2, y2;
+
+          x2 = (rectangle.x + rectangle.width + state->scale - 1) / state->scale;
+          y2 = (rectangle.y + rectangle.height + state->scale - 1) / state->scale;
+          rectangle.x /= state->scale;
+          rectangle.y /= state->scale;
+          rectangle.width = x2 - rectangle.x;
+          rectangle.height = y2 - rectangle.y;
+          damage_add_rectangle (&surface->damage, &rectangle);
+        }
+    }
+
+  damage_clear (&surface->buffer_damage);
 }
 
 #define WL_CALLBACK_VERSION 1
 
+static void
+frame_callback_destructor (struct wl_resource *resource)
+{
+  wl_list_remove (wl_resource_get_link (resource));
+  wakefield_client_release (wl_resource_get_client (resource),
+                            WAKEFIELD_CLIENT_RESOURCE_FRAME_CALLBACKS, 1);
+}
+
 static void
 wl_surface_frame (struct wl_client *client,
                   struct wl_resource *surface_resource,
                   uint32_t callback_id)
 {
   WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct wl_resource *callback;
 
-  struct wl_resource *callback = wl_resource_create (client, &wl_callback_interface,
-                                                     WL_CALLBACK_VERSION, callback_id);
-  wl_resource_set_destructor (callback, unbind_resource);
+  if (!wakefield_client_charge (client, WAKEFIELD_CLIENT_RESOURCE_FRAME_CALLBACKS, 1))
+    return;
+
+  callback = wl_resource_create (client, &wl_callback_interface,
+                                 WL_CALLBACK_VERSION, callback_id);
+  wl_resource_set_destructor (callback, frame_callback_destructor);
   wl_list_insert (&surface->pending.frame_callbacks, wl_resource_get_link (callback));
 }
 
@@ -379,56 +808,66 @@ wl_surface_set_input_region (struct wl_client *client,
 }
 
 static void
-wl_surface_commit (struct wl_client *client,
-                   struct wl_resource *resource)
+wakefield_surface_apply_state (WakefieldSurface *surface,
+                               struct WakefieldSurfacePendingState *state,
+                               struct WakefieldDamage *damage,
+                               gint64 presented_frame)
 {
-  WakefieldSurface *surface = wl_resource_get_user_data (resource);
-  struct wl_shm_buffer *shm_buffer;
-  cairo_region_t *clear_region = NULL;
-  cairo_rectangle_int_t rect = { 0, };
-  int new_width = 0, new_height = 0;
-
-  if (surface->current.buffer)
-    {
-      shm_buffer = wl_shm_buffer_get (surface->current.buffer);
-      if (shm_buffer)
-        {
-          rect.width = wl_shm_buffer_get_width (shm_buffer) / surface->current.scale;
-          rect.height = wl_shm_buffer_get_height (shm_buffer) / surface->current.scale;
+  cairo_rectangle_int_t old_geometry, geometry;
+  int old_width, old_height, new_width, new_height;
 
-          clear_region = cairo_region_create_rectangle (&rect);
-        }
-      wl_buffer_send_release (surface->current.buffer);
-    }
+  wakefield_surface_get_current_size (surface, &old_width, &old_height);
+  wakefield_surface_state_get_geometry (&surface->current, &old_geometry);
 
-  if (surface->pending.buffer)
+  /* Committing without an attach, or attaching the same buffer again,
+     keeps using the current one */
+  if (state->buffer && state->buffer != surface->current.buffer)
     {
-      shm_buffer = wl_shm_buffer_get (surface->pending.buffer);
-      new_width = wl_shm_buffer_get_width (shm_buffer) / surface->pending.scale;
-      new_height = wl_shm_buffer_get_height (shm_buffer) / surface->pending.scale;
-      if (clear_region && shm_buffer)
-        {
-          rect.width = new_width;
-          rect.height = new_height;
-
-          cairo_region_subtract_rectangle (clear_region, &rect);
-        }
-      surface->current.buffer = surface->pending.buffer;
+      if (surface->current.buffer)
+        wl_buffer_send_release (surface->current.buffer);
+      surface->current.buffer = state->buffer;
     }
 
   /* XXX: Should we reallocate / redraw the entire region if the buffer
    * scale changes? */
-  if (surface->pending.scale > 0)
-    surface->current.scale = surface->pending.scale;
+  if (state->scale > 0)
+    surface->current.scale = state->scale;
+
+  surface->current.viewport = state->viewport;
+  surface->current.window_geometry = state->window_geometry;
+
+  wakefield_surface_get_current_size (surface, &new_width, &new_height);
+  wakefield_surface_state_get_geometry (&surface->current, &geometry);
 
   wl_list_insert_list (&surface->current.frame_callbacks,
-                       &surface->pending.frame_callbacks);
-  wl_list_init (&surface->pending.frame_callbacks);
+                       &state->frame_callbacks);
+  wl_list_init (&state->frame_callbacks);
+
+  if (surface->frame_callbacks_sent)
+    {
+      surface->reply_commit_time = g_get_monotonic_time ();
+      surface->frame_callbacks_sent = FALSE;
+    }
+
+  if (state->configure_serial != 0 && surface->xdg_surface)
+    surface->xdg_surface->committed_serial = state->configure_serial;
 
-  if (clear_region)
+  /* Content that is never going to be presented doesn't hold back
+     later commits */
+  if (state->fifo_barrier && presented_frame != G_MAXINT64)
+    surface->fifo_barrier_frame = presented_frame;
+
+  /* Whatever the old content covered outside of the new one, as the
+     strips to the right of and below it */
+  if (old_width > new_width)
+    {
+      cairo_rectangle_int_t right = { new_width, 0, old_width - new_width, old_height };
+      damage_add_rectangle (damage, &right);
+    }
+  if (old_height > new_height)
     {
-      cairo_region_union (surface->damage, clear_region);
-      cairo_region_destroy (clear_region);
+      cairo_rectangle_int_t below = { 0, new_height, MIN (old_width, new_width), old_height - new_height };
+      damage_add_rectangle (damage, &below);
     }
 
   /* process damage */
@@ -439,47 +878,73 @@ wl_surface_commit (struct wl_client *client,
 
       gtk_widget_get_allocation (GTK_WIDGET (surface->compositor), &allocation);
 
-      cairo_region_translate (surface->damage, allocation.x, allocation.y);
-      gtk_widget_queue_draw_region (GTK_WIDGET (surface->compositor), surface->damage);
+      /* Moving the geometry moves everything we show */
+      if (geometry.x != old_geometry.x || geometry.y != old_geometry.y)
+        gtk_widget_queue_draw (GTK_WIDGET (surface->compositor));
+
+      damage_queue_draw (damage, GTK_WIDGET (surface->compositor),
+                         allocation.x - geometry.x,
+                         allocation.y - geometry.y);
 
       if (surface->xdg_surface->window)
         gdk_window_resize (surface->xdg_surface->window,
-                           new_width,
-                           new_height);
+                           geometry.width,
+                           geometry.height);
     }
   else if (surface->xdg_popup && new_width > 0 && new_height > 0)
     {
       struct WakefieldXdgPopup *xdg_popup = surface->xdg_popup;
       gint root_x, root_y;
 
-      gtk_widget_set_size_request (GTK_WIDGET (xdg_popup->drawing_area), new_width, new_height);
-      gtk_window_resize (GTK_WINDOW (xdg_popup->toplevel), new_width, new_height);
+      if (!xdg_popup->placed)
+        place_xdg_popup (xdg_popup, new_width, new_height);
 
-      if (!surface->mapped)
+      if (xdg_popup->overlay)
         {
-          GdkWindow *parent_window = wakefield_surface_get_window (xdg_popup->parent_surface->resource);
+          GtkAllocation allocation;
 
-          gdk_window_get_root_coords (parent_window, 0, 0, &root_x, &root_y);
+          gtk_widget_get_allocation (GTK_WIDGET (surface->compositor), &allocation);
 
-          gtk_window_move (GTK_WINDOW (xdg_popup->toplevel),
-                           root_x + xdg_popup->x, root_y + xdg_popup->y);
-          gtk_widget_show (xdg_popup->toplevel);
+          damage_queue_draw (damage, GTK_WIDGET (surface->compositor),
+                             allocation.x + xdg_popup->overlay_x,
+                             allocation.y + xdg_popup->overlay_y);
+        }
+      else
+        {
+          gtk_widget_set_size_request (GTK_WIDGET (xdg_popup->window->drawing_area), new_width, new_height);
+          gtk_window_resize (GTK_WINDOW (xdg_popup->window->toplevel), new_width, new_height);
+
+          if (!surface->mapped)
+            {
+              GdkWindow *parent_window = wakefield_surface_get_window (xdg_popup->parent_surface->resource);
+              int geometry_x, geometry_y;
+
+              /* The parent window starts at its window geometry */
+              wakefield_surface_get_window_geometry (xdg_popup->parent_surface->resource,
+                                                     &geometry_x, &geometry_y, NULL, NULL);
+              gdk_window_get_root_coords (parent_window, -geometry_x, -geometry_y,
+                                          &root_x, &root_y);
+
+              gtk_window_move (GTK_WINDOW (xdg_popup->window->toplevel),
+                               root_x + xdg_popup->x, root_y + xdg_popup->y);
+              gtk_widget_show (xdg_popup->window->toplevel);
+            }
+
+          damage_queue_draw (damage, GTK_WIDGET (xdg_popup->window->drawing_area), 0, 0);
         }
-
-      gtk_widget_queue_draw_region (GTK_WIDGET (xdg_popup->drawing_area), surface->damage);
     }
 
   /* ... and then empty it */
-  {
-    cairo_rectangle_int_t nothing = { 0, 0, 0, 0 };
-    cairo_region_intersect_rectangle (surface->damage, &nothing);
-  }
+  damage_clear (damage);
 
   /* XXX: Stop leak when we start using the input region. */
-  surface->pending.input_region = NULL;
+  state->input_region = NULL;
 
-  surface->pending.buffer = NULL;
-  surface->pending.scale = 1;
+  state->buffer = NULL;
+  state->fifo_barrier = FALSE;
+  state->fifo_wait = FALSE;
+  state->target_time = 0;
+  state->configure_serial = 0;
 
   if (!surface->mapped)
     {
@@ -487,103 +952,712 @@ wl_surface_commit (struct wl_client *client,
       wakefield_compositor_surface_mapped (surface->compositor, surface->resource);
     }
 
-  g_signal_emit (surface, signals[COMMITTED], 0);
+  wl_signal_emit (&surface->commit_signal, surface->resource);
+}
+
+/* During a resize we keep showing the last frame that matched a
+   configure, and hold back buffers of any other size until the client
+   catches up with the latest configure or RESIZE_TIMEOUT passes */
+#define RESIZE_TIMEOUT (G_USEC_PER_SEC / 5)
+
+static gboolean
+wakefield_surface_state_is_stale (WakefieldSurface *surface,
+                                  struct WakefieldSurfacePendingState *state)
+{
+  struct WakefieldXdgSurface *xdg_surface = surface->xdg_surface;
+  cairo_rectangle_int_t geometry;
+
+  if (xdg_surface == NULL || state->buffer == NULL ||
+      surface->current.buffer == NULL)
+    return FALSE;
+
+  /* Once the latest configure is acked the client picks its own size */
+  if (xdg_surface->committed_serial == xdg_surface->configure_serial ||
+      state->configure_serial == xdg_surface->configure_serial)
+    return FALSE;
+
+  /* The configured size is that of the window geometry */
+  wakefield_surface_state_get_geometry (state, &geometry);
+  if (geometry.width == 0)
+    return FALSE;
+
+  return geometry.width != xdg_surface->configure_width ||
+         geometry.height != xdg_surface->configure_height;
+}
+
+static gboolean
+wakefield_surface_state_is_ready (WakefieldSurface *surface,
+                                  struct WakefieldSurfacePendingState *state,
+                                  gint64 queued_time,
+                                  gint64 presented_frame,
+                                  gint64 presentation_time)
+{
+  /* The barrier is cleared once the frame showing its content is done */
+  if (state->fifo_wait && surface->fifo_barrier_frame >= presented_frame)
+    return FALSE;
+
+  if (state->target_time > presentation_time)
+    return FALSE;
+
+  if (presentation_time - queued_time < RESIZE_TIMEOUT &&
+      wakefield_surface_state_is_stale (surface, state))
+    return FALSE;
+
+  return TRUE;
 }
 
 static void
-wl_surface_set_buffer_transform (struct wl_client *client,
-                                 struct wl_resource *resource,
-                                 int32_t transform)
+queued_buffer_destroyed (struct wl_listener *listener,
+                         void *data)
 {
-  /* TODO */
+  struct WakefieldSurfaceCommit *commit =
+    wl_container_of (listener, commit, buffer_destroy_listener);
+
+  wl_list_remove (&commit->buffer_destroy_listener.link);
+  commit->state.buffer = NULL;
 }
 
 static void
-wl_surface_set_buffer_scale (struct wl_client *client,
-                             struct wl_resource *resource,
-                             int32_t scale)
+destroy_pending_state (struct WakefieldSurfacePendingState *state);
+
+static void
+wakefield_surface_commit_free (struct WakefieldSurfaceCommit *commit)
 {
-  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+  if (commit->state.buffer)
+    wl_list_remove (&commit->buffer_destroy_listener.link);
+
+  destroy_pending_state (&commit->state);
+  g_slice_free (struct WakefieldSurfaceCommit, commit);
+}
+
+/* Done with a commit that left the queue; the next one reuses it */
+static void
+wakefield_surface_recycle_commit (WakefieldSurface *surface,
+                                  struct WakefieldSurfaceCommit *commit)
+{
+  if (commit->state.buffer)
+    wl_list_remove (&commit->buffer_destroy_listener.link);
+
+  destroy_pending_state (&commit->state);
+  commit->state.buffer = NULL;
+  damage_clear (&commit->damage);
+
+  wl_list_insert (&surface->spare_commits, &commit->link);
+}
+
+static void
+wakefield_surface_queue_commit (WakefieldSurface *surface)
+{
+  struct WakefieldSurfaceCommit *commit;
+
+  if (wl_list_empty (&surface->spare_commits))
+    commit = g_slice_new0 (struct WakefieldSurfaceCommit);
+  else
+    {
+      commit = wl_container_of (surface->spare_commits.next, commit, link);
+      wl_list_remove (&commit->link);
+    }
+
+  commit->state = surface->pending;
+  wl_list_init (&commit->state.frame_callbacks);
+  wl_list_insert_list (&commit->state.frame_callbacks,
+                       &surface->pending.frame_callbacks);
+  wl_list_init (&surface->pending.frame_callbacks);
+
+  if (commit->state.buffer)
+    {
+      commit->buffer_destroy_listener.notify = queued_buffer_destroyed;
+      wl_resource_add_destroy_listener (commit->state.buffer,
+                                        &commit->buffer_destroy_listener);
+    }
+
+  commit->damage = surface->damage;
+  damage_clear (&surface->damage);
+  commit->queued_time = g_get_monotonic_time ();
+
+  surface->pending.input_region = NULL;
+  surface->pending.buffer = NULL;
+  surface->pending.fifo_barrier = FALSE;
+  surface->pending.fifo_wait = FALSE;
+  surface->pending.target_time = 0;
+  surface->pending.configure_serial = 0;
+
+  wl_list_insert (surface->commit_queue.prev, &commit->link);
+}
+
+/* A newer commit superseded a frame held back for a resize, so that one
+   is never shown; only its side effects carry over */
+static void
+wakefield_surface_drop_commit (WakefieldSurface *surface,
+                               struct WakefieldSurfaceCommit *commit,
+                               struct WakefieldSurfaceCommit *next)
+{
+  wl_list_remove (&commit->link);
+
+  if (commit->state.buffer)
+    {
+      wl_list_remove (&commit->buffer_destroy_listener.link);
+      wl_buffer_send_release (commit->state.buffer);
+      commit->state.buffer = NULL;
+    }
+
+  next->state.fifo_barrier |= commit->state.fifo_barrier;
+  if (next->state.configure_serial == 0)
+    next->state.configure_serial = commit->state.configure_serial;
+  damage_add (&next->damage, &commit->damage);
+
+  /* Its frame callbacks get done along with the frame that replaces it */
+  wl_list_insert_list (&next->state.frame_callbacks,
+                       &commit->state.frame_callbacks);
+  wl_list_init (&commit->state.frame_callbacks);
+
+  wakefield_surface_recycle_commit (surface, commit);
+}
+
+/* Applies queued commits in order, until one that still has to wait.
+   Returns TRUE if there are commits left in the queue. */
+gboolean
+wakefield_surface_process_commit_queue (struct wl_resource *surface_resource,
+                                        gint64 presented_frame,
+                                        gint64 presentation_time)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+  struct WakefieldSurfaceCommit *commit, *next;
+
+  wl_list_for_each_safe (commit, next, &surface->commit_queue, link)
+    {
+      if (!wakefield_surface_state_is_ready (surface, &commit->state,
+                                             commit->queued_time,
+                                             presented_frame, presentation_time))
+        {
+          if (&next->link != &surface->commit_queue &&
+              wakefield_surface_state_is_stale (surface, &commit->state))
+            {
+              wakefield_surface_drop_commit (surface, commit, next);
+              continue;
+            }
+
+          /* A frame held back for a resize may never be shown, but the
+             client shouldn't stop drawing because of that. It still
+             only gets to draw once per frame. */
+          if (wakefield_surface_state_is_stale (surface, &commit->state))
+            send_frame_callbacks (&commit->state.frame_callbacks);
+
+          break;
+        }
+
+      wl_list_remove (&commit->link);
+      if (commit->state.buffer)
+        wl_list_remove (&commit->buffer_destroy_listener.link);
+
+      wakefield_surface_apply_state (surface, &commit->state, &commit->damage,
+                                     presented_frame);
+      wakefield_surface_recycle_commit (surface, commit);
+    }
+
+  return !wl_list_empty (&surface->commit_queue);
+}
+
+static gboolean
+wakefield_surface_check_viewport (WakefieldSurface *surface)
+{
+  struct WakefieldSurfacePendingState *state = &surface->pending;
+  struct wl_resource *buffer = state->buffer ? state->buffer : surface->current.buffer;
+  struct wl_shm_buffer *shm_buffer;
+  double src_x, src_y, src_width, src_height;
+
+  if (surface->viewport == NULL ||
+      state->viewport.src_width == wl_fixed_from_int (-1))
+    return TRUE;
+
+  if (state->viewport.dst_width == -1 &&
+      (wl_fixed_to_int (state->viewport.src_width) * 256 != state->viewport.src_width ||
+       wl_fixed_to_int (state->viewport.src_height) * 256 != state->viewport.src_height))
+    {
+      wl_resource_post_error (surface->viewport, WP_VIEWPORT_ERROR_BAD_SIZE,
+                              "wp_viewport: source size is not integer and there is no destination size");
+      return FALSE;
+    }
+
+  shm_buffer = wl_shm_buffer_get (buffer);
+  if (shm_buffer == NULL)
+    return TRUE;
+
+  src_x = wl_fixed_to_double (state->viewport.src_x);
+  src_y = wl_fixed_to_double (state->viewport.src_y);
+  src_width = wl_fixed_to_double (state->viewport.src_width);
+  src_height = wl_fixed_to_double (state->viewport.src_height);
+
+  if (src_x + src_width > (double) wl_shm_buffer_get_width (shm_buffer) / state->scale ||
+      src_y + src_height > (double) wl_shm_buffer_get_height (shm_buffer) / state->scale)
+    {
+      wl_resource_post_error (surface->viewport, WP_VIEWPORT_ERROR_OUT_OF_BUFFER,
+                              "wp_viewport: source rectangle extends outside of the buffer");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+wl_surface_commit (struct wl_client *client,
+                   struct wl_resource *resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+  gint64 presented_frame, presentation_time;
+
+  if (!wakefield_surface_check_viewport (surface))
+    return;
+
+  wakefield_surface_flush_buffer_damage (surface);
+
+  wakefield_compositor_get_frame_timings (surface->compositor,
+                                          &presented_frame,
+                                          &presentation_time);
+
+  if (wl_list_empty (&surface->commit_queue) &&
+      wakefield_surface_state_is_ready (surface, &surface->pending,
+                                        g_get_monotonic_time (),
+                                        presented_frame, presentation_time))
+    {
+      wakefield_surface_apply_state (surface, &surface->pending, &surface->damage,
+                                     presented_frame);
+      return;
+    }
+
+  wakefield_surface_queue_commit (surface);
+  wakefield_compositor_schedule_commit_queue (surface->compositor);
+}
+
+static void
+wl_surface_set_buffer_transform (struct wl_client *client,
+                                 struct wl_resource *resource,
+                                 int32_t transform)
+{
+  /* TODO */
+}
+
+static void
+wl_surface_set_buffer_scale (struct wl_client *client,
+                             struct wl_resource *resource,
+                             int32_t scale)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+
+  /* We divide by it all over the place */
+  if (scale < 1)
+    {
+      wl_resource_post_error (resource, WL_SURFACE_ERROR_INVALID_SCALE,
+                              "wl_surface: buffer scale %d is not positive", scale);
+      return;
+    }
+
   surface->pending.scale = scale;
 }
 
 static void
-destroy_pending_state (struct WakefieldSurfacePendingState *state)
+wl_surface_offset (struct wl_client *client,
+                   struct wl_resource *resource,
+                   int32_t x,
+                   int32_t y)
+{
+  /* Like the attach dx/dy, ignore this in our case */
+}
+
+static void
+destroy_pending_state (struct WakefieldSurfacePendingState *state)
+{
+  struct wl_resource *cr, *next;
+  wl_resource_for_each_safe (cr, next, &state->frame_callbacks)
+    wl_resource_destroy (cr);
+  g_clear_pointer (&state->input_region, cairo_region_destroy);
+}
+
+/* This needs to be called both from wl_surface and xdg_[surface|popup] finalizer,
+   because destructors are called in random order during client disconnect */
+static void
+wl_surface_unmap (WakefieldSurface *surface)
+{
+  if (surface->mapped)
+    {
+      surface->mapped = FALSE;
+      wakefield_compositor_surface_unmapped (surface->compositor, surface->resource);
+    }
+}
+
+
+static void
+wl_surface_finalize (struct wl_resource *resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+  struct WakefieldSurfaceCommit *commit, *next;
+
+  wl_surface_unmap (surface);
+
+  wl_list_for_each_safe (commit, next, &surface->commit_queue, link)
+    wakefield_surface_commit_free (commit);
+  wl_list_for_each_safe (commit, next, &surface->spare_commits, link)
+    wakefield_surface_commit_free (commit);
+
+  if (surface->fifo)
+    wl_resource_set_user_data (surface->fifo, NULL);
+
+  if (surface->commit_timer)
+    wl_resource_set_user_data (surface->commit_timer, NULL);
+
+  if (surface->viewport)
+    wl_resource_set_user_data (surface->viewport, NULL);
+
+  if (surface->xdg_surface)
+    surface->xdg_surface->surface = NULL;
+
+  if (surface->xdg_popup)
+    surface->xdg_popup->surface = NULL;
+
+  wl_list_remove (wl_resource_get_link (resource));
+
+  destroy_pending_state (&surface->pending);
+  destroy_pending_state (&surface->current);
+
+  wakefield_client_release (wl_resource_get_client (resource),
+                            WAKEFIELD_CLIENT_RESOURCE_SURFACES, 1);
+
+  g_slice_free (WakefieldSurface, surface);
+}
+
+static const struct wl_surface_interface surface_implementation = {
+  wl_surface_destroy,
+  wl_surface_attach,
+  wl_surface_damage,
+  wl_surface_frame,
+  wl_surface_set_opaque_region,
+  wl_surface_set_input_region,
+  wl_surface_commit,
+  wl_surface_set_buffer_transform,
+  wl_surface_set_buffer_scale,
+  wl_surface_damage_buffer,
+  wl_surface_offset
+};
+
+struct wl_resource *
+wakefield_surface_new (WakefieldCompositor *compositor,
+                       struct wl_client *client,
+                       struct wl_resource *compositor_resource,
+                       uint32_t id)
+{
+  WakefieldSurface *surface;
+
+  surface = g_slice_new0 (WakefieldSurface);
+  surface->compositor = compositor;
+
+  surface->resource = wl_resource_create (client, &wl_surface_interface, wl_resource_get_version (compositor_resource), id);
+  wl_resource_set_implementation (surface->resource, &surface_implementation, surface, wl_surface_finalize);
+
+  wl_list_init (&surface->pending.frame_callbacks);
+  wl_list_init (&surface->current.frame_callbacks);
+  wl_list_init (&surface->commit_queue);
+  wl_list_init (&surface->spare_commits);
+  wl_signal_init (&surface->commit_signal);
+
+  surface->current.scale = 1;
+  surface->pending.scale = 1;
+  viewport_init (&surface->current.viewport);
+  viewport_init (&surface->pending.viewport);
+  surface->fifo_barrier_frame = -1;
+  surface->frame_callback_lead = G_USEC_PER_SEC / 120;
+
+  /* We never rotate anything, so this is all clients get */
+  if (wl_resource_get_version (surface->resource) >= WL_SURFACE_PREFERRED_BUFFER_TRANSFORM_SINCE_VERSION)
+    wl_surface_send_preferred_buffer_transform (surface->resource, WL_OUTPUT_TRANSFORM_NORMAL);
+
+  wakefield_surface_send_preferred_scale (surface->resource,
+                                          wakefield_compositor_get_preferred_scale (compositor));
+
+  return surface->resource;
+}
+
+/* Tells the client the buffer scale to render at */
+void
+wakefield_surface_send_preferred_scale (struct wl_resource *surface_resource,
+                                        int                 scale)
+{
+  if (wl_resource_get_version (surface_resource) >= WL_SURFACE_PREFERRED_BUFFER_SCALE_SINCE_VERSION)
+    wl_surface_send_preferred_buffer_scale (surface_resource, scale);
+}
+
+struct wl_resource *
+wakefield_surface_get_fifo (struct wl_resource *surface_resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  return surface->fifo;
+}
+
+struct wl_resource *
+wakefield_surface_get_commit_timer (struct wl_resource *surface_resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  return surface->commit_timer;
+}
+
+struct wl_resource *
+wakefield_surface_get_viewport (struct wl_resource *surface_resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  return surface->viewport;
+}
+
+static void
+fifo_set_barrier (struct wl_client *client,
+                  struct wl_resource *resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+
+  if (surface == NULL)
+    {
+      wl_resource_post_error (resource, WP_FIFO_V1_ERROR_SURFACE_DESTROYED,
+                              "wp_fifo_v1: the wl_surface was destroyed");
+      return;
+    }
+
+  surface->pending.fifo_barrier = TRUE;
+}
+
+static void
+fifo_wait_barrier (struct wl_client *client,
+                   struct wl_resource *resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+
+  if (surface == NULL)
+    {
+      wl_resource_post_error (resource, WP_FIFO_V1_ERROR_SURFACE_DESTROYED,
+                              "wp_fifo_v1: the wl_surface was destroyed");
+      return;
+    }
+
+  surface->pending.fifo_wait = TRUE;
+}
+
+static void
+fifo_destroy (struct wl_client *client,
+              struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static const struct wp_fifo_v1_interface fifo_implementation = {
+  fifo_set_barrier,
+  fifo_wait_barrier,
+  fifo_destroy
+};
+
+static void
+fifo_finalize (struct wl_resource *resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+
+  if (surface)
+    surface->fifo = NULL;
+}
+
+struct wl_resource *
+wakefield_fifo_new (struct wl_client   *client,
+                    struct wl_resource *manager_resource,
+                    uint32_t            id,
+                    struct wl_resource *surface_resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  surface->fifo = wl_resource_create (client, &wp_fifo_v1_interface,
+                                      wl_resource_get_version (manager_resource), id);
+  wl_resource_set_implementation (surface->fifo, &fifo_implementation,
+                                  surface, fifo_finalize);
+
+  return surface->fifo;
+}
+
+static void
+commit_timer_set_timestamp (struct wl_client *client,
+                            struct wl_resource *resource,
+                            uint32_t tv_sec_hi,
+                            uint32_t tv_sec_lo,
+                            uint32_t tv_nsec)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+  guint64 tv_sec = ((guint64) tv_sec_hi << 32) | tv_sec_lo;
+
+  if (surface == NULL)
+    {
+      wl_resource_post_error (resource, WP_COMMIT_TIMER_V1_ERROR_SURFACE_DESTROYED,
+                              "wp_commit_timer_v1: the wl_surface was destroyed");
+      return;
+    }
+
+  if (tv_nsec >= 1000000000)
+    {
+      wl_resource_post_error (resource, WP_COMMIT_TIMER_V1_ERROR_INVALID_TIMESTAMP,
+                              "wp_commit_timer_v1: tv_nsec out of range");
+      return;
+    }
+
+  if (surface->pending.target_time != 0)
+    {
+      wl_resource_post_error (resource, WP_COMMIT_TIMER_V1_ERROR_TIMESTAMP_EXISTS,
+                              "wp_commit_timer_v1: timestamp already set for this commit");
+      return;
+    }
+
+  /* Both this and the frame clock are in CLOCK_MONOTONIC */
+  surface->pending.target_time = tv_sec * G_USEC_PER_SEC + tv_nsec / 1000;
+}
+
+static void
+commit_timer_destroy (struct wl_client *client,
+                      struct wl_resource *resource)
+{
+  wl_resource_destroy (resource);
+}
+
+static const struct wp_commit_timer_v1_interface commit_timer_implementation = {
+  commit_timer_set_timestamp,
+  commit_timer_destroy
+};
+
+static void
+commit_timer_finalize (struct wl_resource *resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+
+  if (surface)
+    surface->commit_timer = NULL;
+}
+
+struct wl_resource *
+wakefield_commit_timer_new (struct wl_client   *client,
+                            struct wl_resource *manager_resource,
+                            uint32_t            id,
+                            struct wl_resource *surface_resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
+
+  surface->commit_timer = wl_resource_create (client, &wp_commit_timer_v1_interface,
+                                              wl_resource_get_version (manager_resource), id);
+  wl_resource_set_implementation (surface->commit_timer, &commit_timer_implementation,
+                                  surface, commit_timer_finalize);
+
+  return surface->commit_timer;
+}
+
+static void
+viewport_destroy (struct wl_client *client,
+                  struct wl_resource *resource)
 {
-  struct wl_resource *cr, *next;
-  wl_resource_for_each_safe (cr, next, &state->frame_callbacks)
-    wl_resource_destroy (cr);
-  g_clear_pointer (&state->input_region, cairo_region_destroy);
+  wl_resource_destroy (resource);
 }
 
-/* This needs to be called both from wl_surface and xdg_[surface|popup] finalizer,
-   because destructors are called in random order during client disconnect */
 static void
-wl_surface_unmap (WakefieldSurface *surface)
+viewport_set_source (struct wl_client *client,
+                     struct wl_resource *resource,
+                     wl_fixed_t x,
+                     wl_fixed_t y,
+                     wl_fixed_t width,
+                     wl_fixed_t height)
 {
-  if (surface->mapped)
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+  struct WakefieldViewport *viewport;
+
+  if (surface == NULL)
     {
-      surface->mapped = FALSE;
-      wakefield_compositor_surface_unmapped (surface->compositor, surface->resource);
+      wl_resource_post_error (resource, WP_VIEWPORT_ERROR_NO_SURFACE,
+                              "wp_viewport: the wl_surface was destroyed");
+      return;
     }
-}
 
+  viewport = &surface->pending.viewport;
 
-static void
-wl_surface_finalize (struct wl_resource *resource)
-{
-  WakefieldSurface *surface = wl_resource_get_user_data (resource);
+  if (x == wl_fixed_from_int (-1) && y == wl_fixed_from_int (-1) &&
+      width == wl_fixed_from_int (-1) && height == wl_fixed_from_int (-1))
+    {
+      viewport->src_x = viewport->src_y = wl_fixed_from_int (-1);
+      viewport->src_width = viewport->src_height = wl_fixed_from_int (-1);
+      return;
+    }
 
-  wl_surface_unmap (surface);
+  if (x < 0 || y < 0 || width <= 0 || height <= 0)
+    {
+      wl_resource_post_error (resource, WP_VIEWPORT_ERROR_BAD_VALUE,
+                              "wp_viewport: invalid source rectangle");
+      return;
+    }
 
-  if (surface->xdg_surface)
-    surface->xdg_surface->surface = NULL;
+  viewport->src_x = x;
+  viewport->src_y = y;
+  viewport->src_width = width;
+  viewport->src_height = height;
+}
 
-  if (surface->xdg_popup)
-    surface->xdg_popup->surface = NULL;
+static void
+viewport_set_destination (struct wl_client *client,
+                          struct wl_resource *resource,
+                          int32_t width,
+                          int32_t height)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
 
-  wl_list_remove (wl_resource_get_link (resource));
+  if (surface == NULL)
+    {
+      wl_resource_post_error (resource, WP_VIEWPORT_ERROR_NO_SURFACE,
+                              "wp_viewport: the wl_surface was destroyed");
+      return;
+    }
 
-  destroy_pending_state (&surface->pending);
-  destroy_pending_state (&surface->current);
+  if ((width <= 0 || height <= 0) && !(width == -1 && height == -1))
+    {
+      wl_resource_post_error (resource, WP_VIEWPORT_ERROR_BAD_VALUE,
+                              "wp_viewport: invalid destination size");
+      return;
+    }
 
-  g_object_unref (surface);
+  surface->pending.viewport.dst_width = width;
+  surface->pending.viewport.dst_height = height;
 }
 
-static const struct wl_surface_interface surface_implementation = {
-  wl_surface_destroy,
-  wl_surface_attach,
-  wl_surface_damage,
-  wl_surface_frame,
-  wl_surface_set_opaque_region,
-  wl_surface_set_input_region,
-  wl_surface_commit,
-  wl_surface_set_buffer_transform,
-  wl_surface_set_buffer_scale
+static const struct wp_viewport_interface viewport_implementation = {
+  viewport_destroy,
+  viewport_set_source,
+  viewport_set_destination
 };
 
-struct wl_resource *
-wakefield_surface_new (WakefieldCompositor *compositor,
-                       struct wl_client *client,
-                       struct wl_resource *compositor_resource,
-                       uint32_t id)
+static void
+viewport_finalize (struct wl_resource *resource)
 {
-  WakefieldSurface *surface;
-
-  surface = g_object_new (WAKEFIELD_TYPE_SURFACE, NULL);
-  surface->compositor = compositor;
-  surface->damage = cairo_region_create ();
+  WakefieldSurface *surface = wl_resource_get_user_data (resource);
 
-  surface->resource = wl_resource_create (client, &wl_surface_interface, wl_resource_get_version (compositor_resource), id);
-  wl_resource_set_implementation (surface->resource, &surface_implementation, surface, wl_surface_finalize);
+  /* Like unsetting both, on the next commit */
+  if (surface)
+    {
+      viewport_init (&surface->pending.viewport);
+      surface->viewport = NULL;
+    }
+}
 
-  wl_list_init (&surface->pending.frame_callbacks);
-  wl_list_init (&surface->current.frame_callbacks);
+struct wl_resource *
+wakefield_viewport_new (struct wl_client   *client,
+                        struct wl_resource *viewporter_resource,
+                        uint32_t            id,
+                        struct wl_resource *surface_resource)
+{
+  WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
 
-  surface->current.scale = 1;
-  surface->pending.scale = 1;
+  surface->viewport = wl_resource_create (client, &wp_viewport_interface,
+                                          wl_resource_get_version (viewporter_resource), id);
+  wl_resource_set_implementation (surface->viewport, &viewport_implementation,
+                                  surface, viewport_finalize);
 
-  return surface->resource;
+  return surface->viewport;
 }
 
 static void
@@ -656,6 +1730,22 @@ xdg_surface_ack_configure (struct wl_client *client,
                            struct wl_resource *resource,
                            uint32_t serial)
 {
+  struct WakefieldXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+
+  if (serial != xdg_surface->configure_serial)
+    return;
+
+  /* Ties the next commit to this configure */
+  if (xdg_surface->surface)
+    xdg_surface->surface->pending.configure_serial = serial;
+
+  if (xdg_surface->configure_acked)
+    return;
+
+  xdg_surface->configure_acked = TRUE;
+
+  if (xdg_surface->configure_pending && xdg_surface->surface)
+    wakefield_compositor_send_xdg_configure (xdg_surface->surface->compositor, resource);
 }
 
 static void
@@ -666,6 +1756,13 @@ xdg_surface_set_window_geometry (struct wl_client *client,
                                  int32_t width,
                                  int32_t height)
 {
+  struct WakefieldXdgSurface *xdg_surface = wl_resource_get_user_data (resource);
+  cairo_rectangle_int_t geometry = { x, y, width, height };
+
+  if (xdg_surface->surface == NULL || width <= 0 || height <= 0)
+    return;
+
+  xdg_surface->surface->pending.window_geometry = geometry;
 }
 
 static void
@@ -735,6 +1832,60 @@ wakefield_xdg_surface_get_window (struct wl_resource *xdg_surface_resource)
   return xdg_surface->window;
 }
 
+void
+wakefield_xdg_surface_configure (struct wl_resource *xdg_surface_resource,
+                                 int width,
+                                 int height,
+                                 gboolean activated)
+{
+  struct WakefieldXdgSurface *xdg_surface = wl_resource_get_user_data (xdg_surface_resource);
+  struct wl_display *display = wl_client_get_display (wl_resource_get_client (xdg_surface_resource));
+  /* There are at most two states, so this needs no allocation */
+  uint32_t state_data[2];
+  struct wl_array states;
+  uint32_t *s;
+
+  /* Nothing changed since the last configure, or the one in flight */
+  if (xdg_surface->configure_serial != 0 &&
+      xdg_surface->configure_width == width &&
+      xdg_surface->configure_height == height &&
+      xdg_surface->configure_activated == activated)
+    {
+      xdg_surface->configure_pending = FALSE;
+      return;
+    }
+
+  /* Only the latest one goes out once the client acks, or catches up
+     with its socket */
+  if (!xdg_surface->configure_acked ||
+      wakefield_client_is_backed_up (wl_resource_get_client (xdg_surface_resource)))
+    {
+      xdg_surface->configure_pending = TRUE;
+      return;
+    }
+
+  s = state_data;
+  *s++ = XDG_SURFACE_STATE_FULLSCREEN;
+  if (activated)
+    *s++ = XDG_SURFACE_STATE_ACTIVATED;
+
+  states.data = state_data;
+  states.size = (s - state_data) * sizeof *s;
+  states.alloc = sizeof state_data;
+
+  xdg_surface->configure_serial = wl_display_next_serial (display);
+  xdg_surface->configure_acked = FALSE;
+  xdg_surface->configure_pending = FALSE;
+  xdg_surface->configure_width = width;
+  xdg_surface->configure_height = height;
+  xdg_surface->configure_activated = activated;
+
+  xdg_surface_send_configure (xdg_surface_resource, width, height,
+                              &states, xdg_surface->configure_serial);
+}
+
+G_DEFINE_QUARK (wakefield-xdg-surface-window, wakefield_xdg_surface_window)
+
 void
 wakefield_xdg_surface_realize (struct wl_resource *xdg_surface_resource,
                                GdkWindow *parent_window)
@@ -744,15 +1895,15 @@ wakefield_xdg_surface_realize (struct wl_resource *xdg_surface_resource,
   WakefieldSurface *surface = xdg_surface->surface;
   GdkWindowAttr attributes;
   gint attributes_mask;
-  int width, height;
+  int x, y, width, height;
 
   if (surface == NULL)
     return;
 
   compositor = surface->compositor;
 
-  wakefield_surface_get_current_size (xdg_surface->surface,
-                                      &width, &height);
+  wakefield_surface_get_window_geometry (surface->resource, &x, &y,
+                                         &width, &height);
 
   attributes.x = 0;
   attributes.y = 0;
@@ -774,6 +1925,10 @@ wakefield_xdg_surface_realize (struct wl_resource *xdg_surface_resource,
 
   xdg_surface->window = gdk_window_new (parent_window, &attributes, attributes_mask);
   gtk_widget_register_window (GTK_WIDGET (compositor), xdg_surface->window);
+  /* The user data is the widget, so input routing finds us through this */
+  g_object_set_qdata (G_OBJECT (xdg_surface->window),
+                      wakefield_xdg_surface_window_quark (),
+                      xdg_surface_resource);
   gdk_window_show (xdg_surface->window);
 }
 
@@ -795,6 +1950,8 @@ wakefield_xdg_surface_unrealize (struct wl_resource *xdg_surface_resource)
           gtk_widget_unregister_window (GTK_WIDGET (compositor), xdg_surface->window);
         }
 
+      g_object_set_qdata (G_OBJECT (xdg_surface->window),
+                          wakefield_xdg_surface_window_quark (), NULL);
       gdk_window_destroy (xdg_surface->window);
       xdg_surface->window = NULL;
     }
@@ -814,6 +1971,7 @@ wakefield_xdg_surface_new (struct wl_client *client,
 
   xdg_surface = g_slice_new0 (struct WakefieldXdgSurface);
   xdg_surface->surface = surface;
+  xdg_surface->configure_acked = TRUE;
 
   surface->xdg_surface = xdg_surface;
 
@@ -834,30 +1992,14 @@ static const struct xdg_popup_interface xdg_popup_implementation = {
   xdg_popup_destroy,
 };
 
-static void
-xdg_popup_finalize (struct wl_resource *xdg_popup_resource)
-{
-  struct WakefieldXdgPopup *xdg_popup = wl_resource_get_user_data (xdg_popup_resource);
-
-  if (xdg_popup->surface)
-    wl_surface_unmap (xdg_popup->surface);
-
-  wl_list_remove (wl_resource_get_link (xdg_popup_resource));
-
-  if (xdg_popup->surface)
-    xdg_popup->surface->xdg_popup = NULL;
-
-  gtk_widget_destroy (xdg_popup->toplevel);
-
-  g_slice_free (struct WakefieldXdgPopup, xdg_popup);
-}
-
 static gboolean
 xdg_popup_draw (GtkWidget *widget,
                 cairo_t   *cr,
-                struct WakefieldXdgPopup *xdg_popup)
+                struct WakefieldPopupWindow *window)
 {
-  if (xdg_popup->surface)
+  struct WakefieldXdgPopup *xdg_popup = window->xdg_popup;
+
+  if (xdg_popup && xdg_popup->surface)
     wakefield_surface_draw (xdg_popup->surface->resource, cr);
   return TRUE;
 }
@@ -865,9 +2007,11 @@ xdg_popup_draw (GtkWidget *widget,
 static gboolean
 xdg_popup_enter_notify (GtkWidget        *widget,
                         GdkEventCrossing *event,
-                        struct WakefieldXdgPopup *xdg_popup)
+                        struct WakefieldPopupWindow *window)
 {
-  if (event->mode == GDK_CROSSING_NORMAL && xdg_popup->surface)
+  struct WakefieldXdgPopup *xdg_popup = window->xdg_popup;
+
+  if (event->mode == GDK_CROSSING_NORMAL && xdg_popup && xdg_popup->surface)
     wakefield_compositor_send_enter (xdg_popup->surface->compositor,
                                      xdg_popup->surface->resource,
                                      event);
@@ -878,9 +2022,11 @@ xdg_popup_enter_notify (GtkWidget        *widget,
 static gboolean
 xdg_popup_leave_notify (GtkWidget        *widget,
                         GdkEventCrossing *event,
-                        struct WakefieldXdgPopup *xdg_popup)
+                        struct WakefieldPopupWindow *window)
 {
-  if (event->mode == GDK_CROSSING_NORMAL && xdg_popup->surface)
+  struct WakefieldXdgPopup *xdg_popup = window->xdg_popup;
+
+  if (event->mode == GDK_CROSSING_NORMAL && xdg_popup && xdg_popup->surface)
     wakefield_compositor_send_leave (xdg_popup->surface->compositor,
                                      xdg_popup->surface->resource,
                                      event);
@@ -891,9 +2037,11 @@ xdg_popup_leave_notify (GtkWidget        *widget,
 static gboolean
 xdg_popup_motion_notify (GtkWidget        *widget,
                          GdkEventMotion   *event,
-                         struct WakefieldXdgPopup *xdg_popup)
+                         struct WakefieldPopupWindow *window)
 {
-  if (xdg_popup->surface)
+  struct WakefieldXdgPopup *xdg_popup = window->xdg_popup;
+
+  if (xdg_popup && xdg_popup->surface)
     wakefield_compositor_send_motion (xdg_popup->surface->compositor,
                                       xdg_popup->surface->resource,
                                       event);
@@ -904,9 +2052,11 @@ xdg_popup_motion_notify (GtkWidget        *widget,
 static gboolean
 xdg_popup_button_press_event (GtkWidget      *widget,
                               GdkEventButton *event,
-                              struct WakefieldXdgPopup *xdg_popup)
+                              struct WakefieldPopupWindow *window)
 {
-  if (xdg_popup->surface)
+  struct WakefieldXdgPopup *xdg_popup = window->xdg_popup;
+
+  if (xdg_popup && xdg_popup->surface)
     wakefield_compositor_send_button (xdg_popup->surface->compositor,
                                       xdg_popup->surface->resource,
                                       event);
@@ -916,9 +2066,11 @@ xdg_popup_button_press_event (GtkWidget      *widget,
 static gboolean
 xdg_popup_button_release_event (GtkWidget      *widget,
                                 GdkEventButton *event,
-                                struct WakefieldXdgPopup *xdg_popup)
+                                struct WakefieldPopupWindow *window)
 {
-  if (xdg_popup->surface)
+  struct WakefieldXdgPopup *xdg_popup = window->xdg_popup;
+
+  if (xdg_popup && xdg_popup->surface)
     wakefield_compositor_send_button (xdg_popup->surface->compositor,
                                       xdg_popup->surface->resource,
                                       event);
@@ -928,15 +2080,168 @@ xdg_popup_button_release_event (GtkWidget      *widget,
 static gboolean
 xdg_popup_scroll_event (GtkWidget      *widget,
                         GdkEventScroll *event,
-                        struct WakefieldXdgPopup *xdg_popup)
+                        struct WakefieldPopupWindow *window)
 {
-  if (xdg_popup->surface)
+  struct WakefieldXdgPopup *xdg_popup = window->xdg_popup;
+
+  if (xdg_popup && xdg_popup->surface)
     wakefield_compositor_send_scroll (xdg_popup->surface->compositor,
                                       xdg_popup->surface->resource,
                                       event);
   return TRUE;
 }
 
+/* Per screen and visual, so a pooled toplevel can take any popup */
+#define POPUP_POOL_SIZE 4
+
+static GQueue popup_pool = G_QUEUE_INIT;
+
+static GdkVisual *
+get_popup_visual (GdkScreen *screen)
+{
+  GdkVisual *rgba_visual = gdk_screen_get_rgba_visual (screen);
+
+  return rgba_visual ? rgba_visual : gdk_screen_get_system_visual (screen);
+}
+
+static struct WakefieldPopupWindow *
+popup_window_new (GdkScreen *screen,
+                  GdkVisual *visual)
+{
+  struct WakefieldPopupWindow *window;
+
+  window = g_slice_new0 (struct WakefieldPopupWindow);
+  window->screen = screen;
+  window->visual = visual;
+
+  window->toplevel = gtk_window_new (GTK_WINDOW_POPUP);
+  gtk_window_set_screen (GTK_WINDOW (window->toplevel), screen);
+  gtk_widget_set_visual (GTK_WIDGET (window->toplevel), visual);
+
+  gtk_widget_set_app_paintable (GTK_WIDGET (window->toplevel), TRUE);
+  gtk_widget_realize (window->toplevel);
+  gdk_window_set_type_hint (gtk_widget_get_window (window->toplevel),
+                            GDK_WINDOW_TYPE_HINT_POPUP_MENU);
+
+  window->drawing_area = gtk_drawing_area_new ();
+  gtk_widget_set_events (window->drawing_area,
+                         GDK_POINTER_MOTION_MASK |
+                         GDK_BUTTON_PRESS_MASK |
+                         GDK_BUTTON_RELEASE_MASK |
+                         GDK_SCROLL_MASK |
+                         GDK_FOCUS_CHANGE_MASK |
+                         GDK_KEY_PRESS_MASK |
+                         GDK_KEY_RELEASE_MASK |
+                         GDK_ENTER_NOTIFY_MASK |
+                         GDK_LEAVE_NOTIFY_MASK |
+                         GDK_EXPOSURE_MASK);
+  gtk_container_add (GTK_CONTAINER (window->toplevel), window->drawing_area);
+  gtk_widget_show (window->drawing_area);
+
+  g_signal_connect (window->drawing_area, "draw", G_CALLBACK (xdg_popup_draw),
+                    window);
+  g_signal_connect (window->drawing_area, "enter-notify-event", G_CALLBACK (xdg_popup_enter_notify),
+                    window);
+  g_signal_connect (window->drawing_area, "leave-notify-event", G_CALLBACK (xdg_popup_leave_notify),
+                    window);
+  g_signal_connect (window->drawing_area, "motion-notify-event", G_CALLBACK (xdg_popup_motion_notify),
+                    window);
+  g_signal_connect (window->drawing_area, "button-press-event", G_CALLBACK (xdg_popup_button_press_event),
+                    window);
+  g_signal_connect (window->drawing_area, "button-release-event", G_CALLBACK (xdg_popup_button_release_event),
+                    window);
+  g_signal_connect (window->drawing_area, "scroll-event", G_CALLBACK (xdg_popup_scroll_event),
+                    window);
+
+  return window;
+}
+
+static struct WakefieldPopupWindow *
+popup_window_acquire (GdkScreen *screen)
+{
+  GdkVisual *visual = get_popup_visual (screen);
+  GList *l;
+
+  for (l = popup_pool.head; l != NULL; l = l->next)
+    {
+      struct WakefieldPopupWindow *window = l->data;
+
+      if (window->screen == screen && window->visual == visual)
+        {
+          g_queue_delete_link (&popup_pool, l);
+          return window;
+        }
+    }
+
+  return popup_window_new (screen, visual);
+}
+
+static void
+popup_window_release (struct WakefieldPopupWindow *window)
+{
+  window->xdg_popup = NULL;
+
+  gtk_widget_hide (window->toplevel);
+  gdk_window_set_transient_for (gtk_widget_get_window (window->toplevel), NULL);
+  gtk_widget_set_size_request (window->drawing_area, -1, -1);
+
+  if (g_queue_get_length (&popup_pool) < POPUP_POOL_SIZE)
+    {
+      g_queue_push_head (&popup_pool, window);
+      return;
+    }
+
+  gtk_widget_destroy (window->toplevel);
+  g_slice_free (struct WakefieldPopupWindow, window);
+}
+
+static gboolean
+prepare_popup_window (gpointer user_data)
+{
+  GdkScreen *screen = user_data;
+  GdkVisual *visual = get_popup_visual (screen);
+  GList *l;
+
+  for (l = popup_pool.head; l != NULL; l = l->next)
+    {
+      struct WakefieldPopupWindow *window = l->data;
+
+      if (window->screen == screen && window->visual == visual)
+        return G_SOURCE_REMOVE;
+    }
+
+  g_queue_push_head (&popup_pool, popup_window_new (screen, visual));
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Gets a popup toplevel ready for screen once we are idle, so that
+   even the first menu doesn't wait for one */
+void
+wakefield_xdg_popup_prepare (GdkScreen *screen)
+{
+  g_idle_add_full (G_PRIORITY_LOW, prepare_popup_window, screen, NULL);
+}
+
+static void
+xdg_popup_finalize (struct wl_resource *xdg_popup_resource)
+{
+  struct WakefieldXdgPopup *xdg_popup = wl_resource_get_user_data (xdg_popup_resource);
+
+  if (xdg_popup->surface)
+    wl_surface_unmap (xdg_popup->surface);
+
+  wl_list_remove (wl_resource_get_link (xdg_popup_resource));
+
+  if (xdg_popup->surface)
+    xdg_popup->surface->xdg_popup = NULL;
+
+  if (xdg_popup->window)
+    popup_window_release (xdg_popup->window);
+
+  g_slice_free (struct WakefieldXdgPopup, xdg_popup);
+}
+
 guint32
 wakefield_xdg_popup_get_serial (struct wl_resource *xdg_popup_resource)
 {
@@ -950,7 +2255,31 @@ wakefield_xdg_popup_get_window (struct wl_resource *xdg_popup_resource)
 {
   struct WakefieldXdgPopup *xdg_popup = wl_resource_get_user_data (xdg_popup_resource);
 
-  return gtk_widget_get_window (xdg_popup->drawing_area);
+  /* Overlays, and popups not placed yet, get their input through the
+     compositor */
+  if (xdg_popup->window == NULL)
+    return wakefield_surface_get_window (xdg_popup->parent_surface->resource);
+
+  return gtk_widget_get_window (xdg_popup->window->drawing_area);
+}
+
+/* Returns the surface of a popup drawn by the compositor, mapped or not,
+   and where it goes */
+struct wl_resource *
+wakefield_xdg_popup_get_overlay (struct wl_resource *xdg_popup_resource,
+                                 int *x, int *y,
+                                 int *width, int *height)
+{
+  struct WakefieldXdgPopup *xdg_popup = wl_resource_get_user_data (xdg_popup_resource);
+
+  if (!xdg_popup->overlay || xdg_popup->surface == NULL)
+    return NULL;
+
+  *x = xdg_popup->overlay_x;
+  *y = xdg_popup->overlay_y;
+  wakefield_surface_get_current_size (xdg_popup->surface, width, height);
+
+  return xdg_popup->surface->resource;
 }
 
 void
@@ -961,7 +2290,8 @@ wakefield_xdg_popup_close (struct wl_resource *xdg_popup_resource)
 
   if (surface && surface->mapped)
     {
-      gtk_widget_hide (xdg_popup->toplevel);
+      if (xdg_popup->window)
+        gtk_widget_hide (xdg_popup->window->toplevel);
       surface->mapped = FALSE;
 
       wakefield_compositor_surface_unmapped (surface->compositor, surface->resource);
@@ -973,12 +2303,65 @@ wakefield_xdg_popup_close (struct wl_resource *xdg_popup_resource)
 static GdkWindow *
 get_toplevel (WakefieldSurface *surface)
 {
-  if (surface->xdg_popup)
-    return gtk_widget_get_window (surface->xdg_popup->toplevel);
+  if (surface->xdg_popup && surface->xdg_popup->window)
+    return gtk_widget_get_window (surface->xdg_popup->window->toplevel);
+  else if (surface->xdg_popup)
+    return get_toplevel (surface->xdg_popup->parent_surface);
   else
     return surface->xdg_surface->window;
 }
 
+/* Decided once, at the first map: a popup whose parent is drawn by the
+   compositor and that fits inside its allocation is drawn there too,
+   anything else gets a toplevel of its own */
+static void
+place_xdg_popup (struct WakefieldXdgPopup *xdg_popup,
+                 int width, int height)
+{
+  WakefieldSurface *parent_surface = xdg_popup->parent_surface;
+  GtkWidget *widget = GTK_WIDGET (xdg_popup->surface->compositor);
+  struct WakefieldXdgPopup *parent_popup = parent_surface->xdg_popup;
+  int x, y;
+
+  xdg_popup->placed = TRUE;
+
+  if (parent_surface->xdg_surface != NULL ||
+      (parent_popup != NULL && parent_popup->overlay))
+    {
+      x = xdg_popup->x;
+      y = xdg_popup->y;
+      if (parent_popup != NULL)
+        {
+          x += parent_popup->overlay_x;
+          y += parent_popup->overlay_y;
+        }
+      else
+        {
+          int geometry_x, geometry_y;
+
+          wakefield_surface_get_window_geometry (parent_surface->resource,
+                                                 &geometry_x, &geometry_y, NULL, NULL);
+          x -= geometry_x;
+          y -= geometry_y;
+        }
+
+      if (x >= 0 && y >= 0 &&
+          x + width <= gtk_widget_get_allocated_width (widget) &&
+          y + height <= gtk_widget_get_allocated_height (widget))
+        {
+          xdg_popup->overlay = TRUE;
+          xdg_popup->overlay_x = x;
+          xdg_popup->overlay_y = y;
+          return;
+        }
+    }
+
+  xdg_popup->window = popup_window_acquire (gtk_widget_get_screen (widget));
+  xdg_popup->window->xdg_popup = xdg_popup;
+  gdk_window_set_transient_for (gtk_widget_get_window (xdg_popup->window->toplevel),
+                                get_toplevel (parent_surface));
+}
+
 struct wl_resource *
 wakefield_xdg_popup_new (WakefieldCompositor *compositor,
                          struct wl_client   *client,
@@ -992,9 +2375,6 @@ wakefield_xdg_popup_new (WakefieldCompositor *compositor,
   WakefieldSurface *surface = wl_resource_get_user_data (surface_resource);
   WakefieldSurface *parent_surface = wl_resource_get_user_data (parent_resource);
   struct WakefieldXdgPopup *xdg_popup;
-  GdkWindow *popup_window;
-  GdkScreen *screen = gtk_widget_get_screen (GTK_WIDGET (compositor));
-  GdkVisual *rgba_visual = gdk_screen_get_rgba_visual (screen);
 
   wakefield_surface_set_role (surface_resource,
                               WAKEFIELD_SURFACE_ROLE_XDG_SURFACE);
@@ -1003,50 +2383,10 @@ wakefield_xdg_popup_new (WakefieldCompositor *compositor,
   xdg_popup->surface = surface;
   xdg_popup->parent_surface = parent_surface;
 
-  xdg_popup->toplevel = gtk_window_new (GTK_WINDOW_POPUP);
-  gtk_window_set_screen (GTK_WINDOW (xdg_popup->toplevel), screen);
-  if (rgba_visual)
-    gtk_widget_set_visual (GTK_WIDGET (xdg_popup->toplevel), rgba_visual);
-
-  gtk_widget_set_app_paintable (GTK_WIDGET (xdg_popup->toplevel), TRUE);
-  gtk_widget_realize (xdg_popup->toplevel);
-  popup_window = gtk_widget_get_window (xdg_popup->toplevel);
-  gdk_window_set_transient_for (popup_window, get_toplevel (parent_surface));
-  gdk_window_set_type_hint (popup_window, GDK_WINDOW_TYPE_HINT_POPUP_MENU);
-
-  xdg_popup->drawing_area = gtk_drawing_area_new ();
-  gtk_widget_set_events (xdg_popup->drawing_area,
-                         GDK_POINTER_MOTION_MASK |
-                         GDK_BUTTON_PRESS_MASK |
-                         GDK_BUTTON_RELEASE_MASK |
-                         GDK_SCROLL_MASK |
-                         GDK_FOCUS_CHANGE_MASK |
-                         GDK_KEY_PRESS_MASK |
-                         GDK_KEY_RELEASE_MASK |
-                         GDK_ENTER_NOTIFY_MASK |
-                         GDK_LEAVE_NOTIFY_MASK |
-                         GDK_EXPOSURE_MASK);
-  gtk_container_add (GTK_CONTAINER (xdg_popup->toplevel), xdg_popup->drawing_area);
-  gtk_widget_show (xdg_popup->drawing_area);
   xdg_popup->serial = serial;
   xdg_popup->x = x;
   xdg_popup->y = y;
 
-  g_signal_connect (xdg_popup->drawing_area, "draw", G_CALLBACK (xdg_popup_draw),
-                    xdg_popup);
-  g_signal_connect (xdg_popup->drawing_area, "enter-notify-event", G_CALLBACK (xdg_popup_enter_notify),
-                    xdg_popup);
-  g_signal_connect (xdg_popup->drawing_area, "leave-notify-event", G_CALLBACK (xdg_popup_leave_notify),
-                    xdg_popup);
-  g_signal_connect (xdg_popup->drawing_area, "motion-notify-event", G_CALLBACK (xdg_popup_motion_notify),
-                    xdg_popup);
-  g_signal_connect (xdg_popup->drawing_area, "button-press-event", G_CALLBACK (xdg_popup_button_press_event),
-                    xdg_popup);
-  g_signal_connect (xdg_popup->drawing_area, "button-release-event", G_CALLBACK (xdg_popup_button_release_event),
-                    xdg_popup);
-  g_signal_connect (xdg_popup->drawing_area, "scroll-event", G_CALLBACK (xdg_popup_scroll_event),
-                    xdg_popup);
-
   surface->xdg_popup = xdg_popup;
 
   xdg_popup->resource = wl_resource_create (client, &xdg_popup_interface, wl_resource_get_version (shell_resource), id);
@@ -1054,21 +2394,3 @@ wakefield_xdg_popup_new (WakefieldCompositor *compositor,
 
   return xdg_popup->resource;
 }
-
-static void
-wakefield_surface_init (WakefieldSurface *surface)
-{
-}
-
-static void
-wakefield_surface_class_init (WakefieldSurfaceClass *klass)
-{
-  GObjectClass *object_class = G_OBJECT_CLASS (klass);
-
-  signals[COMMITTED] = g_signal_new ("committed",
-                                     G_TYPE_FROM_CLASS (object_class),
-                                     G_SIGNAL_RUN_FIRST,
-                                     0,
-                                     NULL, NULL, NULL,
-                                     G_TYPE_NONE, 0);
-}
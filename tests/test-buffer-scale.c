@@ -0,0 +1,76 @@
+#include "test-client.h"
+
+/* A client that sets a buffer scale below 1 gets a protocol error, and
+   the compositor carries on serving other clients */
+
+static gboolean
+check_scale (WakefieldCompositor *compositor,
+             int32_t              scale)
+{
+  TestClient *client;
+  struct wl_surface *surface;
+  const struct wl_interface *interface;
+  uint32_t id, code;
+  gboolean ok = TRUE;
+
+  client = test_client_new (compositor);
+  if (client == NULL)
+    return FALSE;
+
+  surface = wl_compositor_create_surface (client->compositor);
+  wl_surface_set_buffer_scale (surface, scale);
+  wl_surface_commit (surface);
+
+  if (test_client_roundtrip (client))
+    {
+      g_printerr ("Buffer scale %d was accepted\n", scale);
+      ok = FALSE;
+    }
+  else
+    {
+      code = wl_display_get_protocol_error (client->display, &interface, &id);
+      if (interface != &wl_surface_interface ||
+          id != wl_proxy_get_id ((struct wl_proxy *) surface) ||
+          code != WL_SURFACE_ERROR_INVALID_SCALE)
+        {
+          g_printerr ("Buffer scale %d got the wrong error\n", scale);
+          ok = FALSE;
+        }
+    }
+
+  wl_surface_destroy (surface);
+  test_client_free (client);
+
+  return ok;
+}
+
+int
+main (int argc, char **argv)
+{
+  WakefieldCompositor *compositor;
+  TestClient *client;
+  gboolean ok;
+
+  if (!gtk_init_check (&argc, &argv))
+    return 77;
+
+  compositor = wakefield_compositor_new ();
+  g_object_ref_sink (compositor);
+
+  ok = check_scale (compositor, 0) && check_scale (compositor, -2);
+
+  /* Still there for everyone else */
+  client = test_client_new (compositor);
+  if (client == NULL || !test_client_roundtrip (client))
+    {
+      g_printerr ("The compositor stopped serving clients\n");
+      ok = FALSE;
+    }
+  if (client != NULL)
+    test_client_free (client);
+
+  gtk_widget_destroy (GTK_WIDGET (compositor));
+  g_object_unref (compositor);
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "test-client.h"
+
+static void
+registry_global (void *data,
+                 struct wl_registry *registry,
+                 uint32_t name,
+                 const char *interface,
+                 uint32_t version)
+{
+  TestClient *client = data;
+
+  if (strcmp (interface, wl_compositor_interface.name) == 0)
+    client->compositor = wl_registry_bind (registry, name, &wl_compositor_interface, 4);
+  else if (strcmp (interface, wl_shm_interface.name) == 0)
+    client->shm = wl_registry_bind (registry, name, &wl_shm_interface, 1);
+  else if (strcmp (interface, wl_seat_interface.name) == 0)
+    client->seat = wl_registry_bind (registry, name, &wl_seat_interface, 1);
+  else if (strcmp (interface, xdg_shell_interface.name) == 0)
+    client->shell = wl_registry_bind (registry, name, &xdg_shell_interface, 1);
+  else if (strcmp (interface, zwp_pointer_constraints_v1_interface.name) == 0)
+    client->pointer_constraints = wl_registry_bind (registry, name,
+                                                    &zwp_pointer_constraints_v1_interface, 1);
+}
+
+static void
+registry_global_remove (void *data,
+                        struct wl_registry *registry,
+                        uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+  registry_global,
+  registry_global_remove
+};
+
+static void
+shell_ping (void *data,
+            struct xdg_shell *shell,
+            uint32_t serial)
+{
+  xdg_shell_pong (shell, serial);
+}
+
+static const struct xdg_shell_listener shell_listener = {
+  shell_ping
+};
+
+static void
+sync_done (void *data,
+           struct wl_callback *callback,
+           uint32_t serial)
+{
+  gboolean *done = data;
+
+  *done = TRUE;
+  wl_callback_destroy (callback);
+}
+
+static const struct wl_callback_listener sync_listener = {
+  sync_done
+};
+
+void
+test_client_run_server (TestClient *client)
+{
+  wl_display_flush (client->display);
+
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+
+  if (wl_display_prepare_read (client->display) == 0)
+    wl_display_read_events (client->display);
+  wl_display_dispatch_pending (client->display);
+}
+
+/* Returns FALSE if the server disconnected us */
+gboolean
+test_client_roundtrip (TestClient *client)
+{
+  struct wl_callback *callback;
+  gboolean done = FALSE;
+
+  callback = wl_display_sync (client->display);
+  wl_callback_add_listener (callback, &sync_listener, &done);
+
+  while (!done)
+    {
+      if (wl_display_get_error (client->display) != 0)
+        return FALSE;
+      test_client_run_server (client);
+    }
+
+  return TRUE;
+}
+
+TestClient *
+test_client_new (WakefieldCompositor *compositor)
+{
+  TestClient *client;
+  struct wl_registry *registry;
+  GError *error = NULL;
+  int fd;
+
+  fd = wakefield_compositor_create_client_fd (compositor, NULL, NULL, &error);
+  if (fd == -1)
+    {
+      g_printerr ("%s\n", error->message);
+      g_error_free (error);
+      return NULL;
+    }
+
+  client = g_new0 (TestClient, 1);
+  client->display = wl_display_connect_to_fd (fd);
+
+  registry = wl_display_get_registry (client->display);
+  wl_registry_add_listener (registry, &registry_listener, client);
+  if (!test_client_roundtrip (client) ||
+      client->compositor == NULL || client->shm == NULL || client->shell == NULL)
+    {
+      g_printerr ("Missing globals\n");
+      test_client_free (client);
+      return NULL;
+    }
+
+  xdg_shell_use_unstable_version (client->shell, XDG_SHELL_VERSION_CURRENT);
+  xdg_shell_add_listener (client->shell, &shell_listener, client);
+
+  return client;
+}
+
+void
+test_client_free (TestClient *client)
+{
+  wl_display_disconnect (client->display);
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+
+  g_free (client);
+}
+
+struct wl_buffer *
+test_client_create_buffer (TestClient *client,
+                           int         width,
+                           int         height)
+{
+  struct wl_shm_pool *pool;
+  struct wl_buffer *buffer;
+  int size = width * height * 4;
+  int fd;
+
+  fd = memfd_create ("test-client", MFD_CLOEXEC);
+  if (fd == -1 || ftruncate (fd, size) == -1)
+    return NULL;
+
+  pool = wl_shm_create_pool (client->shm, fd, size);
+  buffer = wl_shm_pool_create_buffer (pool, 0, width, height, width * 4,
+                                      WL_SHM_FORMAT_ARGB8888);
+  wl_shm_pool_destroy (pool);
+  close (fd);
+
+  return buffer;
+}
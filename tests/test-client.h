@@ -0,0 +1,26 @@
+#include <gtk/gtk.h>
+#include <wayland-client.h>
+#include "xdg-shell-client-protocol.h"
+#include "pointer-constraints-unstable-v1-client-protocol.h"
+#include "wakefield-compositor.h"
+
+/* A client in the same process as the compositor. The server runs on
+   our own main loop, so the client never blocks on it. */
+
+typedef struct
+{
+  struct wl_display *display;
+  struct wl_compositor *compositor;
+  struct wl_shm *shm;
+  struct wl_seat *seat;
+  struct xdg_shell *shell;
+  struct zwp_pointer_constraints_v1 *pointer_constraints;
+} TestClient;
+
+TestClient *       test_client_new           (WakefieldCompositor *compositor);
+void               test_client_free          (TestClient          *client);
+void               test_client_run_server    (TestClient          *client);
+gboolean           test_client_roundtrip     (TestClient          *client);
+struct wl_buffer * test_client_create_buffer (TestClient          *client,
+                                              int                  width,
+                                              int                  height);
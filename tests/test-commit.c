@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <gtk/gtk.h>
+#include <wayland-client.h>
+#include "xdg-shell-client-protocol.h"
+#include "wakefield-compositor.h"
+
+/* Counts the heap allocations the server makes for each commit of a
+   surface that keeps showing the same buffer, with an in-process client.
+
+   libwayland allocates for every request it dispatches, so this runs
+   the same requests once with the commit swapped for one we ignore,
+   and takes the difference; that is what the commit path costs us and
+   it should be nothing. The compositor is never shown, so no GTK
+   repaints get in the way, and only the server side is counted.
+
+   Commits are run with damage in one rectangle, and split in several.
+   Neither may allocate at all, so this is run by meson test and fails
+   otherwise. */
+
+#define WIDTH 64
+#define HEIGHT 64
+
+/* glibc's own allocator, so we can count calls into it */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static gboolean counting;
+static guint64 allocations;
+
+void *
+malloc (size_t size)
+{
+  if (counting)
+    allocations++;
+  return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb, size_t size)
+{
+  if (counting)
+    allocations++;
+  return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+  if (counting)
+    allocations++;
+  return __libc_realloc (ptr, size);
+}
+
+struct Client
+{
+  struct wl_display *display;
+  struct wl_compositor *compositor;
+  struct wl_shm *shm;
+  struct xdg_shell *shell;
+  struct wl_surface *surface;
+  struct xdg_surface *xdg_surface;
+  struct wl_buffer *buffer;
+};
+
+/* The server runs on our own main loop, so nothing here may block */
+static guint64
+run_server (struct wl_display *display)
+{
+  guint64 start = allocations;
+
+  wl_display_flush (display);
+
+  counting = TRUE;
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+  counting = FALSE;
+
+  return allocations - start;
+}
+
+static void
+read_events (struct wl_display *display)
+{
+  if (wl_display_prepare_read (display) == 0)
+    wl_display_read_events (display);
+  wl_display_dispatch_pending (display);
+}
+
+static void
+sync_done (void *data,
+           struct wl_callback *callback,
+           uint32_t serial)
+{
+  gboolean *done = data;
+
+  *done = TRUE;
+  wl_callback_destroy (callback);
+}
+
+static const struct wl_callback_listener sync_listener = {
+  sync_done
+};
+
+static void
+roundtrip (struct Client *client)
+{
+  struct wl_callback *callback;
+  gboolean done = FALSE;
+
+  callback = wl_display_sync (client->display);
+  wl_callback_add_listener (callback, &sync_listener, &done);
+
+  while (!done)
+    {
+      run_server (client->display);
+      read_events (client->display);
+    }
+}
+
+static void
+registry_global (void *data,
+                 struct wl_registry *registry,
+                 uint32_t name,
+                 const char *interface,
+                 uint32_t version)
+{
+  struct Client *client = data;
+
+  if (strcmp (interface, wl_compositor_interface.name) == 0)
+    client->compositor = wl_registry_bind (registry, name, &wl_compositor_interface, 4);
+  else if (strcmp (interface, wl_shm_interface.name) == 0)
+    client->shm = wl_registry_bind (registry, name, &wl_shm_interface, 1);
+  else if (strcmp (interface, xdg_shell_interface.name) == 0)
+    client->shell = wl_registry_bind (registry, name, &xdg_shell_interface, 1);
+}
+
+static void
+registry_global_remove (void *data,
+                        struct wl_registry *registry,
+                        uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+  registry_global,
+  registry_global_remove
+};
+
+static void
+shell_ping (void *data,
+            struct xdg_shell *shell,
+            uint32_t serial)
+{
+  xdg_shell_pong (shell, serial);
+}
+
+static const struct xdg_shell_listener shell_listener = {
+  shell_ping
+};
+
+static void
+xdg_surface_configure (void *data,
+                       struct xdg_surface *xdg_surface,
+                       int32_t width,
+                       int32_t height,
+                       struct wl_array *states,
+                       uint32_t serial)
+{
+  xdg_surface_ack_configure (xdg_surface, serial);
+}
+
+static void
+xdg_surface_close (void *data,
+                   struct xdg_surface *xdg_surface)
+{
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+  xdg_surface_configure,
+  xdg_surface_close
+};
+
+static struct wl_buffer *
+create_buffer (struct wl_shm *shm)
+{
+  struct wl_shm_pool *pool;
+  struct wl_buffer *buffer;
+  int size = WIDTH * HEIGHT * 4;
+  int fd;
+
+  fd = memfd_create ("test-commit", MFD_CLOEXEC);
+  if (fd == -1 || ftruncate (fd, size) == -1)
+    return NULL;
+
+  pool = wl_shm_create_pool (shm, fd, size);
+  buffer = wl_shm_pool_create_buffer (pool, 0, WIDTH, HEIGHT, WIDTH * 4,
+                                      WL_SHM_FORMAT_ARGB8888);
+  wl_shm_pool_destroy (pool);
+  close (fd);
+
+  return buffer;
+}
+
+/* Attaches the same buffer again and damages all of it, as
+   n_rectangles bands of different widths, n times, and returns how many
+   allocations the server made for that */
+static guint64
+run_commits (struct Client *client,
+             int            n,
+             int            n_rectangles,
+             gboolean       commit)
+{
+  guint64 count = 0;
+  int i, j;
+
+  for (i = 0; i < n; i++)
+    {
+      wl_surface_attach (client->surface, client->buffer, 0, 0);
+      for (j = 0; j < n_rectangles; j++)
+        wl_surface_damage_buffer (client->surface, 0, j * HEIGHT / n_rectangles,
+                                  WIDTH - j, HEIGHT / n_rectangles);
+      if (commit)
+        wl_surface_commit (client->surface);
+      else
+        wl_surface_set_opaque_region (client->surface, NULL);
+
+      count += run_server (client->display);
+      read_events (client->display);
+    }
+
+  return count;
+}
+
+/* Returns the allocations per commit beyond the same requests without
+   it */
+static double
+measure (struct Client *client,
+         int            n,
+         int            n_rectangles)
+{
+  guint64 baseline, total;
+
+  /* The first time through anything may fill caches */
+  run_commits (client, 10, n_rectangles, TRUE);
+  run_commits (client, 10, n_rectangles, FALSE);
+
+  baseline = run_commits (client, n, n_rectangles, FALSE);
+  total = run_commits (client, n, n_rectangles, TRUE);
+
+  g_print ("%d rectangles: dispatch %8.2f, commit %8.2f allocations\n",
+           n_rectangles, (double) baseline / n,
+           ((double) total - (double) baseline) / n);
+
+  return ((double) total - (double) baseline) / n;
+}
+
+int
+main (int argc, char **argv)
+{
+  WakefieldCompositor *compositor;
+  struct Client client = { NULL, };
+  struct wl_registry *registry;
+  GError *error = NULL;
+  gboolean ok;
+  int n = 10000;
+  int fd;
+
+  if (!gtk_init_check (&argc, &argv))
+    return 77;
+
+  if (argc >= 2)
+    n = atoi (argv[1]);
+  if (n <= 0)
+    n = 10000;
+
+  compositor = wakefield_compositor_new ();
+  g_object_ref_sink (compositor);
+
+  fd = wakefield_compositor_create_client_fd (compositor, NULL, NULL, &error);
+  if (fd == -1)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  client.display = wl_display_connect_to_fd (fd);
+  registry = wl_display_get_registry (client.display);
+  wl_registry_add_listener (registry, &registry_listener, &client);
+  roundtrip (&client);
+
+  if (client.compositor == NULL || client.shm == NULL || client.shell == NULL)
+    {
+      g_printerr ("Missing globals\n");
+      return 1;
+    }
+
+  xdg_shell_use_unstable_version (client.shell, XDG_SHELL_VERSION_CURRENT);
+  xdg_shell_add_listener (client.shell, &shell_listener, &client);
+
+  client.surface = wl_compositor_create_surface (client.compositor);
+  client.xdg_surface = xdg_shell_get_xdg_surface (client.shell, client.surface);
+  xdg_surface_add_listener (client.xdg_surface, &xdg_surface_listener, &client);
+  client.buffer = create_buffer (client.shm);
+  if (client.buffer == NULL)
+    {
+      g_printerr ("Can't create a buffer\n");
+      return 1;
+    }
+
+  /* Acks the configure */
+  roundtrip (&client);
+
+  /* The first commit maps the surface */
+  ok = measure (&client, n, 1) <= 0;
+  ok &= measure (&client, n, 4) <= 0;
+
+  wl_buffer_destroy (client.buffer);
+  wl_display_disconnect (client.display);
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+
+  gtk_widget_destroy (GTK_WIDGET (compositor));
+  g_object_unref (compositor);
+
+  return ok ? 0 : 1;
+}
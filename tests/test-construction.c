@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <gtk/gtk.h>
+#include "wakefield-compositor.h"
+
+/* Times creating and destroying compositor widgets, both with a server
+   each and sharing one, and then what it takes for the first client to
+   connect to one. */
+
+static double
+construct (int              n,
+           WakefieldServer *server)
+{
+  gint64 start;
+  int i;
+
+  start = g_get_monotonic_time ();
+
+  for (i = 0; i < n; i++)
+    {
+      WakefieldCompositor *compositor;
+
+      if (server)
+        compositor = wakefield_compositor_new_for_server (server);
+      else
+        compositor = wakefield_compositor_new ();
+
+      g_object_ref_sink (compositor);
+      gtk_widget_destroy (GTK_WIDGET (compositor));
+      g_object_unref (compositor);
+    }
+
+  return (double) (g_get_monotonic_time () - start) / n;
+}
+
+int
+main (int argc, char **argv)
+{
+  WakefieldServer *server;
+  WakefieldCompositor *compositor;
+  GError *error = NULL;
+  gint64 start;
+  int n = 1000;
+  int fd;
+
+  gtk_init (&argc, &argv);
+
+  if (argc >= 2)
+    n = atoi (argv[1]);
+  if (n <= 0)
+    n = 1000;
+
+  /* The first one pays for type registration and such */
+  construct (1, NULL);
+
+  g_print ("own server:    %8.1f us per widget\n", construct (n, NULL));
+
+  server = wakefield_server_new ();
+  g_print ("shared server: %8.1f us per widget\n", construct (n, server));
+
+  /* The keymap only gets loaded now, off the main thread */
+  compositor = wakefield_compositor_new_for_server (server);
+  g_object_ref_sink (compositor);
+
+  start = g_get_monotonic_time ();
+  fd = wakefield_compositor_create_client_fd (compositor, NULL, NULL, &error);
+  if (fd == -1)
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+  g_print ("first client:  %8.1f us\n", (double) (g_get_monotonic_time () - start));
+
+  close (fd);
+  while (g_main_context_iteration (NULL, FALSE))
+    ;
+
+  gtk_widget_destroy (GTK_WIDGET (compositor));
+  g_object_unref (compositor);
+  g_object_unref (server);
+
+  return 0;
+}
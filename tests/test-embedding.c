@@ -2,6 +2,7 @@
 #include "wakefield-compositor.h"
 
 int child_count = 0;
+WakefieldServer *server;
 
 static void
 button_clicked (GtkButton *button,
@@ -15,7 +16,7 @@ button_clicked (GtkButton *button,
   GError *error = NULL;
   char *argv[] = { "./test-embedded", NULL };
 
-  compositor = wakefield_compositor_new ();
+  compositor = wakefield_compositor_new_for_server (server);
 
   gtk_widget_set_size_request (GTK_WIDGET (compositor), 400, 400);
 
@@ -61,6 +62,9 @@ main (int argc, char **argv)
 
   gtk_init (&argc, &argv);
 
+  /* All the children share one wayland display */
+  server = wakefield_server_new ();
+
   window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
 
   vbox = gtk_box_new (GTK_ORIENTATION_VERTICAL, 8);
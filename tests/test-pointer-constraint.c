@@ -0,0 +1,300 @@
+#include "test-client.h"
+#include "wakefield-private.h"
+
+/* Confines the pointer of a surface whose window geometry does not
+   start at its origin, and checks that motion is reported and clamped
+   in surface coordinates, not in those of the window we show it in.
+
+   Motion is fed to GTK as synthesized events on that window, but the
+   constraint grabs and warps the real pointer, so this needs a display
+   we may take the pointer on, like Xvfb. */
+
+#define WIDTH 100
+#define HEIGHT 100
+
+#define GEOMETRY_X 20
+#define GEOMETRY_Y 10
+
+/* In surface coordinates */
+#define REGION_X 30
+#define REGION_Y 30
+#define REGION_SIZE 20
+
+typedef struct
+{
+  gboolean entered;
+  gboolean confined;
+  double x, y;
+} PointerState;
+
+static void
+pointer_enter (void *data,
+               struct wl_pointer *pointer,
+               uint32_t serial,
+               struct wl_surface *surface,
+               wl_fixed_t x,
+               wl_fixed_t y)
+{
+  PointerState *state = data;
+
+  state->entered = TRUE;
+  state->x = wl_fixed_to_double (x);
+  state->y = wl_fixed_to_double (y);
+}
+
+static void
+pointer_leave (void *data,
+               struct wl_pointer *pointer,
+               uint32_t serial,
+               struct wl_surface *surface)
+{
+  PointerState *state = data;
+
+  state->entered = FALSE;
+}
+
+static void
+pointer_motion (void *data,
+                struct wl_pointer *pointer,
+                uint32_t time,
+                wl_fixed_t x,
+                wl_fixed_t y)
+{
+  PointerState *state = data;
+
+  state->x = wl_fixed_to_double (x);
+  state->y = wl_fixed_to_double (y);
+}
+
+static void
+pointer_button (void *data,
+                struct wl_pointer *pointer,
+                uint32_t serial,
+                uint32_t time,
+                uint32_t button,
+                uint32_t button_state)
+{
+}
+
+static void
+pointer_axis (void *data,
+              struct wl_pointer *pointer,
+              uint32_t time,
+              uint32_t axis,
+              wl_fixed_t value)
+{
+}
+
+static const struct wl_pointer_listener pointer_listener = {
+  pointer_enter,
+  pointer_leave,
+  pointer_motion,
+  pointer_button,
+  pointer_axis,
+};
+
+static void
+confined_pointer_confined (void *data,
+                           struct zwp_confined_pointer_v1 *confined_pointer)
+{
+  PointerState *state = data;
+
+  state->confined = TRUE;
+}
+
+static void
+confined_pointer_unconfined (void *data,
+                             struct zwp_confined_pointer_v1 *confined_pointer)
+{
+  PointerState *state = data;
+
+  state->confined = FALSE;
+}
+
+static const struct zwp_confined_pointer_v1_listener confined_pointer_listener = {
+  confined_pointer_confined,
+  confined_pointer_unconfined
+};
+
+static void
+xdg_surface_configure (void *data,
+                       struct xdg_surface *xdg_surface,
+                       int32_t width,
+                       int32_t height,
+                       struct wl_array *states,
+                       uint32_t serial)
+{
+  xdg_surface_ack_configure (xdg_surface, serial);
+}
+
+static void
+xdg_surface_close (void *data,
+                   struct xdg_surface *xdg_surface)
+{
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+  xdg_surface_configure,
+  xdg_surface_close
+};
+
+/* Sends motion to x, y in the coordinates of window */
+static void
+send_motion (TestClient *client,
+             GdkWindow  *window,
+             int         x,
+             int         y)
+{
+  GdkDevice *device;
+  GdkEvent *event;
+  int origin_x, origin_y;
+
+  device = gdk_seat_get_pointer (gdk_display_get_default_seat (gdk_window_get_display (window)));
+  gdk_window_get_origin (window, &origin_x, &origin_y);
+
+  event = gdk_event_new (GDK_MOTION_NOTIFY);
+  event->motion.window = g_object_ref (window);
+  event->motion.time = g_get_monotonic_time () / 1000;
+  event->motion.x = x;
+  event->motion.y = y;
+  event->motion.x_root = origin_x + x;
+  event->motion.y_root = origin_y + y;
+  gdk_event_set_device (event, device);
+
+  gtk_main_do_event (event);
+  gdk_event_free (event);
+
+  test_client_roundtrip (client);
+}
+
+static gboolean
+check_position (PointerState *state,
+                double        x,
+                double        y,
+                const char   *what)
+{
+  if (state->x == x && state->y == y)
+    return TRUE;
+
+  g_printerr ("%s: pointer at %g,%g, expected %g,%g\n", what, state->x, state->y, x, y);
+  return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+  WakefieldCompositor *compositor;
+  TestClient *client;
+  GtkWidget *toplevel;
+  struct wl_surface *surface;
+  struct xdg_surface *xdg_surface;
+  struct wl_buffer *buffer;
+  struct wl_pointer *pointer;
+  struct wl_region *region;
+  struct zwp_confined_pointer_v1 *confined_pointer;
+  struct wl_resource *server_surface = NULL;
+  PointerState state = { FALSE, };
+  GdkWindow *window;
+  GdkEvent *event;
+  double x, y;
+  int i;
+  gboolean ok = TRUE;
+
+  if (!gtk_init_check (&argc, &argv))
+    return 77;
+
+  toplevel = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+  gtk_window_set_default_size (GTK_WINDOW (toplevel), 200, 200);
+  compositor = wakefield_compositor_new ();
+  gtk_container_add (GTK_CONTAINER (toplevel), GTK_WIDGET (compositor));
+  gtk_widget_show_all (toplevel);
+
+  client = test_client_new (compositor);
+  if (client == NULL)
+    return 1;
+  if (client->seat == NULL || client->pointer_constraints == NULL)
+    {
+      g_printerr ("Missing globals\n");
+      return 1;
+    }
+
+  pointer = wl_seat_get_pointer (client->seat);
+  wl_pointer_add_listener (pointer, &pointer_listener, &state);
+
+  surface = wl_compositor_create_surface (client->compositor);
+  xdg_surface = xdg_shell_get_xdg_surface (client->shell, surface);
+  xdg_surface_add_listener (xdg_surface, &xdg_surface_listener, NULL);
+  test_client_roundtrip (client);
+
+  buffer = test_client_create_buffer (client, WIDTH, HEIGHT);
+  xdg_surface_set_window_geometry (xdg_surface, GEOMETRY_X, GEOMETRY_Y,
+                                   WIDTH - 2 * GEOMETRY_X, HEIGHT - 2 * GEOMETRY_Y);
+  wl_surface_attach (surface, buffer, 0, 0);
+  wl_surface_damage (surface, 0, 0, WIDTH, HEIGHT);
+  wl_surface_commit (surface);
+
+  region = wl_compositor_create_region (client->compositor);
+  wl_region_add (region, REGION_X, REGION_Y, REGION_SIZE, REGION_SIZE);
+  confined_pointer = zwp_pointer_constraints_v1_confine_pointer (client->pointer_constraints,
+                                                                 surface, pointer, region,
+                                                                 ZWP_POINTER_CONSTRAINTS_V1_LIFETIME_PERSISTENT);
+  zwp_confined_pointer_v1_add_listener (confined_pointer, &confined_pointer_listener, &state);
+  wl_region_destroy (region);
+
+  /* Wait for the toplevel and the surface to be shown */
+  for (i = 0; i < 100 && server_surface == NULL; i++)
+    {
+      test_client_roundtrip (client);
+      g_usleep (G_USEC_PER_SEC / 100);
+
+      x = 0;
+      y = 0;
+      if (gtk_widget_get_mapped (toplevel))
+        server_surface = wakefield_compositor_surface_at (compositor, &x, &y);
+    }
+
+  window = server_surface ? wakefield_surface_get_window (server_surface) : NULL;
+  if (window == NULL || !gdk_window_is_viewable (window))
+    {
+      g_printerr ("The surface was never shown\n");
+      return 1;
+    }
+
+  /* Constraints only activate with the keyboard focus */
+  gtk_widget_grab_focus (GTK_WIDGET (compositor));
+  event = gdk_event_new (GDK_FOCUS_CHANGE);
+  event->focus_change.window = g_object_ref (gtk_widget_get_window (toplevel));
+  event->focus_change.send_event = TRUE;
+  event->focus_change.in = TRUE;
+  gdk_event_set_device (event, gdk_seat_get_keyboard (gdk_display_get_default_seat (gdk_display_get_default ())));
+  gtk_main_do_event (event);
+  gdk_event_free (event);
+
+  /* Into the region, which activates the constraint */
+  send_motion (client, window, REGION_X - GEOMETRY_X + 10, REGION_Y - GEOMETRY_Y + 10);
+  if (!state.entered || !state.confined)
+    {
+      g_printerr ("The pointer was not confined\n");
+      return 1;
+    }
+  ok &= check_position (&state, REGION_X + 10, REGION_Y + 10, "Entering the region");
+
+  /* Out of it, to the window origin, which is clamped to the corner */
+  send_motion (client, window, 0, 0);
+  ok &= check_position (&state, REGION_X, REGION_Y, "Leaving the region");
+
+  /* Back in, at a point that is outside the region in window coordinates */
+  send_motion (client, window, REGION_X - GEOMETRY_X + 5, REGION_Y - GEOMETRY_Y + 5);
+  ok &= check_position (&state, REGION_X + 5, REGION_Y + 5, "Moving in the region");
+
+  zwp_confined_pointer_v1_destroy (confined_pointer);
+  wl_pointer_destroy (pointer);
+  xdg_surface_destroy (xdg_surface);
+  wl_surface_destroy (surface);
+  wl_buffer_destroy (buffer);
+  test_client_free (client);
+
+  gtk_widget_destroy (toplevel);
+
+  return ok ? 0 : 1;
+}